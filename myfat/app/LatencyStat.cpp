@@ -0,0 +1,118 @@
+
+#include "LatencyStat.h"
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <cstdio>
+
+using std::string;
+
+unsigned long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void drop_caches(bool enabled)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (-1 == fd || write(fd, "3", 1) != 1)
+    {
+        perror("drop_caches");
+    }
+    if (-1 != fd)
+    {
+        close(fd);
+    }
+}
+
+bool op_unsupported(int err)
+{
+    // VFS returns EPERM for an operation the file system leaves out
+    return EPERM == err || ENOSYS == err || EOPNOTSUPP == err;
+}
+
+void note_unsupported(const char *op, const string &dir)
+{
+    fprintf(stderr, "%s: not supported by the file system, not measured;"
+            " the files are left in %s\n", op, dir.c_str());
+}
+
+LatencyStat::LatencyStat():
+  m_total(0), m_errors(0), m_sorted(true)
+{
+}
+
+void LatencyStat::add(unsigned long long ns)
+{
+    m_samples.push_back(ns);
+    m_total += ns;
+    m_sorted = false;
+}
+
+void LatencyStat::merge(const LatencyStat &other)
+{
+    m_samples.insert(m_samples.end(), other.m_samples.begin(), other.m_samples.end());
+    m_total += other.m_total;
+    m_errors += other.m_errors;
+    m_sorted = m_samples.empty();
+}
+
+void LatencyStat::clear()
+{
+    m_samples.clear();
+    m_total = 0;
+    m_errors = 0;
+    m_sorted = true;
+}
+
+unsigned long long LatencyStat::percentile(double p)
+{
+    if (m_samples.empty())
+    {
+        return 0;
+    }
+    if (!m_sorted)
+    {
+        std::sort(m_samples.begin(), m_samples.end());
+        m_sorted = true;
+    }
+
+    // nearest rank
+    size_t rank = (size_t)(p / 100.0 * m_samples.size() + 0.5);
+    if (rank > 0)
+    {
+        --rank;
+    }
+    if (rank >= m_samples.size())
+    {
+        rank = m_samples.size() - 1;
+    }
+    return m_samples[rank];
+}
+
+string LatencyStat::csv_header()
+{
+    return "p50_us,p99_us,p999_us";
+}
+
+string LatencyStat::csv_row()
+{
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "%.1f,%.1f,%.1f",
+             percentile(50) / 1000.0, percentile(99) / 1000.0, percentile(99.9) / 1000.0);
+    return buf;
+}
+
@@ -0,0 +1,58 @@
+#ifndef _LATENCY_STAT_H
+#define _LATENCY_STAT_H
+
+#include <vector>
+#include <string>
+
+// monotonic time in nanoseconds
+unsigned long long now_ns();
+
+// sync and drop the page/dentry/inode caches (needs root), so that the
+// next operations reach the file system; does nothing if !enabled
+void drop_caches(bool enabled);
+
+// err (errno) says the file system doesn't have the operation at all
+bool op_unsupported(int err);
+
+// the note on stderr when a tool leaves op out
+void note_unsupported(const char *op, const std::string &dir);
+
+/*
+ * latencies of one kind of operation, used by the benchmark tools
+ * All samples are kept so that percentiles are exact.
+ */
+class LatencyStat
+{
+public:
+    LatencyStat();
+
+    void add(unsigned long long ns);
+    void add_error() { ++m_errors; }
+
+    // put the samples of other into this one
+    void merge(const LatencyStat &other);
+
+    void clear();
+
+    size_t count() const { return m_samples.size(); }
+    unsigned long errors() const { return m_errors; }
+
+    // sum of all samples in ns
+    unsigned long long total() const { return m_total; }
+
+    // p in [0, 100], e.g. 99.9; 0 if there is no sample
+    unsigned long long percentile(double p);
+
+    // "p50_us,p99_us,p999_us" as printed by csv_row
+    static std::string csv_header();
+    std::string csv_row();
+
+private:
+    std::vector<unsigned long long> m_samples;
+    unsigned long long m_total;
+    unsigned long m_errors;
+    bool m_sorted;
+};
+
+#endif
+
@@ -0,0 +1,255 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>  // for exit
+
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "LatencyStat.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+/*
+ * dirscale: cost of directory operations as the directory grows
+ *
+ *   dirscale [-k samples] [-R readdir rounds] [-d] <directory> [size ...]
+ *
+ * <directory> is filled step by step up to every size (default 10 100 1000
+ * 10000 50000). At each size it measures
+ *   create:      the creates which grew the directory to this size
+ *   lookup_hit:  stat of <samples> random existing names
+ *   lookup_miss: stat of <samples> names which don't exist
+ *   readdir:     <rounds> scans of the whole directory
+ *   unlink:      unlink of <samples> random names (created again untimed)
+ * and prints CSV on stdout: size,op,ops,errors,mean_us,p50_us,p99_us,p999_us.
+ * All the files are removed at the end. -d drops the caches before each
+ * measurement (needs root) so that the operations reach the file system.
+ * Only plain POSIX calls are used, so it runs on any file system.
+ */
+
+struct Options
+{
+    string dir;
+    long samples;
+    long readdir_rounds;
+    bool drop_caches;
+};
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " [-k samples] [-R readdir rounds] [-d] <directory> [size ...]" << endl;
+    exit(1);
+}
+
+static string file_name(const Options &opt, char prefix, long i)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%c%06ld", prefix, i);
+    return opt.dir + "/" + buf;
+}
+
+static bool create_file(const string &name)
+{
+    int fd = open(name.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (-1 == fd)
+    {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static void print_row(long size, const char *op, LatencyStat &lat)
+{
+    printf("%ld,%s,%lu,%lu,%.1f,%s\n", size, op, (unsigned long)lat.count(), lat.errors(),
+           lat.count()? lat.total() / 1000.0 / lat.count(): 0.0, lat.csv_row().c_str());
+    fflush(stdout);
+}
+
+static void measure_lookup(const Options &opt, long size, const char *op, char prefix,
+                           bool expect)
+{
+    LatencyStat lat;
+    struct stat st;
+
+    drop_caches(opt.drop_caches);
+    for (long i = 0; i < opt.samples; ++i)
+    {
+        string name = file_name(opt, prefix, expect? random() % size: size + i);
+        unsigned long long t = now_ns();
+        int ret = stat(name.c_str(), &st);
+        unsigned long long d = now_ns() - t;
+        if ((0 == ret) != expect)
+        {
+            lat.add_error();
+            continue;
+        }
+        lat.add(d);
+    }
+    print_row(size, op, lat);
+}
+
+static void measure_readdir(const Options &opt, long size)
+{
+    LatencyStat lat;
+
+    for (long r = 0; r < opt.readdir_rounds; ++r)
+    {
+        drop_caches(opt.drop_caches);
+        unsigned long long t = now_ns();
+        DIR *d = opendir(opt.dir.c_str());
+        if (!d)
+        {
+            lat.add_error();
+            continue;
+        }
+        while (readdir(d))
+        {
+        }
+        closedir(d);
+        lat.add(now_ns() - t);
+    }
+    print_row(size, "readdir", lat);
+}
+
+// the file system has no unlink, see op_unsupported
+static bool unlink_unsupported = false;
+
+static void measure_unlink(const Options &opt, long size)
+{
+    LatencyStat lat;
+    vector<long> victims;
+
+    if (unlink_unsupported)
+    {
+        return;
+    }
+
+    // distinct names, otherwise the second unlink of a name fails
+    for (long i = 0; i < opt.samples && i < size; ++i)
+    {
+        victims.push_back(i * size / (opt.samples < size? opt.samples: size));
+    }
+
+    drop_caches(opt.drop_caches);
+    for (size_t i = 0; i < victims.size(); ++i)
+    {
+        string name = file_name(opt, 'f', victims[i]);
+        unsigned long long t = now_ns();
+        if (unlink(name.c_str()))
+        {
+            if (0 == i && op_unsupported(errno))
+            {
+                note_unsupported("unlink", opt.dir);
+                unlink_unsupported = true;
+                return;
+            }
+            lat.add_error();
+            continue;
+        }
+        lat.add(now_ns() - t);
+    }
+    print_row(size, "unlink", lat);
+
+    // keep the size for the next step
+    for (size_t i = 0; i < victims.size(); ++i)
+    {
+        create_file(file_name(opt, 'f', victims[i]));
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    Options opt;
+    opt.samples = 100;
+    opt.readdir_rounds = 5;
+    opt.drop_caches = false;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "k:R:d")) != -1)
+    {
+        switch (c)
+        {
+        case 'k': opt.samples = atol(optarg); break;
+        case 'R': opt.readdir_rounds = atol(optarg); break;
+        case 'd': opt.drop_caches = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || opt.samples <= 0 || opt.readdir_rounds <= 0)
+    {
+        usage(argv[0]);
+    }
+    opt.dir = argv[optind++];
+
+    vector<long> sizes;
+    for (; optind < argc; ++optind)
+    {
+        long s = atol(argv[optind]);
+        if (s <= 0 || s > 999999 || (!sizes.empty() && s <= sizes.back()))
+        {
+            cerr << "sizes must be increasing and in [1, 999999]" << endl;
+            return 1;
+        }
+        sizes.push_back(s);
+    }
+    if (sizes.empty())
+    {
+        long def[] = {10, 100, 1000, 10000, 50000};
+        sizes.assign(def, def + sizeof(def) / sizeof(def[0]));
+    }
+
+    srandom(1);
+    printf("size,op,ops,errors,mean_us,%s\n", LatencyStat::csv_header().c_str());
+
+    long cur = 0;  // files in the directory
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        LatencyStat lat;
+        for (; cur < sizes[s]; ++cur)
+        {
+            string name = file_name(opt, 'f', cur);
+            unsigned long long t = now_ns();
+            if (!create_file(name))
+            {
+                lat.add_error();
+                continue;
+            }
+            lat.add(now_ns() - t);
+        }
+        print_row(sizes[s], "create", lat);
+        if (lat.errors())
+        {
+            cerr << "create failed at size " << sizes[s] << ": " << strerror(errno) << endl;
+            break;
+        }
+
+        measure_lookup(opt, sizes[s], "lookup_hit", 'f', true);
+        measure_lookup(opt, sizes[s], "lookup_miss", 'f', false);
+        measure_readdir(opt, sizes[s]);
+        measure_unlink(opt, sizes[s]);
+    }
+
+    if (unlink_unsupported)
+    {
+        return 0;
+    }
+    for (long i = 0; i < cur; ++i)
+    {
+        unlink(file_name(opt, 'f', i).c_str());
+    }
+    return 0;
+}
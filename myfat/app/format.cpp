@@ -14,6 +14,7 @@
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <exception>
 #include <cerrno>
 
@@ -25,6 +26,7 @@ using std::cout;
 using std::cin;
 using std::endl;
 using std::string;
+using std::vector;
 using std::exception;
 
 #define ELE_BLOCK_SZ 512
@@ -54,7 +56,52 @@ int main (int argc, char *argv[])
         name = argv[1];
     }
 
+    // no. of hash buckets the root directory starts with, the kernel adds
+    // more as it grows
+    // 0 => linear root directory, which stays linear
+    // subdirectories are hashed by the kernel once they are large either way
+    int buckets = 0;
+    if (argc >= 3)
+    {
+        buckets = atoi(argv[2]);
+        if (buckets < 0 || buckets > SFAT_DIR_MAX_BUCKETS)
+        {
+            cerr << "no. of buckets must be in [0, " << SFAT_DIR_MAX_BUCKETS << "]" << endl;
+            return 1;
+        }
+    }
+
+    // no. of sectors of the metadata journal, placed after the reserved sectors
+    // 0 => no journal
+    int journal = 0;
+    if (argc >= 4)
+    {
+        journal = atoi(argv[3]);
+        if (journal != 0 && (journal < SFAT_JOURNAL_MIN_BLOCKS || journal > 0xffff - RESERVE_SECTORS))
+        {
+            cerr << "no. of journal sectors must be 0 or in [" << SFAT_JOURNAL_MIN_BLOCKS
+                 << ", " << 0xffff - RESERVE_SECTORS << "]" << endl;
+            return 1;
+        }
+    }
+    size_t reserved = RESERVE_SECTORS + journal;
+
+    // 1 => files over 4GB (v2 layout, extended directory entries)
+    int largefile = 0;
+    if (argc >= 5)
+    {
+        largefile = atoi(argv[4]);
+        if (largefile != 0 && largefile != 1)
+        {
+            cerr << "largefile must be 0 or 1" << endl;
+            return 1;
+        }
+    }
+
     cout << "file name: " << name << endl;
+    cout << "root buckets: " << buckets << endl;
+    cout << "journal sectors: " << journal << endl;
+    cout << "large files: " << largefile << endl;
     // cin >> str;
 
     try
@@ -71,7 +118,7 @@ int main (int argc, char *argv[])
         size_t sectors = bdev.getsize() / (BYTES_PER_SECTOR / blk_sector_sz);  // at most 2^32 - 1 sectors
                                                                             // no. of sectors for fat
 
-        size_t clusters = (sectors - 1 /*super_sector*/ - RESERVE_SECTORS) / SECTORS_PER_CLUSTER;
+        size_t clusters = (sectors - 1 /*super_sector*/ - reserved) / SECTORS_PER_CLUSTER;
         if (clusters > SFAT_ENTRY_MAX)
         {
         	clusters = SFAT_ENTRY_MAX;  // only support part of the hard disk
@@ -91,21 +138,53 @@ int main (int argc, char *argv[])
         super_sector.media = SFAT_MEDIA;
         super_sector.sector_size = static_cast<__le16>(BYTES_PER_SECTOR);  // todo: use better 
         super_sector.sec_per_clus = SECTORS_PER_CLUSTER;
-        super_sector.reserved = static_cast<__le16>(RESERVE_SECTORS);
+        super_sector.reserved = static_cast<__le16>(reserved);
         super_sector.fat_length = static_cast<__le32>(fat_length_sectors);
         super_sector.fats = SFAT_NO;
 
         super_sector.sectors = static_cast<__le32>(sectors);
         super_sector.clusters = static_cast<__le32>(clusters);
 
+        // a hashed root is its index (cluster 0 ~ index_clusters - 1) and
+        // the first cluster of each bucket after it
+        size_t cluster_bytes = SECTORS_PER_CLUSTER * BYTES_PER_SECTOR;
+        size_t index_clusters = 1;
+        if (buckets > 0)
+        {
+            index_clusters = (SFAT_DIR_INDEX_SIZE(buckets) + cluster_bytes - 1) / cluster_bytes;
+        }
+        size_t root_clusters = index_clusters + buckets;
+
         // starting cluster of root is 0
         super_sector.root_start = static_cast<__le32>(0);
-        // size of root is 1 cluster
-        super_sector.root_size = static_cast<__le32>(1);
+        super_sector.root_size = static_cast<__le32>(root_clusters);
+
+        super_sector.signature = static_cast<__le32>(SFAT_BOOT_SIGNATURE);
+
+        super_sector.version = SFAT_FORMAT_V2;
+        super_sector.features = static_cast<__le32>(SFAT_FEATURE_HASHDIR);
+        super_sector.root_buckets = static_cast<__le16>(buckets);
+
+        if (journal > 0)
+        {
+            super_sector.version = SFAT_FORMAT_V2;
+            super_sector.features = static_cast<__le32>(super_sector.features | SFAT_FEATURE_JOURNAL);
+            super_sector.journal_start = static_cast<__le32>(1 + RESERVE_SECTORS);
+            super_sector.journal_length = static_cast<__le32>(journal);
+        }
+
+        if (largefile)
+        {
+            super_sector.version = SFAT_FORMAT_V2;
+            super_sector.features = static_cast<__le32>(super_sector.features | SFAT_FEATURE_LARGEFILE);
+        }
         
+        // the whole sector, nothing left of an older format
         cout << "size of struct is " << sizeof(sfat_boot_sector) << endl;
-        ssize_t ret = bdev.write(&super_sector, sizeof(sfat_boot_sector));
-        if (ret < sizeof(sfat_boot_sector))
+        char boot_block[BYTES_PER_SECTOR] = {};
+        memcpy(boot_block, &super_sector, sizeof(sfat_boot_sector));
+        ssize_t ret = bdev.write(boot_block, BYTES_PER_SECTOR);
+        if (ret < BYTES_PER_SECTOR)
         {
             cerr << "write failed, errno is " << errno << " , info is: " << 
                 strerror(errno) << endl;
@@ -115,9 +194,36 @@ int main (int argc, char *argv[])
         #define ROUND_SIZE 512  // we write 512 bytes each time
         #define ENTRIES (ROUND_SIZE / sizeof(__le32))
 
+        off_t oft = 0;
+        if (journal > 0)
+        {
+            // an empty log, the first transaction will have seq 1
+            char jblock[ROUND_SIZE] = {};
+            struct sfat_journal_super *js = reinterpret_cast<sfat_journal_super *>(jblock);
+            js->h.magic = static_cast<__le32>(SFAT_JOURNAL_MAGIC);
+            js->h.type = static_cast<__le32>(SFAT_JOURNAL_SUPER);
+            js->h.seq = static_cast<__le32>(1);
+            js->flags = static_cast<__le32>(SFAT_JOURNAL_CLEAN);
+
+            oft = bdev.lset((1 + RESERVE_SECTORS) * BYTES_PER_SECTOR);
+            if (oft == static_cast<off_t>(-1))
+            {
+                cerr << "lset failed, errno is " << errno << " , info is: " <<
+                    strerror(errno) << endl;
+                throw std::runtime_error("lset error");
+            }
+            ret = bdev.write(jblock, ROUND_SIZE);
+            if (ret < ROUND_SIZE)
+            {
+                cerr << "write failed, errno is " << errno << " , info is: " <<
+                    strerror(errno) << endl;
+                throw std::runtime_error("write error");
+            }
+        }
+
         cout << "ENTRIES is " << ENTRIES << endl;
         // preparing to write the fat table
-        off_t oft = bdev.lset((1 + RESERVE_SECTORS) * BYTES_PER_SECTOR);
+        oft = bdev.lset((1 + reserved) * BYTES_PER_SECTOR);
         if (oft == static_cast<off_t>(-1))
         {
             cerr << "lset failed, errno is " << errno << " , info is: " << 
@@ -138,20 +244,26 @@ int main (int argc, char *argv[])
 
         for (int i = 0; i < SFAT_NO; ++i)
         {
-            // root dir consumes only one cluster
-            fat_block[0] = static_cast<__le32>(SFAT_ENTRY_EOC);  
-
-            ssize_t ret = bdev.write(fat_block, ROUND_SIZE);
-            if (ret < ROUND_SIZE)
+            for (size_t cur_round = 0; cur_round < rounds; ++cur_round)
             {
-                cerr << "write failed, errno is " << errno << " , info is: " << 
-                    strerror(errno) << endl;
-                throw std::runtime_error("write error");
-            }
+                // the index chain of root, then a cluster for each bucket
+                for (size_t e = 0; e < ENTRIES; ++e)
+                {
+                    size_t c = cur_round * ENTRIES + e;
+                    if (c + 1 < index_clusters)
+                    {
+                        fat_block[e] = static_cast<__le32>(c + 1);
+                    }
+                    else if (c < root_clusters)
+                    {
+                        fat_block[e] = static_cast<__le32>(SFAT_ENTRY_EOC);
+                    }
+                    else
+                    {
+                        fat_block[e] = static_cast<__le32>(SFAT_ENTRY_FREE);
+                    }
+                }
 
-            fat_block[0] = static_cast<__le32>(SFAT_ENTRY_FREE);  
-            for (size_t cur_round = 1; cur_round < rounds; ++cur_round)
-            {
                 ssize_t ret = bdev.write(fat_block, ROUND_SIZE);
                 if (ret < ROUND_SIZE)
                 {
@@ -162,16 +274,57 @@ int main (int argc, char *argv[])
             }
         }
 
-        // write the dir entry of root, which is adject to FAT table
+        // the clusters of root, which are adjacent to the FAT table
+        off_t data_start = (1 + reserved + SFAT_NO * fat_length_sectors) * BYTES_PER_SECTOR;
         struct sfat_dir_entry *pDirEntry = reinterpret_cast<sfat_dir_entry *>(fat_block);
-        pDirEntry->attr = SFAT_ATTR_EMPTY_END;
 
-        ret = bdev.write(fat_block, ROUND_SIZE);
-        if (ret < ROUND_SIZE)
+        if (buckets > 0)
         {
-            cerr << "write failed, errno is " << errno << " , info is: " << 
-                strerror(errno) << endl;
-            throw std::runtime_error("write error");
+            // the index, bucket b starts at cluster index_clusters + b
+            vector<char> index(index_clusters * cluster_bytes, 0);
+            struct sfat_dir_index *pIndex = reinterpret_cast<sfat_dir_index *>(&index[0]);
+            pIndex->magic = static_cast<__le32>(SFAT_DIR_INDEX_MAGIC);
+            pIndex->buckets = static_cast<__le32>(buckets);
+            for (int b = 0; b < buckets; ++b)
+            {
+                pIndex->bucket[b] = static_cast<__le32>(index_clusters + b);
+            }
+
+            oft = bdev.lset(data_start);
+            if (oft == static_cast<off_t>(-1))
+            {
+                cerr << "lset failed, errno is " << errno << " , info is: " <<
+                    strerror(errno) << endl;
+                throw std::runtime_error("lset error");
+            }
+            ret = bdev.write(&index[0], index.size());
+            if (ret < static_cast<ssize_t>(index.size()))
+            {
+                cerr << "write failed, errno is " << errno << " , info is: " <<
+                    strerror(errno) << endl;
+                throw std::runtime_error("write error");
+            }
+        }
+
+        // a linear root, or each bucket, starts as an empty chain of one cluster
+        memset(fat_block, 0, sizeof(fat_block));
+        pDirEntry->attr = SFAT_ATTR_EMPTY_END;
+        for (size_t c = (buckets > 0)? index_clusters: 0; c < root_clusters; ++c)
+        {
+            oft = bdev.lset(data_start + c * cluster_bytes);
+            if (oft == static_cast<off_t>(-1))
+            {
+                cerr << "lset failed, errno is " << errno << " , info is: " <<
+                    strerror(errno) << endl;
+                throw std::runtime_error("lset error");
+            }
+            ret = bdev.write(fat_block, ROUND_SIZE);
+            if (ret < ROUND_SIZE)
+            {
+                cerr << "write failed, errno is " << errno << " , info is: " <<
+                    strerror(errno) << endl;
+                throw std::runtime_error("write error");
+            }
         }
 
         bdev.lset(0);
@@ -190,8 +343,8 @@ int main (int argc, char *argv[])
         bdev.lset(0);
 
 
-        bdev.lset((1 + RESERVE_SECTORS) * BYTES_PER_SECTOR);
-        cout << "fat table starts at " << std::dec << (1 + RESERVE_SECTORS) * BYTES_PER_SECTOR << endl;
+        bdev.lset((1 + reserved) * BYTES_PER_SECTOR);
+        cout << "fat table starts at " << std::dec << (1 + reserved) * BYTES_PER_SECTOR << endl;
         cout << "sizeof(fat_block) is " << std::dec << sizeof(fat_block) << endl;
         ret = bdev.read(fat_block, sizeof(fat_block));
         if (ret < sizeof(fat_block))
@@ -0,0 +1,192 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>  // for ioctl
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>  // for exit
+
+#include <linux/types.h>
+
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../simplefat/sfat_fs.h"
+#include "LatencyStat.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+/*
+ * sfatbatch: bulk creation of files on a mounted simplefat volume
+ *
+ *   sfatbatch [-n files] [-b batch] [-s file size] [-o] <directory>
+ *
+ * Creates <files> files (default 10000) of <file size> bytes (default 0)
+ * in <directory> by SFAT_IOCTL_CREATE_BATCH, <batch> files per call
+ * (default SFAT_BATCH_MAX_FILES). With -o the same files are created by
+ * open/write/close instead, for comparison. The names are short (8.3).
+ * stdout gets CSV: mode,files,created,errors,seconds,files_per_sec,
+ * with the per call latencies (in us) after it.
+ */
+
+struct Options
+{
+    string dir;
+    long files;
+    long batch;
+    long file_size;
+    bool by_open;
+};
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " [-n files] [-b batch] [-s file size] [-o] <directory>" << endl;
+    exit(1);
+}
+
+static void file_name(long i, char *buf, size_t len)
+{
+    snprintf(buf, len, "b%07ld", i);
+}
+
+// one call of the ioctl for files [first, first + n)
+static bool create_batch(int dfd, const Options &opt, const vector<char> &data,
+                         long first, long n, long *created, long *errors)
+{
+    vector<struct sfat_batch_file> files(n);
+    struct sfat_ioctl_batch req;
+
+    memset(&files[0], 0, n * sizeof(files[0]));
+    for (long i = 0; i < n; ++i)
+    {
+        file_name(first + i, files[i].name, sizeof(files[i].name));
+        files[i].data = opt.file_size? (__u64)(unsigned long)&data[0]: 0;
+        files[i].size = opt.file_size;
+    }
+    memset(&req, 0, sizeof(req));
+    req.files = (__u64)(unsigned long)&files[0];
+    req.count = n;
+
+    if (ioctl(dfd, SFAT_IOCTL_CREATE_BATCH, &req) < 0)
+    {
+        perror("SFAT_IOCTL_CREATE_BATCH");
+        return false;
+    }
+    *created += req.created;
+    for (long i = 0; i < n; ++i)
+    {
+        if (files[i].error)
+        {
+            ++*errors;
+        }
+    }
+    return true;
+}
+
+static bool create_open(const Options &opt, const vector<char> &data, long i,
+                        long *created, long *errors)
+{
+    char name[SFAT_BATCH_NAME_LEN];
+
+    file_name(i, name, sizeof(name));
+    string path = opt.dir + "/" + name;
+    int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (-1 == fd)
+    {
+        ++*errors;
+        return true;
+    }
+    if (opt.file_size && write(fd, &data[0], data.size()) != (ssize_t)data.size())
+    {
+        ++*errors;
+    }
+    else
+    {
+        ++*created;
+    }
+    close(fd);
+    return true;
+}
+
+int main (int argc, char *argv[])
+{
+    Options opt;
+    opt.files = 10000;
+    opt.batch = SFAT_BATCH_MAX_FILES;
+    opt.file_size = 0;
+    opt.by_open = false;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "n:b:s:o")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': opt.files = atol(optarg); break;
+        case 'b': opt.batch = atol(optarg); break;
+        case 's': opt.file_size = atol(optarg); break;
+        case 'o': opt.by_open = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || opt.files <= 0 || opt.batch <= 0
+        || opt.batch > SFAT_BATCH_MAX_FILES || opt.file_size < 0
+        || opt.file_size * opt.batch > SFAT_BATCH_MAX_DATA)
+    {
+        usage(argv[0]);
+    }
+    opt.dir = argv[optind];
+
+    int dfd = open(opt.dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (-1 == dfd)
+    {
+        cerr << "open " << opt.dir << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    vector<char> data(opt.file_size? opt.file_size: 1, 'x');
+    LatencyStat lat;
+    long created = 0;
+    long errors = 0;
+    unsigned long long begin = now_ns();
+
+    for (long first = 0; first < opt.files; first += opt.batch)
+    {
+        long n = opt.files - first < opt.batch? opt.files - first: opt.batch;
+        unsigned long long t = now_ns();
+        bool ok = true;
+        if (opt.by_open)
+        {
+            for (long i = first; i < first + n && ok; ++i)
+            {
+                ok = create_open(opt, data, i, &created, &errors);
+            }
+        }
+        else
+        {
+            ok = create_batch(dfd, opt, data, first, n, &created, &errors);
+        }
+        if (!ok)
+        {
+            close(dfd);
+            return 1;
+        }
+        lat.add(now_ns() - t);
+    }
+
+    double secs = (now_ns() - begin) / 1e9;
+    close(dfd);
+
+    printf("mode,files,created,errors,seconds,files_per_sec,%s\n", LatencyStat::csv_header().c_str());
+    printf("%s,%ld,%ld,%ld,%.3f,%.1f,%s\n", opt.by_open? "open": "batch",
+           opt.files, created, errors, secs, secs > 0? created / secs: 0.0,
+           lat.csv_row().c_str());
+    return 0;
+}
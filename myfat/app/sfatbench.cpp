@@ -0,0 +1,376 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>  // for exit
+
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "LatencyStat.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+/*
+ * sfatbench: timed phases against a mounted file system, no input needed
+ *
+ *   sfatbench [-n files] [-s file size] [-b io size] [-r random reads]
+ *             [-R readdir rounds] [-d] <directory>
+ *
+ * The phases run in order in <directory>: create, stat, lookup_hit,
+ * lookup_miss, readdir, seq_write, seq_read, rand_read, unlink.
+ * stdout gets one CSV line per phase, progress and errors go to stderr.
+ * File names are short (8.3) so that simplefat and msdos take them alike.
+ * -d drops the page/dentry/inode caches before each phase (needs root),
+ * so that lookups and reads reach the file system.
+ */
+
+struct Options
+{
+    string dir;
+    long files;
+    long file_size;
+    long io_size;
+    long rand_reads;
+    long readdir_rounds;
+    bool drop_caches;
+};
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " [-n files] [-s file size] [-b io size] [-r random reads]"
+         << " [-R readdir rounds] [-d] <directory>" << endl;
+    exit(1);
+}
+
+static string file_name(const Options &opt, const char *prefix, long i)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%s%06ld", prefix, i);
+    return opt.dir + "/" + buf;
+}
+
+static void print_header()
+{
+    printf("phase,ops,errors,secs,ops_per_sec,mb_per_sec,%s\n", LatencyStat::csv_header().c_str());
+}
+
+/*
+ * bytes: data moved by the phase, 0 if it isn't about data
+ */
+static void print_phase(const char *phase, LatencyStat &lat, unsigned long long elapsed_ns,
+                        unsigned long long bytes)
+{
+    double secs = elapsed_ns / 1e9;
+
+    printf("%s,%lu,%lu,%.6f,%.1f,%.2f,%s\n", phase,
+           (unsigned long)lat.count(), lat.errors(), secs,
+           secs > 0? lat.count() / secs: 0.0,
+           secs > 0? bytes / secs / (1024 * 1024): 0.0,
+           lat.csv_row().c_str());
+    fflush(stdout);
+}
+
+static void phase_create(const Options &opt)
+{
+    LatencyStat lat;
+    unsigned long long begin = now_ns();
+
+    for (long i = 0; i < opt.files; ++i)
+    {
+        string name = file_name(opt, "b", i);
+        unsigned long long t = now_ns();
+        int fd = open(name.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (-1 == fd)
+        {
+            lat.add_error();
+            continue;
+        }
+        close(fd);
+        lat.add(now_ns() - t);
+    }
+    print_phase("create", lat, now_ns() - begin, 0);
+}
+
+static void phase_stat(const Options &opt, const char *phase, const char *prefix, bool expect)
+{
+    LatencyStat lat;
+    struct stat st;
+
+    drop_caches(opt.drop_caches);
+    unsigned long long begin = now_ns();
+    for (long i = 0; i < opt.files; ++i)
+    {
+        string name = file_name(opt, prefix, i);
+        unsigned long long t = now_ns();
+        int ret = stat(name.c_str(), &st);
+        unsigned long long d = now_ns() - t;
+        if ((0 == ret) != expect)
+        {
+            lat.add_error();
+            continue;
+        }
+        lat.add(d);
+    }
+    print_phase(phase, lat, now_ns() - begin, 0);
+}
+
+// open and close every file in a shuffled order
+static void phase_lookup_hit(const Options &opt)
+{
+    LatencyStat lat;
+    vector<long> order;
+
+    for (long i = 0; i < opt.files; ++i)
+    {
+        order.push_back(i);
+    }
+    for (long i = opt.files - 1; i > 0; --i)
+    {
+        std::swap(order[i], order[random() % (i + 1)]);
+    }
+
+    drop_caches(opt.drop_caches);
+    unsigned long long begin = now_ns();
+    for (long i = 0; i < opt.files; ++i)
+    {
+        string name = file_name(opt, "b", order[i]);
+        unsigned long long t = now_ns();
+        int fd = open(name.c_str(), O_RDONLY);
+        if (-1 == fd)
+        {
+            lat.add_error();
+            continue;
+        }
+        close(fd);
+        lat.add(now_ns() - t);
+    }
+    print_phase("lookup_hit", lat, now_ns() - begin, 0);
+}
+
+// one op is a scan of the whole directory
+static void phase_readdir(const Options &opt)
+{
+    LatencyStat lat;
+    unsigned long entries = 0;
+
+    drop_caches(opt.drop_caches);
+    unsigned long long begin = now_ns();
+    for (long r = 0; r < opt.readdir_rounds; ++r)
+    {
+        unsigned long long t = now_ns();
+        DIR *d = opendir(opt.dir.c_str());
+        if (!d)
+        {
+            lat.add_error();
+            continue;
+        }
+        unsigned long n = 0;
+        while (readdir(d))
+        {
+            ++n;
+        }
+        closedir(d);
+        lat.add(now_ns() - t);
+        entries = n;
+    }
+    print_phase("readdir", lat, now_ns() - begin, 0);
+    cerr << "readdir: " << entries << " entries" << endl;
+}
+
+static void phase_seq_write(const Options &opt, vector<char> &buf)
+{
+    LatencyStat lat;
+    unsigned long long bytes = 0;
+    string name = file_name(opt, "s", 0);
+
+    unsigned long long begin = now_ns();
+    int fd = open(name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (-1 == fd)
+    {
+        perror(name.c_str());
+        lat.add_error();
+        print_phase("seq_write", lat, now_ns() - begin, 0);
+        return;
+    }
+    for (long done = 0; done < opt.file_size; done += opt.io_size)
+    {
+        size_t len = opt.file_size - done < opt.io_size? opt.file_size - done: opt.io_size;
+        unsigned long long t = now_ns();
+        ssize_t ret = write(fd, &buf[0], len);
+        if (ret <= 0)
+        {
+            lat.add_error();
+            break;
+        }
+        lat.add(now_ns() - t);
+        bytes += ret;
+    }
+    fsync(fd);
+    close(fd);
+    print_phase("seq_write", lat, now_ns() - begin, bytes);
+}
+
+static void phase_seq_read(const Options &opt, vector<char> &buf)
+{
+    LatencyStat lat;
+    unsigned long long bytes = 0;
+    string name = file_name(opt, "s", 0);
+
+    drop_caches(opt.drop_caches);
+    unsigned long long begin = now_ns();
+    int fd = open(name.c_str(), O_RDONLY);
+    if (-1 == fd)
+    {
+        lat.add_error();
+        print_phase("seq_read", lat, now_ns() - begin, 0);
+        return;
+    }
+    for (;;)
+    {
+        unsigned long long t = now_ns();
+        ssize_t ret = read(fd, &buf[0], opt.io_size);
+        if (ret < 0)
+        {
+            lat.add_error();
+            break;
+        }
+        if (0 == ret)
+        {
+            break;
+        }
+        lat.add(now_ns() - t);
+        bytes += ret;
+    }
+    close(fd);
+    print_phase("seq_read", lat, now_ns() - begin, bytes);
+    if ((long)bytes != opt.file_size)
+    {
+        cerr << "seq_read: " << bytes << " of " << opt.file_size << " bytes read" << endl;
+    }
+}
+
+static void phase_rand_read(const Options &opt, vector<char> &buf)
+{
+    LatencyStat lat;
+    unsigned long long bytes = 0;
+    string name = file_name(opt, "s", 0);
+    long slots = opt.file_size / opt.io_size;
+
+    drop_caches(opt.drop_caches);
+    unsigned long long begin = now_ns();
+    int fd = open(name.c_str(), O_RDONLY);
+    if (-1 == fd || slots <= 0)
+    {
+        lat.add_error();
+        if (-1 != fd)
+        {
+            close(fd);
+        }
+        print_phase("rand_read", lat, now_ns() - begin, 0);
+        return;
+    }
+    for (long i = 0; i < opt.rand_reads; ++i)
+    {
+        off_t off = (off_t)(random() % slots) * opt.io_size;
+        unsigned long long t = now_ns();
+        ssize_t ret = pread(fd, &buf[0], opt.io_size, off);
+        if (ret < 0)
+        {
+            lat.add_error();
+            continue;
+        }
+        lat.add(now_ns() - t);
+        bytes += ret;
+    }
+    close(fd);
+    print_phase("rand_read", lat, now_ns() - begin, bytes);
+}
+
+static void phase_unlink(const Options &opt)
+{
+    LatencyStat lat;
+
+    unsigned long long begin = now_ns();
+    for (long i = 0; i < opt.files; ++i)
+    {
+        string name = file_name(opt, "b", i);
+        unsigned long long t = now_ns();
+        if (unlink(name.c_str()))
+        {
+            if (0 == i && op_unsupported(errno))
+            {
+                note_unsupported("unlink", opt.dir);
+                return;
+            }
+            lat.add_error();
+            continue;
+        }
+        lat.add(now_ns() - t);
+    }
+    unlink(file_name(opt, "s", 0).c_str());
+    print_phase("unlink", lat, now_ns() - begin, 0);
+}
+
+int main (int argc, char *argv[])
+{
+    Options opt;
+    opt.files = 1000;
+    opt.file_size = 1024 * 1024;
+    opt.io_size = 4096;
+    opt.rand_reads = 1000;
+    opt.readdir_rounds = 10;
+    opt.drop_caches = false;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "n:s:b:r:R:d")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': opt.files = atol(optarg); break;
+        case 's': opt.file_size = atol(optarg); break;
+        case 'b': opt.io_size = atol(optarg); break;
+        case 'r': opt.rand_reads = atol(optarg); break;
+        case 'R': opt.readdir_rounds = atol(optarg); break;
+        case 'd': opt.drop_caches = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || opt.files <= 0 || opt.files > 999999
+        || opt.file_size <= 0 || opt.io_size <= 0)
+    {
+        usage(argv[0]);
+    }
+    opt.dir = argv[optind];
+
+    cerr << "directory: " << opt.dir << ", files: " << opt.files
+         << ", file size: " << opt.file_size << ", io size: " << opt.io_size << endl;
+
+    vector<char> buf(opt.io_size, 'x');
+    srandom(1);
+
+    print_header();
+    phase_create(opt);
+    phase_stat(opt, "stat", "b", true);
+    phase_lookup_hit(opt);
+    phase_stat(opt, "lookup_miss", "m", false);
+    phase_readdir(opt);
+    phase_seq_write(opt, buf);
+    phase_seq_read(opt, buf);
+    phase_rand_read(opt, buf);
+    phase_unlink(opt);
+
+    return 0;
+}
@@ -0,0 +1,488 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>  // for exit
+
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "LatencyStat.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::map;
+using std::ifstream;
+using std::istringstream;
+
+/*
+ * sfatreplay: replay a recorded syscall trace against a mount point
+ *
+ *   sfatreplay [-t threads] [-l loops] <trace> <mount point>
+ *
+ * Trace format (text, one call per line, '#' starts a comment):
+ *   <tid> open <fd> <path> <flags>    flags: r | w | rw, followed by any of
+ *                                       c (create), t (trunc), a (append), x (excl)
+ *   <tid> read <fd> <len>
+ *   <tid> write <fd> <len>
+ *   <tid> pread <fd> <len> <offset>
+ *   <tid> pwrite <fd> <len> <offset>
+ *   <tid> lseek <fd> <offset> <set | cur | end>
+ *   <tid> close <fd>
+ *   <tid> mkdir <path>
+ *   <tid> unlink <path>
+ *   <tid> rename <old path> <new path>
+ * tid and fd are the ones of the recorded process, paths are relative to
+ * the mount point and must not contain blanks. strace2replay converts the
+ * output of "strace -f -tt" into this format.
+ *
+ * Every call is assigned to a file: the path, or for fd based calls the
+ * path the fd was opened with (a rename keeps the file). Files which depend
+ * on each other (the contents of a directory made by the trace, the two
+ * sides of a rename) form one group. The groups are spread over the threads
+ * and each thread replays the calls of its groups in trace order, so the
+ * order per file is kept while unrelated files run in parallel. Calls are
+ * issued back to back, without the recorded think time.
+ * stdout gets CSV: op,ops,errors,mean_us,p50_us,p99_us,p999_us and a
+ * "total" line with the wall time.
+ */
+
+enum OpType
+{
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_PREAD,
+    OP_PWRITE,
+    OP_LSEEK,
+    OP_CLOSE,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RENAME,
+    OP_NR
+};
+
+static const char *op_names[OP_NR] = {
+    "open", "read", "write", "pread", "pwrite", "lseek", "close", "mkdir", "unlink", "rename"
+};
+
+struct Call
+{
+    OpType op;
+    long tid;
+    long fd;           // fd in the trace
+    string path;
+    string path2;      // rename target
+    int flags;         // open flags or whence
+    long long len;
+    long long offset;
+};
+
+struct Worker
+{
+    pthread_t thread;
+    const string *root;
+    vector<Call> calls;
+    map<std::pair<long, long>, int> fds;   // (tid, trace fd) => real fd
+    LatencyStat lat[OP_NR];
+    long loops;
+};
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " [-t threads] [-l loops] <trace> <mount point>" << endl;
+    exit(1);
+}
+
+static bool parse_open_flags(const string &s, int *flags)
+{
+    size_t i = 0;
+
+    if (0 == s.compare(0, 2, "rw"))
+    {
+        *flags = O_RDWR;
+        i = 2;
+    }
+    else if (!s.empty() && 'r' == s[0])
+    {
+        *flags = O_RDONLY;
+        i = 1;
+    }
+    else if (!s.empty() && 'w' == s[0])
+    {
+        *flags = O_WRONLY;
+        i = 1;
+    }
+    else
+    {
+        return false;
+    }
+
+    for (; i < s.size(); ++i)
+    {
+        switch (s[i])
+        {
+        case 'c': *flags |= O_CREAT; break;
+        case 't': *flags |= O_TRUNC; break;
+        case 'a': *flags |= O_APPEND; break;
+        case 'x': *flags |= O_EXCL; break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * return: false if the line is malformed
+ */
+static bool parse_line(const string &line, Call *c)
+{
+    istringstream in(line);
+    string op;
+    string arg;
+
+    c->fd = -1;
+    c->flags = 0;
+    c->len = 0;
+    c->offset = 0;
+    if (!(in >> c->tid >> op))
+    {
+        return false;
+    }
+
+    if ("open" == op)
+    {
+        c->op = OP_OPEN;
+        return (in >> c->fd >> c->path >> arg) && parse_open_flags(arg, &c->flags);
+    }
+    if ("read" == op || "write" == op)
+    {
+        c->op = "read" == op? OP_READ: OP_WRITE;
+        return (in >> c->fd >> c->len) && c->len >= 0;
+    }
+    if ("pread" == op || "pwrite" == op)
+    {
+        c->op = "pread" == op? OP_PREAD: OP_PWRITE;
+        return (in >> c->fd >> c->len >> c->offset) && c->len >= 0;
+    }
+    if ("lseek" == op)
+    {
+        c->op = OP_LSEEK;
+        if (!(in >> c->fd >> c->offset >> arg))
+        {
+            return false;
+        }
+        c->flags = "set" == arg? SEEK_SET: "cur" == arg? SEEK_CUR: "end" == arg? SEEK_END: -1;
+        return c->flags >= 0;
+    }
+    if ("close" == op)
+    {
+        c->op = OP_CLOSE;
+        return static_cast<bool>(in >> c->fd);
+    }
+    if ("mkdir" == op || "unlink" == op)
+    {
+        c->op = "mkdir" == op? OP_MKDIR: OP_UNLINK;
+        return static_cast<bool>(in >> c->path);
+    }
+    if ("rename" == op)
+    {
+        c->op = OP_RENAME;
+        return static_cast<bool>(in >> c->path >> c->path2);
+    }
+    return false;
+}
+
+// union-find over file ids, files which depend on each other end up in one group
+static long group_of(vector<long> &parent, long f)
+{
+    while (parent[f] != f)
+    {
+        parent[f] = parent[parent[f]];
+        f = parent[f];
+    }
+    return f;
+}
+
+static void join(vector<long> &parent, long a, long b)
+{
+    parent[group_of(parent, a)] = group_of(parent, b);
+}
+
+/*
+ * Desc: file id of a path, a new one for a path not seen before
+ *   A file inside a directory made by the trace depends on the mkdir, so
+ *   it is put in the group of the directory.
+ */
+static long file_of(map<string, long> &file_of_path, vector<long> &parent, const string &path)
+{
+    map<string, long>::iterator it = file_of_path.find(path);
+    if (it != file_of_path.end())
+    {
+        return it->second;
+    }
+
+    long f = parent.size();
+    parent.push_back(f);
+    file_of_path[path] = f;
+
+    size_t slash = path.rfind('/');
+    if (slash != string::npos)
+    {
+        it = file_of_path.find(path.substr(0, slash));
+        if (it != file_of_path.end())
+        {
+            join(parent, f, it->second);
+        }
+    }
+    return f;
+}
+
+/*
+ * Desc: read the trace and spread its calls over the workers by file group
+ * Return: false on error
+ */
+static bool load_trace(const char *name, vector<Worker> &workers)
+{
+    ifstream in(name);
+    string line;
+    long lineno = 0;
+    map<string, long> file_of_path;             // path => file id
+    map<std::pair<long, long>, long> file_of_fd; // (tid, fd) => file id
+    vector<long> parent;                         // union-find of file ids
+    vector<Call> calls;
+    vector<long> files;                          // file id of each call
+
+    if (!in)
+    {
+        cerr << "can't open " << name << endl;
+        return false;
+    }
+
+    while (getline(in, line))
+    {
+        ++lineno;
+        size_t p = line.find_first_not_of(" \t");
+        if (string::npos == p || '#' == line[p])
+        {
+            continue;
+        }
+
+        Call c;
+        if (!parse_line(line, &c))
+        {
+            cerr << name << ":" << lineno << ": bad line: " << line << endl;
+            return false;
+        }
+
+        long file = -1;
+        if (c.fd < 0 || OP_OPEN == c.op)
+        {
+            file = file_of(file_of_path, parent, c.path);
+            if (OP_OPEN == c.op)
+            {
+                file_of_fd[std::make_pair(c.tid, c.fd)] = file;
+            }
+            else if (OP_RENAME == c.op)
+            {
+                // the target (and its directory) must see the calls before
+                join(parent, file, file_of(file_of_path, parent, c.path2));
+                file_of_path[c.path2] = file;
+                file_of_path.erase(c.path);
+            }
+        }
+        else
+        {
+            map<std::pair<long, long>, long>::iterator it =
+                file_of_fd.find(std::make_pair(c.tid, c.fd));
+            if (it == file_of_fd.end())
+            {
+                continue;  // fd opened before the trace started
+            }
+            file = it->second;
+            if (OP_CLOSE == c.op)
+            {
+                file_of_fd.erase(it);
+            }
+        }
+
+        calls.push_back(c);
+        files.push_back(file);
+    }
+
+    for (size_t i = 0; i < calls.size(); ++i)
+    {
+        workers[group_of(parent, files[i]) % workers.size()].calls.push_back(calls[i]);
+    }
+    return true;
+}
+
+static bool replay_call(Worker &w, const Call &c, vector<char> &buf)
+{
+    std::pair<long, long> key(c.tid, c.fd);
+    int fd = -1;
+
+    if (OP_OPEN != c.op && c.fd >= 0)
+    {
+        map<std::pair<long, long>, int>::iterator it = w.fds.find(key);
+        if (it == w.fds.end())
+        {
+            return false;  // its open failed
+        }
+        fd = it->second;
+    }
+    if (buf.size() < (size_t)c.len)
+    {
+        buf.resize(c.len, 'r');
+    }
+
+    switch (c.op)
+    {
+    case OP_OPEN:
+        fd = open((*w.root + "/" + c.path).c_str(), c.flags, 0644);
+        if (-1 == fd)
+        {
+            return false;
+        }
+        w.fds[key] = fd;
+        return true;
+    case OP_READ:
+        return read(fd, &buf[0], c.len) >= 0;
+    case OP_WRITE:
+        return write(fd, &buf[0], c.len) >= 0;
+    case OP_PREAD:
+        return pread(fd, &buf[0], c.len, c.offset) >= 0;
+    case OP_PWRITE:
+        return pwrite(fd, &buf[0], c.len, c.offset) >= 0;
+    case OP_LSEEK:
+        return lseek(fd, c.offset, c.flags) != (off_t)-1;
+    case OP_CLOSE:
+        w.fds.erase(key);
+        return 0 == close(fd);
+    case OP_MKDIR:
+        return 0 == mkdir((*w.root + "/" + c.path).c_str(), 0755);
+    case OP_UNLINK:
+        return 0 == unlink((*w.root + "/" + c.path).c_str());
+    case OP_RENAME:
+        return 0 == rename((*w.root + "/" + c.path).c_str(), (*w.root + "/" + c.path2).c_str());
+    default:
+        return false;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Worker &w = *(Worker *)arg;
+    vector<char> buf(4096, 'r');
+
+    for (long l = 0; l < w.loops; ++l)
+    {
+        for (size_t i = 0; i < w.calls.size(); ++i)
+        {
+            const Call &c = w.calls[i];
+            unsigned long long t = now_ns();
+            if (replay_call(w, c, buf))
+            {
+                w.lat[c.op].add(now_ns() - t);
+            }
+            else
+            {
+                w.lat[c.op].add_error();
+            }
+        }
+
+        // fds left open by the trace
+        for (map<std::pair<long, long>, int>::iterator it = w.fds.begin(); it != w.fds.end(); ++it)
+        {
+            close(it->second);
+        }
+        w.fds.clear();
+    }
+    return 0;
+}
+
+static void print_row(const char *op, LatencyStat &lat)
+{
+    printf("%s,%lu,%lu,%.1f,%s\n", op, (unsigned long)lat.count(), lat.errors(),
+           lat.count()? lat.total() / 1000.0 / lat.count(): 0.0, lat.csv_row().c_str());
+}
+
+int main (int argc, char *argv[])
+{
+    long threads = 1;
+    long loops = 1;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "t:l:")) != -1)
+    {
+        switch (c)
+        {
+        case 't': threads = atol(optarg); break;
+        case 'l': loops = atol(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 2 != argc || threads <= 0 || loops <= 0)
+    {
+        usage(argv[0]);
+    }
+    string root = argv[optind + 1];
+
+    vector<Worker> workers(threads);
+    if (!load_trace(argv[optind], workers))
+    {
+        return 1;
+    }
+
+    size_t total_calls = 0;
+    for (long i = 0; i < threads; ++i)
+    {
+        workers[i].root = &root;
+        workers[i].loops = loops;
+        total_calls += workers[i].calls.size();
+    }
+    cerr << total_calls << " calls, " << threads << " threads, " << loops << " loops" << endl;
+
+    unsigned long long begin = now_ns();
+    for (long i = 0; i < threads; ++i)
+    {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    for (long i = 0; i < threads; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double secs = (now_ns() - begin) / 1e9;
+
+    printf("op,ops,errors,mean_us,%s\n", LatencyStat::csv_header().c_str());
+    LatencyStat all;
+    for (int op = 0; op < OP_NR; ++op)
+    {
+        LatencyStat lat;
+        for (long i = 0; i < threads; ++i)
+        {
+            lat.merge(workers[i].lat[op]);
+        }
+        if (lat.count() || lat.errors())
+        {
+            print_row(op_names[op], lat);
+        }
+        all.merge(lat);
+    }
+    print_row("all", all);
+    printf("total,%lu,%lu,%.6f secs,%.1f ops/s\n", (unsigned long)all.count(), all.errors(),
+           secs, secs > 0? all.count() / secs: 0.0);
+    return 0;
+}
@@ -0,0 +1,158 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>  // for ioctl
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>  // for exit
+
+#include <linux/types.h>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <cerrno>
+
+#include "../simplefat/sfat_fs.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+/*
+ * sfatstat: report the counters of a mounted simplefat volume, like vmstat
+ *
+ *   sfatstat <file or directory on the volume> [interval [count]]
+ *
+ * The first line shows the counters since mount, every further line the
+ * changes during the last interval (in seconds). Without interval only
+ * the first line is printed.
+ */
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " <path on simplefat> [interval [count]]" << endl;
+}
+
+static int get_stats(int fd, struct sfat_ioctl_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (ioctl(fd, SFAT_IOCTL_GET_STATS, st) < 0)
+    {
+        perror("SFAT_IOCTL_GET_STATS");
+        return -1;
+    }
+    if (st->version < SFAT_STATS_VERSION)  // newer kernels keep the old fields
+    {
+        cerr << "unsupported stats version " << st->version << endl;
+        return -1;
+    }
+    return 0;
+}
+
+static void print_header()
+{
+    printf("%10s %10s %10s %10s %6s %8s %10s %10s %10s %9s\n",
+           "blk_r", "blk_w", "hit", "miss", "hit%", "alloc",
+           "free", "rd_kB", "wr_kB", "avg_chain");
+}
+
+/*
+ * print the difference between cur and prev (prev is all 0 for the first line)
+ * free clusters are a level, not a counter, so it is printed as is
+ */
+static void print_line(const struct sfat_ioctl_stats &cur, const struct sfat_ioctl_stats &prev)
+{
+    __u64 hit = cur.cache_hit - prev.cache_hit;
+    __u64 miss = cur.cache_miss - prev.cache_miss;
+    __u64 walk = cur.chain_walk - prev.chain_walk;
+    __u64 hop = cur.chain_hop - prev.chain_hop;
+
+    printf("%10llu %10llu %10llu %10llu %6.1f %8llu %10llu %10llu %10llu %9.2f\n",
+           (unsigned long long)(cur.blk_read - prev.blk_read),
+           (unsigned long long)(cur.blk_write - prev.blk_write),
+           (unsigned long long)hit,
+           (unsigned long long)miss,
+           (hit + miss)? 100.0 * hit / (hit + miss): 0.0,
+           (unsigned long long)(cur.cls_alloc - prev.cls_alloc),
+           (unsigned long long)cur.free_clusters,
+           (unsigned long long)((cur.read_bytes - prev.read_bytes) >> 10),
+           (unsigned long long)((cur.write_bytes - prev.write_bytes) >> 10),
+           walk? (double)hop / walk: 0.0);
+    fflush(stdout);
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    string name = argv[1];
+    int interval = 0;
+    long count = -1;  // forever
+    if (argc >= 3)
+    {
+        interval = atoi(argv[2]);
+        if (interval <= 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc >= 4)
+    {
+        count = atol(argv[3]);
+        if (count <= 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int fd = open(name.c_str(), O_RDONLY);
+    if (-1 == fd)
+    {
+        perror(name.c_str());
+        return 1;
+    }
+
+    struct sfat_ioctl_stats prev;
+    struct sfat_ioctl_stats cur;
+    memset(&prev, 0, sizeof(prev));
+
+    if (get_stats(fd, &cur))
+    {
+        close(fd);
+        return 1;
+    }
+    printf("cluster size %llu, %llu clusters\n",
+           (unsigned long long)cur.cluster_size, (unsigned long long)cur.clusters);
+    print_header();
+    print_line(cur, prev);
+
+    int lines = 1;
+    while (interval > 0 && (count < 0 || lines < count))
+    {
+        sleep(interval);
+        prev = cur;
+        if (get_stats(fd, &cur))
+        {
+            close(fd);
+            return 1;
+        }
+        if (lines % 20 == 0)
+        {
+            print_header();
+        }
+        print_line(cur, prev);
+        ++lines;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,351 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>  // for exit
+
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "LatencyStat.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+/*
+ * sfatstress: concurrency stress and scaling of a mounted file system
+ *
+ *   sfatstress [-t max threads] [-T seconds] [-b io size] [-S] <directory>
+ *
+ * For every thread count 1, 2, 4, ... up to max threads (default: no. of
+ * cpus) the workers run a random mix of create (25%), append (35%),
+ * read (25%) and unlink (15%) on their own files for -T seconds (default 5).
+ * Each worker uses a private subdirectory <directory>/pN, or with -S all
+ * of them share <directory>, which puts them on the same directory scans.
+ * stdout gets CSV: threads,op,ops,errors,ops_per_sec,mean_us,p50_us,p99_us,p999_us
+ * with one line per op and one "all" line per thread count, so that lock
+ * contention shows up as ops_per_sec not growing with the threads.
+ * Without unlink in the file system the workers append instead.
+ */
+
+enum Op
+{
+    OP_CREATE,
+    OP_APPEND,
+    OP_READ,
+    OP_UNLINK,
+    OP_NR
+};
+
+static const char *op_names[OP_NR] = {"create", "append", "read", "unlink"};
+
+// set by the first worker whose unlink is unsupported, read by all of them
+static volatile bool unlink_unsupported = false;
+
+struct Options
+{
+    string dir;
+    long max_threads;
+    long seconds;
+    long io_size;
+    bool shared;
+};
+
+struct Worker
+{
+    const Options *opt;
+    int id;
+    string dir;                   // where its files are
+    pthread_t thread;
+    pthread_barrier_t *start;
+    unsigned int seed;
+    LatencyStat lat[OP_NR];
+    vector<long> files;           // files it owns, by number
+    long next;                    // number of the next file to create
+    long round;                   // thread count run, names differ per run
+};
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " [-t max threads] [-T seconds] [-b io size] [-S] <directory>" << endl;
+    exit(1);
+}
+
+// short (8.3) names so that FAT like file systems take them; the run is
+// the extension, so files left by a run without unlink don't clash
+static string file_name(const Worker &w, long n)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "w%02d%05ld.%ld", w.id, n % 100000, w.round % 1000);
+    return w.dir + "/" + buf;
+}
+
+static bool do_create(Worker &w)
+{
+    string name = file_name(w, w.next);
+    int fd = open(name.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (-1 == fd)
+    {
+        return false;
+    }
+    close(fd);
+    w.files.push_back(w.next);
+    ++w.next;
+    return true;
+}
+
+// the end is found by lseek, which works without O_APPEND support
+static bool do_append(Worker &w, long n, const vector<char> &buf)
+{
+    string name = file_name(w, n);
+    int fd = open(name.c_str(), O_WRONLY);
+    if (-1 == fd)
+    {
+        return false;
+    }
+    bool ok = lseek(fd, 0, SEEK_END) != (off_t)-1
+              && write(fd, &buf[0], buf.size()) == (ssize_t)buf.size();
+    close(fd);
+    return ok;
+}
+
+static bool do_read(Worker &w, long n, vector<char> &buf)
+{
+    string name = file_name(w, n);
+    int fd = open(name.c_str(), O_RDONLY);
+    if (-1 == fd)
+    {
+        return false;
+    }
+    bool ok = read(fd, &buf[0], buf.size()) >= 0;
+    close(fd);
+    return ok;
+}
+
+static bool do_unlink(Worker &w, size_t idx)
+{
+    string name = file_name(w, w.files[idx]);
+    if (unlink(name.c_str()))
+    {
+        if (op_unsupported(errno))
+        {
+            unlink_unsupported = true;
+        }
+        return false;
+    }
+    w.files[idx] = w.files.back();
+    w.files.pop_back();
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker &w = *(Worker *)arg;
+    vector<char> wbuf(w.opt->io_size, 'a' + w.id % 26);
+    vector<char> rbuf(w.opt->io_size);
+
+    pthread_barrier_wait(w.start);
+    unsigned long long deadline = now_ns() + w.opt->seconds * 1000000000ULL;
+
+    while (now_ns() < deadline)
+    {
+        int r = rand_r(&w.seed) % 100;
+        Op op = r < 25? OP_CREATE: r < 60? OP_APPEND: r < 85? OP_READ: OP_UNLINK;
+        if (OP_UNLINK == op && unlink_unsupported)
+        {
+            op = OP_APPEND;
+        }
+        if (w.files.empty())
+        {
+            op = OP_CREATE;
+        }
+        size_t idx = w.files.empty()? 0: rand_r(&w.seed) % w.files.size();
+
+        unsigned long long t = now_ns();
+        bool ok = false;
+        switch (op)
+        {
+        case OP_CREATE: ok = do_create(w); break;
+        case OP_APPEND: ok = do_append(w, w.files[idx], wbuf); break;
+        case OP_READ:   ok = do_read(w, w.files[idx], rbuf); break;
+        default:        ok = do_unlink(w, idx); break;
+        }
+        if (ok)
+        {
+            w.lat[op].add(now_ns() - t);
+        }
+        else if (OP_UNLINK == op && unlink_unsupported)
+        {
+            continue;  // not counted, the next unlinks become appends
+        }
+        else
+        {
+            w.lat[op].add_error();
+            if (OP_CREATE == op)
+            {
+                ++w.next;  // don't get stuck on the same name
+            }
+        }
+    }
+    return 0;
+}
+
+static void print_row(long threads, const char *op, LatencyStat &lat, double secs)
+{
+    printf("%ld,%s,%lu,%lu,%.1f,%.1f,%s\n", threads, op,
+           (unsigned long)lat.count(), lat.errors(),
+           secs > 0? lat.count() / secs: 0.0,
+           lat.count()? lat.total() / 1000.0 / lat.count(): 0.0,
+           lat.csv_row().c_str());
+    fflush(stdout);
+}
+
+/*
+ * run one thread count
+ * return: false if the workers couldn't be set up
+ */
+static bool run(const Options &opt, long threads)
+{
+    vector<Worker> workers(threads);
+    pthread_barrier_t start;
+
+    static long round = 0;
+
+    ++round;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (long i = 0; i < threads; ++i)
+    {
+        Worker &w = workers[i];
+        w.opt = &opt;
+        w.id = i;
+        w.start = &start;
+        w.seed = i + 1;
+        w.next = 0;
+        w.round = round;
+        w.dir = opt.dir;
+        if (!opt.shared)
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "/p%ld", i);
+            w.dir += buf;
+            if (mkdir(w.dir.c_str(), 0755) && EEXIST != errno)
+            {
+                cerr << "mkdir " << w.dir << ": " << strerror(errno)
+                     << " (use -S for a shared directory)" << endl;
+                return false;
+            }
+        }
+    }
+
+    for (long i = 0; i < threads; ++i)
+    {
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&start);
+    unsigned long long begin = now_ns();
+    for (long i = 0; i < threads; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double secs = (now_ns() - begin) / 1e9;
+    pthread_barrier_destroy(&start);
+
+    LatencyStat all;
+    for (int op = 0; op < OP_NR; ++op)
+    {
+        LatencyStat lat;
+        for (long i = 0; i < threads; ++i)
+        {
+            lat.merge(workers[i].lat[op]);
+        }
+        if (OP_UNLINK == op && unlink_unsupported)
+        {
+            continue;
+        }
+        print_row(threads, op_names[op], lat, secs);
+        all.merge(lat);
+    }
+    print_row(threads, "all", all, secs);
+
+    // clean up for the next round
+    if (unlink_unsupported)
+    {
+        note_unsupported("unlink", opt.dir);
+        return true;
+    }
+    for (long i = 0; i < threads; ++i)
+    {
+        Worker &w = workers[i];
+        while (!w.files.empty())
+        {
+            if (!do_unlink(w, 0))
+            {
+                w.files.erase(w.files.begin());
+            }
+        }
+        if (!opt.shared)
+        {
+            rmdir(w.dir.c_str());
+        }
+    }
+    return true;
+}
+
+int main (int argc, char *argv[])
+{
+    Options opt;
+    opt.max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    opt.seconds = 5;
+    opt.io_size = 4096;
+    opt.shared = false;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "t:T:b:S")) != -1)
+    {
+        switch (c)
+        {
+        case 't': opt.max_threads = atol(optarg); break;
+        case 'T': opt.seconds = atol(optarg); break;
+        case 'b': opt.io_size = atol(optarg); break;
+        case 'S': opt.shared = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || opt.max_threads <= 0 || opt.max_threads > 99
+        || opt.seconds <= 0 || opt.io_size <= 0)
+    {
+        usage(argv[0]);
+    }
+    opt.dir = argv[optind];
+
+    cerr << "directory: " << opt.dir << (opt.shared? " (shared)": " (private subdirectories)")
+         << ", threads: 1.." << opt.max_threads << ", " << opt.seconds << "s each" << endl;
+
+    printf("threads,op,ops,errors,ops_per_sec,mean_us,%s\n", LatencyStat::csv_header().c_str());
+    for (long t = 1; ; t *= 2)
+    {
+        if (t > opt.max_threads)
+        {
+            t = opt.max_threads;
+        }
+        if (!run(opt, t))
+        {
+            return 1;
+        }
+        if (t == opt.max_threads)
+        {
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,350 @@
+
+#include <stdlib.h>  // for exit
+#include <ctype.h>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+using std::cin;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::map;
+
+/*
+ * strace2replay: convert "strace -f -tt" output into a sfatreplay trace
+ *
+ *   strace -f -tt -o strace.out <program>
+ *   strace2replay <mount point> < strace.out > trace
+ *
+ * Only successful calls on paths below <mount point> are kept (the paths
+ * are made relative to it), and fd based calls only for fds which were
+ * opened on such paths. Relative paths and *at() calls with a dirfd other
+ * than AT_FDCWD can't be resolved and are dropped, as are paths with blanks.
+ * fds belong to processes, not threads, so the calls on an fd are written
+ * with the tid which opened it; this assumes one traced process.
+ * Calls split by strace into "<unfinished ...>" and "<... resumed>" are
+ * joined again.
+ */
+
+struct FdInfo
+{
+    long tid;   // tid which opened the fd
+};
+
+static map<long, string> unfinished;   // tid => first part of the call
+static map<long, FdInfo> open_fds;     // fd => info, only for kept fds
+static string root;
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " <mount point> < strace output > trace" << endl;
+    exit(1);
+}
+
+/*
+ * split the arguments of a call at the commas which are not inside
+ * quotes, brackets or braces
+ */
+static vector<string> split_args(const string &s)
+{
+    vector<string> args;
+    string cur;
+    int depth = 0;
+    bool quoted = false;
+
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        char c = s[i];
+        if (quoted)
+        {
+            cur += c;
+            if ('\\' == c && i + 1 < s.size())
+            {
+                cur += s[++i];
+            }
+            else if ('"' == c)
+            {
+                quoted = false;
+            }
+            continue;
+        }
+        if ('"' == c)
+        {
+            quoted = true;
+        }
+        else if ('[' == c || '{' == c || '(' == c)
+        {
+            ++depth;
+        }
+        else if (']' == c || '}' == c || ')' == c)
+        {
+            --depth;
+        }
+        else if (',' == c && 0 == depth)
+        {
+            args.push_back(cur);
+            cur.clear();
+            continue;
+        }
+        if (!(' ' == c && cur.empty()))
+        {
+            cur += c;
+        }
+    }
+    if (!cur.empty())
+    {
+        args.push_back(cur);
+    }
+    return args;
+}
+
+/*
+ * Desc: path of a quoted argument relative to the mount point
+ * Return: false if it isn't below the mount point or can't be used
+ */
+static bool rel_path(const string &arg, string *path)
+{
+    if (arg.size() < 2 || '"' != arg[0] || '"' != arg[arg.size() - 1])
+    {
+        return false;
+    }
+    string p = arg.substr(1, arg.size() - 2);
+    if (p.find_first_of(" \t\\") != string::npos)
+    {
+        return false;
+    }
+    if (p.compare(0, root.size(), root) != 0
+        || (p.size() > root.size() && '/' != p[root.size()]))
+    {
+        return false;
+    }
+    p.erase(0, root.size());
+    while (!p.empty() && '/' == p[0])
+    {
+        p.erase(0, 1);
+    }
+    if (p.empty())
+    {
+        return false;  // the mount point itself
+    }
+    *path = p;
+    return true;
+}
+
+static string open_flags(const string &arg)
+{
+    string f;
+
+    if (arg.find("O_RDWR") != string::npos)
+    {
+        f = "rw";
+    }
+    else if (arg.find("O_WRONLY") != string::npos)
+    {
+        f = "w";
+    }
+    else
+    {
+        f = "r";
+    }
+    if (arg.find("O_CREAT") != string::npos)
+    {
+        f += 'c';
+    }
+    if (arg.find("O_TRUNC") != string::npos)
+    {
+        f += 't';
+    }
+    if (arg.find("O_APPEND") != string::npos)
+    {
+        f += 'a';
+    }
+    if (arg.find("O_EXCL") != string::npos)
+    {
+        f += 'x';
+    }
+    return f;
+}
+
+static bool is_cwd(const string &arg)
+{
+    return "AT_FDCWD" == arg;
+}
+
+// emit an fd based call if the fd is one of ours
+static void emit_fd(const char *op, long fd, const string &rest)
+{
+    map<long, FdInfo>::iterator it = open_fds.find(fd);
+    if (it == open_fds.end())
+    {
+        return;
+    }
+    cout << it->second.tid << " " << op << " " << fd << rest << "\n";
+}
+
+static void convert(long tid, const string &name, const vector<string> &args, long long ret)
+{
+    string path, path2;
+
+    if ("open" == name || "openat" == name || "creat" == name)
+    {
+        size_t p = "openat" == name? 1: 0;
+        if ((p && (args.size() < 3 || !is_cwd(args[0]))) || args.size() < p + 1
+            || !rel_path(args[p], &path))
+        {
+            return;
+        }
+        string flags = "creat" == name? "wct": args.size() > p + 1? open_flags(args[p + 1]): "r";
+        open_fds[ret].tid = tid;
+        cout << tid << " open " << ret << " " << path << " " << flags << "\n";
+    }
+    else if (("read" == name || "write" == name) && args.size() >= 3)
+    {
+        char rest[32];
+        snprintf(rest, sizeof(rest), " %lld", ret);
+        emit_fd(name.c_str(), atol(args[0].c_str()), rest);
+    }
+    else if (("pread64" == name || "pread" == name || "pwrite64" == name || "pwrite" == name)
+             && args.size() >= 4)
+    {
+        char rest[64];
+        snprintf(rest, sizeof(rest), " %lld %s", ret, args[3].c_str());
+        emit_fd('r' == name[1]? "pread": "pwrite", atol(args[0].c_str()), rest);
+    }
+    else if ("lseek" == name && args.size() >= 3)
+    {
+        const char *whence = "SEEK_SET" == args[2]? "set": "SEEK_CUR" == args[2]? "cur":
+                             "SEEK_END" == args[2]? "end": 0;
+        if (whence)
+        {
+            emit_fd("lseek", atol(args[0].c_str()), " " + args[1] + " " + whence);
+        }
+    }
+    else if ("close" == name && !args.empty())
+    {
+        long fd = atol(args[0].c_str());
+        emit_fd("close", fd, "");
+        open_fds.erase(fd);
+    }
+    else if (("mkdir" == name && !args.empty() && rel_path(args[0], &path))
+             || ("mkdirat" == name && args.size() >= 2 && is_cwd(args[0]) && rel_path(args[1], &path)))
+    {
+        cout << tid << " mkdir " << path << "\n";
+    }
+    else if (("unlink" == name && !args.empty() && rel_path(args[0], &path))
+             || ("unlinkat" == name && args.size() >= 3 && is_cwd(args[0])
+                 && args[2].find("AT_REMOVEDIR") == string::npos && rel_path(args[1], &path)))
+    {
+        cout << tid << " unlink " << path << "\n";
+    }
+    else if (("rename" == name && args.size() >= 2
+              && rel_path(args[0], &path) && rel_path(args[1], &path2))
+             || (("renameat" == name || "renameat2" == name) && args.size() >= 4
+                 && is_cwd(args[0]) && is_cwd(args[2])
+                 && rel_path(args[1], &path) && rel_path(args[3], &path2)))
+    {
+        cout << tid << " rename " << path << " " << path2 << "\n";
+    }
+}
+
+/*
+ * one line of strace output, "[pid N] " or "N " in front with -f,
+ * followed by the time with -tt
+ */
+static void handle_line(string line)
+{
+    long tid = 0;
+    size_t p = 0;
+
+    if (0 == line.compare(0, 5, "[pid "))
+    {
+        tid = atol(line.c_str() + 5);
+        p = line.find(']');
+        p = string::npos == p? line.size(): p + 1;
+    }
+    else if (!line.empty() && isdigit(line[0]))
+    {
+        size_t e = line.find_first_not_of("0123456789");
+        if (e != string::npos && ' ' == line[e])
+        {
+            tid = atol(line.c_str());
+            p = e;
+        }
+    }
+    p = line.find_first_not_of(' ', p);
+    if (string::npos == p)
+    {
+        return;
+    }
+    // time stamp, e.g. 12:00:01.123456
+    if (isdigit(line[p]) && line.find(':', p) < line.find('(', p))
+    {
+        p = line.find(' ', p);
+        p = string::npos == p? line.size(): line.find_first_not_of(' ', p);
+        if (string::npos == p)
+        {
+            return;
+        }
+    }
+    line.erase(0, p);
+
+    // "open("a", O_RDONLY <unfinished ...>" and "<... open resumed>) = 3"
+    size_t u = line.find(" <unfinished ...>");
+    if (u != string::npos)
+    {
+        unfinished[tid] = line.substr(0, u);
+        return;
+    }
+    if (0 == line.compare(0, 5, "<... "))
+    {
+        size_t r = line.find(" resumed>");
+        map<long, string>::iterator it = unfinished.find(tid);
+        if (string::npos == r || it == unfinished.end())
+        {
+            return;
+        }
+        line = it->second + line.substr(r + 9);
+        unfinished.erase(it);
+    }
+
+    size_t open_paren = line.find('(');
+    size_t eq = line.rfind(") = ");
+    if (string::npos == open_paren || string::npos == eq || eq < open_paren)
+    {
+        return;  // signals, exits, ...
+    }
+    string name = line.substr(0, open_paren);
+    long long ret = atoll(line.c_str() + eq + 4);
+    if (ret < 0)
+    {
+        return;  // failed call
+    }
+    convert(tid, name, split_args(line.substr(open_paren + 1, eq - open_paren - 1)), ret);
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        usage(argv[0]);
+    }
+    root = argv[1];
+    while (root.size() > 1 && '/' == root[root.size() - 1])
+    {
+        root.erase(root.size() - 1);
+    }
+
+    cout << "# sfatreplay trace, converted from strace output\n";
+    string line;
+    while (getline(cin, line))
+    {
+        handle_line(line);
+    }
+    return 0;
+}
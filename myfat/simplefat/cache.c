@@ -0,0 +1,561 @@
+/*
+ * cache.c
+ *
+ *  Cache of metadata blocks (FAT and directory blocks) of one volume.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/blkdev.h>
+
+#include "sfat.h"
+#include "io.h"
+#include "cache.h"
+#include "stats.h"
+#include "journal.h"
+
+static struct kmem_cache *sfat_cache_mblock = 0;
+
+/*
+ * return: 0 => success
+ *         -ENOMEM
+ */
+int __init sfat_mblock_cache_init(void)
+{
+    sfat_cache_mblock = kmem_cache_create("sfat_mblock_cache",
+                            sizeof(struct sfat_mblock),
+                            0, (SLAB_RECLAIM_ACCOUNT|
+                            SLAB_MEM_SPREAD),
+                            NULL);
+    if (sfat_cache_mblock == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void sfat_mblock_cache_destroy(void)
+{
+    kmem_cache_destroy(sfat_cache_mblock);
+    sfat_cache_mblock = 0;
+}
+
+static inline struct hlist_head *sfat_mcache_head(struct sfat_mcache *mc, size_t blk_no)
+{
+    return mc->hash + hash_long(blk_no, SFAT_MCACHE_HASH_BITS);
+}
+
+/*
+ * Desc: find a block in the cache, lock must be held
+ * Return: the block (no reference is taken) or NULL
+ */
+static struct sfat_mblock *sfat_mcache_find(struct sfat_mcache *mc, size_t blk_no)
+{
+    struct hlist_node *_p;
+    struct sfat_mblock *mb;
+
+    hlist_for_each_entry(mb, _p, sfat_mcache_head(mc, blk_no), mb_hash) {
+        if (mb->mb_blk == blk_no)
+            return mb;
+    }
+    return NULL;
+}
+
+static void sfat_mblock_free(struct sfat_mblock *mb)
+{
+    sfat_blkholder_free(mb->mb_bh);
+    kmem_cache_free(sfat_cache_mblock, mb);
+}
+
+/*
+ * Desc: drop clean unused blocks from the tail of lru until the cache
+ *   is within its limit, lock must be held
+ * Out:
+ *   victims: blocks removed from the cache, to be freed without the lock
+ */
+static void sfat_mcache_shrink(struct sfat_mcache *mc, struct list_head *victims)
+{
+    struct sfat_mblock *mb, *tmp;
+
+    list_for_each_entry_safe_reverse(mb, tmp, &mc->lru, mb_lru) {
+        if (mc->nr_blocks <= mc->max_blocks)
+            break;
+        if (mb->mb_count || mb->mb_is_dirty)
+            continue;
+        hlist_del(&mb->mb_hash);
+        list_move(&mb->mb_lru, victims);
+        --mc->nr_blocks;
+    }
+}
+
+int sfat_mcache_init(struct super_block *sb)
+{
+    struct sfat_mcache *mc = &SFAT_SB(sb)->mcache;
+    unsigned long i = 0;
+
+    spin_lock_init(&mc->lock);
+    for (i = 0; i < SFAT_MCACHE_HASH_SIZE; ++i)
+    {
+        INIT_HLIST_HEAD(&mc->hash[i]);
+    }
+    INIT_LIST_HEAD(&mc->lru);
+    INIT_LIST_HEAD(&mc->dirty);
+    mc->nr_blocks = 0;
+    mc->nr_dirty = 0;
+    mc->max_blocks = SFAT_MCACHE_MAX_BLOCKS;
+    mutex_init(&mc->write_mutex);
+    mc->sb = sb;
+    mc->wb_wq = NULL;
+    return 0;
+}
+
+/*
+ * Desc: drop all the blocks, dirty ones are lost
+ *   (the caller writes them back before if needed)
+ */
+void sfat_mcache_destroy(struct super_block *sb)
+{
+    struct sfat_mcache *mc = &SFAT_SB(sb)->mcache;
+    struct sfat_mblock *mb, *tmp;
+
+    if (mc->nr_dirty)
+    {
+        printk(KERN_ERR "sfat: %lu dirty metadata blocks dropped\n", mc->nr_dirty);
+    }
+
+    list_for_each_entry_safe(mb, tmp, &mc->lru, mb_lru) {
+        hlist_del(&mb->mb_hash);
+        list_del(&mb->mb_lru);
+        list_del(&mb->mb_dirty);
+        sfat_mblock_free(mb);
+    }
+    mc->nr_blocks = 0;
+    mc->nr_dirty = 0;
+}
+
+/*
+ * Desc: drop the cached blocks blk_no ~ blk_no + n - 1, dirty or not, which
+ *   are no metadata any more (the clusters of a removed directory), so
+ *   that they are never written over what the clusters hold next.
+ *   write_mutex is held meanwhile, so no writer has them in hand. Not
+ *   called inside a journal operation.
+ */
+void sfat_mcache_forget(struct super_block *sb, size_t blk_no, size_t n)
+{
+    struct sfat_mcache *mc = &SFAT_SB(sb)->mcache;
+    struct sfat_mblock *mb = NULL;
+    LIST_HEAD(victims);
+    size_t i = 0;
+
+    mutex_lock(&mc->write_mutex);
+    spin_lock(&mc->lock);
+    for (i = 0; i < n; ++i)
+    {
+        mb = sfat_mcache_find(mc, blk_no + i);
+        if (!mb || mb->mb_count)
+        {
+            continue;
+        }
+        hlist_del(&mb->mb_hash);
+        list_move(&mb->mb_lru, &victims);
+        if (mb->mb_is_dirty)
+        {
+            mb->mb_is_dirty = 0;
+            list_del_init(&mb->mb_dirty);
+            --mc->nr_dirty;
+        }
+        --mc->nr_blocks;
+    }
+    spin_unlock(&mc->lock);
+    mutex_unlock(&mc->write_mutex);
+
+    while (!list_empty(&victims))
+    {
+        mb = list_first_entry(&victims, struct sfat_mblock, mb_lru);
+        list_del(&mb->mb_lru);
+        sfat_mblock_free(mb);
+    }
+}
+
+/*
+ * Desc: get a block through the cache, read it from disk if it's not cached
+ * Out:
+ *   perror: error code if NULL is returned
+ * Return:
+ *   the block (with a reference, release it by sfat_mblock_put) or NULL
+ */
+struct sfat_mblock *sfat_mblock_get(struct super_block *sb, size_t blk_no, int *perror)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_mcache *mc = &sbi->mcache;
+    struct sfat_mblock *mb = NULL;
+    struct sfat_mblock *old = NULL;
+    LIST_HEAD(victims);
+    int error = 0;
+
+    *perror = 0;
+
+    spin_lock(&mc->lock);
+    mb = sfat_mcache_find(mc, blk_no);
+    if (mb)
+    {
+        ++mb->mb_count;
+        list_move(&mb->mb_lru, &mc->lru);
+        spin_unlock(&mc->lock);
+        sfat_stat_inc(sb, SFAT_STAT_CACHE_HIT);
+        return mb;
+    }
+    spin_unlock(&mc->lock);
+    sfat_stat_inc(sb, SFAT_STAT_CACHE_MISS);
+
+    // not cached, read it without holding the lock
+    mb = kmem_cache_alloc(sfat_cache_mblock, GFP_NOFS);
+    if (!mb)
+    {
+        *perror = -ENOMEM;
+        return NULL;
+    }
+    mb->mb_bh = sfat_blkholder_alloc();
+    if (!mb->mb_bh)
+    {
+        kmem_cache_free(sfat_cache_mblock, mb);
+        *perror = -ENOMEM;
+        return NULL;
+    }
+    INIT_HLIST_NODE(&mb->mb_hash);
+    INIT_LIST_HEAD(&mb->mb_lru);
+    INIT_LIST_HEAD(&mb->mb_dirty);
+    mb->mb_blk = blk_no;
+    mb->mb_count = 1;
+    mb->mb_is_dirty = 0;
+
+    error = sfat_read_block(sb, mb->mb_bh, blk_no);
+    if (error)
+    {
+        sfat_mblock_free(mb);
+        *perror = error;
+        return NULL;
+    }
+
+    spin_lock(&mc->lock);
+    old = sfat_mcache_find(mc, blk_no);
+    if (old)  // somebody else was faster
+    {
+        ++old->mb_count;
+        list_move(&old->mb_lru, &mc->lru);
+        spin_unlock(&mc->lock);
+        sfat_mblock_free(mb);
+        return old;
+    }
+    hlist_add_head(&mb->mb_hash, sfat_mcache_head(mc, blk_no));
+    list_add(&mb->mb_lru, &mc->lru);
+    ++mc->nr_blocks;
+    sfat_mcache_shrink(mc, &victims);
+    spin_unlock(&mc->lock);
+
+    while (!list_empty(&victims))
+    {
+        old = list_first_entry(&victims, struct sfat_mblock, mb_lru);
+        list_del(&old->mb_lru);
+        sfat_mblock_free(old);
+    }
+    return mb;
+}
+
+/*
+ * Desc: release the reference taken by sfat_mblock_get
+ *   Dirty blocks are written back by the worker (see sfat_mblock_mark_dirty),
+ *   only if it can't keep up and the cache is full of them they are
+ *   written right here.
+ */
+void sfat_mblock_put(struct super_block *sb, struct sfat_mblock *mb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_mcache *mc = &sbi->mcache;
+    int too_dirty = 0;
+
+    spin_lock(&mc->lock);
+    --mb->mb_count;
+    // with the journal this may be inside an operation, sfat_journal_start
+    // bounds the dirty blocks instead
+    too_dirty = (!sbi->journal && !mb->mb_count && mc->nr_dirty > mc->max_blocks);
+    spin_unlock(&mc->lock);
+
+    if (too_dirty)
+    {
+        sfat_mcache_write(sb, 0, SFAT_BLK_NONE, SFAT_BLK_NONE);
+    }
+}
+
+char *sfat_mblock_data(struct sfat_mblock *mb)
+{
+    return sfat_blkholder_get_data(mb->mb_bh);
+}
+
+/*
+ * Desc: the content of the block is modified and needs to be written back
+ *   The first dirty block starts the timer of the writeback worker, the
+ *   wb_thresh-th one kicks it. Without the timer sfat_write_super writes
+ *   the blocks back.
+ *   The work is queued under lock, so sfat_mcache_wb_stop doesn't race.
+ */
+void sfat_mblock_mark_dirty(struct super_block *sb, struct sfat_mblock *mb)
+{
+    struct sfat_mcache *mc = &SFAT_SB(sb)->mcache;
+    int timer = 0;
+
+    spin_lock(&mc->lock);
+    if (!mb->mb_is_dirty)
+    {
+        mb->mb_is_dirty = 1;
+        list_add_tail(&mb->mb_dirty, &mc->dirty);
+        ++mc->nr_dirty;
+        if (mc->wb_wq && mc->nr_dirty == mc->wb_thresh)
+        {
+            queue_work(mc->wb_wq, &mc->wb_kick);
+        }
+        else if (mc->wb_wq && mc->wb_interval && 1 == mc->nr_dirty)
+        {
+            queue_delayed_work(mc->wb_wq, &mc->wb_timer, mc->wb_interval);
+        }
+    }
+    timer = mc->wb_wq && mc->wb_interval;
+    spin_unlock(&mc->lock);
+
+    if (!timer)
+    {
+        sb->s_dirt = 1;  // sfat_write_super will write it back
+    }
+}
+
+static int sfat_mblock_cmp(const void *a, const void *b)
+{
+    const struct sfat_mblock *x = *(const struct sfat_mblock **)a;
+    const struct sfat_mblock *y = *(const struct sfat_mblock **)b;
+
+    if (x->mb_blk < y->mb_blk)
+        return -1;
+    return x->mb_blk > y->mb_blk;
+}
+
+/*
+ * Desc: write dirty blocks back in ascending order of block no.
+ *   Blocks which follow each other on the volume are written by one
+ *   bio (up to SFAT_WB_MAX_RUN of them).
+ *   No cache flush is issued here, the caller does it once for all.
+ *   With the journal all the dirty blocks are committed instead (see
+ *   sfat_journal_commit), which flushes by itself.
+ * In:
+ *   blk_lo, blk_hi: blocks in [blk_lo, blk_hi) are written
+ *   blk_extra: one more block to be written (or SFAT_BLK_NONE)
+ * Return:
+ *   0: success
+ *   < 0: error code (of the first failure, the rest is still tried)
+ */
+int sfat_mcache_write(struct super_block *sb, size_t blk_lo, size_t blk_hi, size_t blk_extra)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_mcache *mc = &sbi->mcache;
+    struct sfat_mblock **vec = NULL;
+    struct sfat_mblock *mb = NULL;
+    struct block_holder *bhs[SFAT_WB_MAX_RUN];
+    unsigned long cap = 0;
+    unsigned long n = 0;
+    unsigned long len = 0;
+    unsigned long i = 0;
+    unsigned long k = 0;
+    int error = 0;
+    int err = 0;
+
+    mutex_lock(&mc->write_mutex);
+
+    if (sbi->journal)
+    {
+        error = sfat_journal_commit(sb);
+        mutex_unlock(&mc->write_mutex);
+        return error;
+    }
+
+    spin_lock(&mc->lock);
+    cap = mc->nr_dirty;
+    spin_unlock(&mc->lock);
+    if (!cap)
+    {
+        mutex_unlock(&mc->write_mutex);
+        return 0;
+    }
+
+    vec = kmalloc(cap * sizeof(*vec), GFP_NOFS);
+    if (!vec)
+    {
+        mutex_unlock(&mc->write_mutex);
+        return -ENOMEM;
+    }
+
+    spin_lock(&mc->lock);
+    list_for_each_entry(mb, &mc->dirty, mb_dirty) {
+        if (n >= cap)
+            break;
+        if ((mb->mb_blk >= blk_lo && mb->mb_blk < blk_hi) || mb->mb_blk == blk_extra) {
+            ++mb->mb_count;
+            vec[n++] = mb;
+        }
+    }
+
+    // clear the flags before writing, a modification during the
+    // write dirties the block again
+    for (i = 0; i < n; ++i)
+    {
+        mb = vec[i];
+        mb->mb_is_dirty = 0;
+        list_del_init(&mb->mb_dirty);
+        --mc->nr_dirty;
+    }
+    spin_unlock(&mc->lock);
+
+    sort(vec, n, sizeof(*vec), sfat_mblock_cmp, NULL);
+
+    for (i = 0; i < n; i += len)
+    {
+        bhs[0] = vec[i]->mb_bh;
+        for (len = 1; i + len < n && len < SFAT_WB_MAX_RUN
+                && vec[i + len]->mb_blk == vec[i]->mb_blk + len; ++len)
+        {
+            bhs[len] = vec[i + len]->mb_bh;
+        }
+
+        err = sfat_write_blocks(sb, bhs, len, vec[i]->mb_blk);
+        if (err)
+        {
+            for (k = 0; k < len; ++k)
+            {
+                sfat_mblock_mark_dirty(sb, vec[i + k]);
+            }
+            if (!error)
+            {
+                error = err;
+            }
+        }
+    }
+
+    spin_lock(&mc->lock);
+    for (i = 0; i < n; ++i)
+    {
+        --vec[i]->mb_count;
+    }
+    spin_unlock(&mc->lock);
+
+    mutex_unlock(&mc->write_mutex);
+    kfree(vec);
+    return error;
+}
+
+/*
+ * Desc: one run of the writeback worker, then the timer is started again
+ *   if blocks were dirtied meanwhile (or the write failed)
+ */
+static void sfat_mcache_wb_run(struct sfat_mcache *mc)
+{
+    int error = 0;
+
+    sfat_stat_inc(mc->sb, SFAT_STAT_WB_RUN);
+    error = sfat_mcache_write(mc->sb, 0, SFAT_BLK_NONE, SFAT_BLK_NONE);
+    if (error)
+    {
+        printk(KERN_ERR "sfat: writeback of %s failed, error is %d\n", mc->sb->s_id, error);
+    }
+
+    spin_lock(&mc->lock);
+    if (mc->wb_wq && mc->nr_dirty)
+    {
+        if (!error && mc->nr_dirty >= mc->wb_thresh)
+        {
+            queue_work(mc->wb_wq, &mc->wb_kick);
+        }
+        else if (mc->wb_interval)
+        {
+            queue_delayed_work(mc->wb_wq, &mc->wb_timer, mc->wb_interval);
+        }
+    }
+    spin_unlock(&mc->lock);
+}
+
+static void sfat_mcache_wb_timer(struct work_struct *work)
+{
+    sfat_mcache_wb_run(container_of(work, struct sfat_mcache, wb_timer.work));
+}
+
+static void sfat_mcache_wb_kick(struct work_struct *work)
+{
+    sfat_mcache_wb_run(container_of(work, struct sfat_mcache, wb_kick));
+}
+
+/*
+ * Desc: start the writeback worker of the volume, so that the write path
+ *   only dirties the cache
+ * In:
+ *   interval_ms: how long a block stays dirty at most (about), 0 => no
+ *     timer, write_super writes the blocks back
+ *   ratio: percent of max_blocks dirty which starts the writeback at once
+ * Return:
+ *   0: success
+ *   -ENOMEM
+ */
+int sfat_mcache_wb_start(struct super_block *sb, unsigned int interval_ms, unsigned int ratio)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_mcache *mc = &sbi->mcache;
+    struct workqueue_struct *wq = NULL;
+
+    INIT_DELAYED_WORK(&mc->wb_timer, sfat_mcache_wb_timer);
+    INIT_WORK(&mc->wb_kick, sfat_mcache_wb_kick);
+
+    wq = create_singlethread_workqueue("sfat_wb");
+    if (!wq)
+    {
+        return -ENOMEM;
+    }
+
+    spin_lock(&mc->lock);
+    mc->wb_interval = msecs_to_jiffies(interval_ms);
+    mc->wb_thresh = max(1UL, mc->max_blocks * ratio / 100);
+    if (sbi->journal)
+    {
+        // commit in the background before operations have to
+        mc->wb_thresh = max(1UL, min(mc->wb_thresh, sbi->journal->limit / 2));
+    }
+    mc->wb_wq = wq;
+    if (mc->nr_dirty && mc->wb_interval)
+    {
+        queue_delayed_work(wq, &mc->wb_timer, mc->wb_interval);
+    }
+    spin_unlock(&mc->lock);
+    return 0;
+}
+
+/*
+ * Desc: stop the writeback worker, the dirty blocks stay in the cache
+ *   (for sync_fs of unmount)
+ */
+void sfat_mcache_wb_stop(struct super_block *sb)
+{
+    struct sfat_mcache *mc = &SFAT_SB(sb)->mcache;
+    struct workqueue_struct *wq = NULL;
+
+    // nothing is queued any more once wb_wq is NULL
+    spin_lock(&mc->lock);
+    wq = mc->wb_wq;
+    mc->wb_wq = NULL;
+    spin_unlock(&mc->lock);
+    if (!wq)
+    {
+        return;
+    }
+
+    cancel_delayed_work_sync(&mc->wb_timer);
+    cancel_work_sync(&mc->wb_kick);
+    destroy_workqueue(wq);
+}
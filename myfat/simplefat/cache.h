@@ -0,0 +1,100 @@
+/*
+ * cache.h
+ *
+ *  Cache of metadata blocks (FAT and directory blocks) of one volume.
+ *  Modifications only dirty the cached block, the block is written
+ *  back by the writeback worker of the volume (a timer after the first
+ *  dirtying and a dirty threshold), sync_fs, write_super or fsync.
+ */
+
+#ifndef __SFAT_CACHE_H
+#define __SFAT_CACHE_H
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+#define SFAT_MCACHE_HASH_BITS  10
+#define SFAT_MCACHE_HASH_SIZE  (1UL << SFAT_MCACHE_HASH_BITS)
+
+/* default upper limit of cached blocks per volume */
+#define SFAT_MCACHE_MAX_BLOCKS 4096
+
+/* most blocks written by one sfat_write_blocks */
+#define SFAT_WB_MAX_RUN        32
+
+/* no block, used as the bound of a range of blocks */
+#define SFAT_BLK_NONE  (~(size_t)0)
+
+struct block_holder;
+
+/*
+ * one cached block
+ */
+struct sfat_mblock {
+    struct hlist_node mb_hash;  /* in sfat_mcache.hash */
+    struct list_head mb_lru;    /* in sfat_mcache.lru, most recent at head */
+    struct list_head mb_dirty;  /* in sfat_mcache.dirty if dirty */
+
+    size_t mb_blk;              /* block no. in the volume */
+    int mb_count;               /* no. of users */
+    int mb_is_dirty;
+
+    struct block_holder *mb_bh;
+};
+
+/*
+ * all the cached blocks of one volume
+ * lock protects everything except the content of the blocks,
+ * write_mutex and the configuration of the writeback
+ */
+struct sfat_mcache {
+    spinlock_t lock;
+    struct hlist_head hash[SFAT_MCACHE_HASH_SIZE];
+    struct list_head lru;
+    struct list_head dirty;
+
+    unsigned long nr_blocks;
+    unsigned long nr_dirty;
+    unsigned long max_blocks;
+
+    // one sfat_mcache_write at a time, so that a block being written by
+    // one of them is on disk when another one (fsync) returns
+    struct mutex write_mutex;
+
+    // background writeback, see sfat_mcache_wb_start
+    struct super_block *sb;
+    struct workqueue_struct *wb_wq;  /* NULL if not running */
+    struct delayed_work wb_timer;    /* flush wb_interval after dirtying */
+    struct work_struct wb_kick;      /* flush now, wb_thresh is reached */
+    unsigned long wb_interval;       /* in jiffies, 0 => no timer */
+    unsigned long wb_thresh;         /* no. of dirty blocks */
+};
+
+int sfat_mblock_cache_init(void);
+
+void sfat_mblock_cache_destroy(void);
+
+int sfat_mcache_init(struct super_block *sb);
+
+void sfat_mcache_destroy(struct super_block *sb);
+
+struct sfat_mblock *sfat_mblock_get(struct super_block *sb, size_t blk_no, int *perror);
+
+void sfat_mblock_put(struct super_block *sb, struct sfat_mblock *mb);
+
+char *sfat_mblock_data(struct sfat_mblock *mb);
+
+void sfat_mblock_mark_dirty(struct super_block *sb, struct sfat_mblock *mb);
+
+int sfat_mcache_write(struct super_block *sb, size_t blk_lo, size_t blk_hi, size_t blk_extra);
+
+void sfat_mcache_forget(struct super_block *sb, size_t blk_no, size_t n);
+
+int sfat_mcache_wb_start(struct super_block *sb, unsigned int interval_ms, unsigned int ratio);
+
+void sfat_mcache_wb_stop(struct super_block *sb);
+
+#endif
@@ -1,6 +1,21 @@
+#include <linux/hash.h>
+#include <linux/mount.h>
+#include <linux/writeback.h>
+#include <linux/fiemap.h>
+#include <linux/log2.h>
+#include <linux/rcupdate.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+
 #include "inode.h"
 #include "sfat.h"
 #include "io.h"
+#include "super.h"
+#include "cache.h"
+#include "stats.h"
+#include "journal.h"
+#include "sfat_trace.h"
 
 
 
@@ -19,6 +34,14 @@ static void init_once(void *foo) {
     ei->i_start = 0;
     ei->i_attrs = 0;
     ei->i_pos = 0;
+    ei->i_buckets = NULL;
+    ei->i_nbuckets = 0;
+    ei->i_reshape = 0;
+    ei->i_dirty = 0;
+    ei->i_hint_idx = 0;
+    ei->i_hint_cls = SFAT_CLS_NONE;
+    init_rwsem(&ei->i_chain_sem);
+    INIT_HLIST_NODE(&ei->i_sfat_hash);
 
     inode_init_once(&ei->vfs_inode);
 }
@@ -39,6 +62,7 @@ int __init sfat_inodeinfo_cache_init(void) {
 }
 
 void sfat_inodeinfo_cache_destroy(void) {
+    rcu_barrier();  // wait for sfat_i_callback of the last inodes
     kmem_cache_destroy(sfat_cache_inodeinfo);
     sfat_cache_inodeinfo = 0;
 }
@@ -54,20 +78,33 @@ int sfat_setattr(struct dentry *de, struct iattr *attr);
 
 int sfat_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat);
 
+int sfat_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len);
+
 int sfat_readdir(struct file *filp, void *dirent, filldir_t filldir);
 
 ssize_t sfat_sync_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos);
 
 ssize_t sfat_sync_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos);
 
+int sfat_file_fsync(struct file *filp, struct dentry *dentry, int datasync);
+
+int sfat_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg);
+
+int sfat_mkdir(struct inode *dir, struct dentry *dentry, int mode);
+
+int sfat_rmdir(struct inode *dir, struct dentry *dentry);
+
+int sfat_rename(struct inode *old_dir, struct dentry *old_dentry,
+            struct inode *new_dir, struct dentry *new_dentry);
+
 // operations for a directory
 static const struct inode_operations sfat_dir_inode_operations = {
         .create = sfat_create_file,
         .lookup = sfat_lookup,
         .unlink = 0, // msdos_unlink,
-        .mkdir = 0, // msdos_mkdir,
-        .rmdir = 0, // msdos_rmdir,
-        .rename = 0, // msdos_rename,
+        .mkdir = sfat_mkdir,
+        .rmdir = sfat_rmdir,
+        .rename = sfat_rename,
         .setattr = sfat_setattr,
         .getattr = sfat_getattr,
         };
@@ -77,8 +114,8 @@ const struct file_operations sfat_dir_file_operations = {
     .llseek = generic_file_llseek,
     .read = generic_read_dir,
     .readdir = sfat_readdir,
-    .ioctl = 0, // fat_dir_ioctl, todo
-    .fsync = 0, // fat_file_fsync, todo
+    .ioctl = sfat_ioctl,
+    .fsync = sfat_file_fsync,
 };
 
 // operations for a directory
@@ -86,25 +123,32 @@ static const struct inode_operations sfat_file_inode_operations = {
     .truncate   = 0,  // fat_truncate, todo
     .setattr    = 0,  // fat_setattr, todo
     .getattr    = 0,  // fat_getattr, todo
+    .fiemap     = sfat_fiemap,
 };
 
 static const struct file_operations sfat_file_file_operations = {
-    .llseek     = 0,  // generic_file_llseek,  todo
+    .llseek     = generic_file_llseek,  // bounded by s_maxbytes
     .read       = sfat_sync_read,  // do_sync_read,
     .write      = sfat_sync_write,  // do_sync_write
     .aio_read   = 0,  // generic_file_aio_read,  todo
     .aio_write  = 0,  // generic_file_aio_write,  todo
     .mmap       = 0,  // generic_file_mmap,  todo
     .release    = 0,  // fat_file_release,  todo
-    .ioctl      = 0,  // fat_generic_ioctl,  todo
-    .fsync      = 0,  // fat_file_fsync,  todo
+    .ioctl      = sfat_ioctl,
+    .fsync      = sfat_file_fsync,
     .splice_read = 0,  // generic_file_splice_read,  todo
 };
 
 
-static const struct dentry_operations sfat_dentry_operations = {
-    .d_hash     = 0,  // msdos_hash,  todo
-    .d_compare  = 0,  // msdos_cmp,  todo
+static int sfat_hash(struct dentry *dentry, struct qstr *qstr);
+
+static int sfat_ioctl_create_batch(struct file *filp, void __user *arg);
+
+static int sfat_cmp(struct dentry *dentry, struct qstr *a, struct qstr *b);
+
+const struct dentry_operations sfat_dentry_operations = {
+    .d_hash     = sfat_hash,
+    .d_compare  = sfat_cmp,
 };
 
 /* ********** ********** ************* */
@@ -112,7 +156,7 @@ static const struct dentry_operations sfat_dentry_operations = {
 /*
  * count the number of characters till null
  */
-static inline size_t str_len(char *str, size_t max)
+static inline size_t str_len(const char *str, size_t max)
 {
     size_t count = 0;
     for (; count < max; ++count)
@@ -125,7 +169,66 @@ static inline size_t str_len(char *str, size_t max)
     return count;
 }
 
-int sfat_get_entry_content(struct sfat_fs_info *fs, struct block_device *bdev, size_t cls, size_t *next);
+/*
+ * Desc: form the on-disk name (the key in sfat_dir_entry.name)
+ *   Only the first SFAT_NAME_LEN bytes are kept, the rest is padded by '\0'.
+ * In:
+ *   name, len: name from VFS (not ended by '\0')
+ * Out:
+ *   sname: SFAT_NAME_LEN bytes
+ */
+static inline void sfat_format_name(const unsigned char *name, unsigned int len,
+        unsigned char *sname)
+{
+    unsigned int i = 0;
+
+    if (len > SFAT_NAME_LEN)
+    {
+        len = SFAT_NAME_LEN;
+    }
+
+    for (i = 0; i < len; ++i)
+    {
+        sname[i] = name[i];
+    }
+
+    for (; i < SFAT_NAME_LEN; ++i)
+    {
+        sname[i] = '\0';
+    }
+}
+
+/*
+ * Desc: hash of a name in dcache
+ *   Names sharing the same on-disk name share the same hash, so that they
+ *   end up in the same (positive or negative) dentry.
+ */
+static int sfat_hash(struct dentry *dentry, struct qstr *qstr)
+{
+    unsigned char sname[SFAT_NAME_LEN];
+
+    sfat_format_name(qstr->name, qstr->len, sname);
+    qstr->hash = full_name_hash(sname, str_len((const char *)sname, SFAT_NAME_LEN));
+    return 0;
+}
+
+/*
+ * Desc: compare two names by their on-disk names
+ * Return:
+ *   0: the same
+ *   else: different
+ */
+static int sfat_cmp(struct dentry *dentry, struct qstr *a, struct qstr *b)
+{
+    unsigned char a_sname[SFAT_NAME_LEN];
+    unsigned char b_sname[SFAT_NAME_LEN];
+
+    sfat_format_name(a->name, a->len, a_sname);
+    sfat_format_name(b->name, b->len, b_sname);
+    return memcmp(a_sname, b_sname, SFAT_NAME_LEN);
+}
+
+int sfat_get_entry_content(struct super_block *sb, size_t cls, size_t *next);
 
 
 /*
@@ -138,19 +241,22 @@ int sfat_get_entry_content(struct sfat_fs_info *fs, struct block_device *bdev, s
  * return: 0 is success
  *         < 0 is error code
  */
-static inline int sfat_seek(struct sfat_fs_info *fs, struct block_device *bdev,
+static inline int sfat_seek(struct super_block *sb,
             size_t cur_cls, loff_t pos,
             size_t *cls, size_t *offset)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     int error = 0;
 
     if (cur_cls >= fs->clusters - 1) {
         return -EINVAL;
     }
 
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
     while (pos >= fs->cluster_size)
     {
-        error = sfat_get_entry_content(fs, bdev, cur_cls, &cur_cls);
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cur_cls, &cur_cls);
         if (error)
         {
             return error;
@@ -178,8 +284,9 @@ int sfat_read_root(struct inode *inode) {
     struct sfat_sb_info *sbi = SFAT_SB(sb);
     struct sfat_inode_info *inodei = SFAT_I(inode);
     int subfiles = 0;
+    int error = 0;
 
-    printk(KERN_INFO "sfat: sfat_read_root\n");
+    sfat_dbg(1, "sfat: sfat_read_root\n");
 
     // This is root. It has no corresponding directory entry in some other directory file.
     inodei->i_pos = SFAT_ROOT_DIRENTRY_POS; // This is a special value.
@@ -196,7 +303,7 @@ int sfat_read_root(struct inode *inode) {
 
     // the size of the file for Root Dir in bytes
     inode->i_size = sbi->root_size << sbi->fs_info.cluster_bits;
-    printk(KERN_INFO "sfat: sfat_read_root inode->i_size = %lld\n", inode->i_size);
+    sfat_dbg(1, "sfat: sfat_read_root inode->i_size = %lld\n", inode->i_size);
 
     inode->i_mtime.tv_sec = inode->i_atime.tv_sec = inode->i_ctime.tv_sec = 0;
     inode->i_mtime.tv_nsec = inode->i_atime.tv_nsec = inode->i_ctime.tv_nsec = 0;
@@ -205,115 +312,206 @@ int sfat_read_root(struct inode *inode) {
     inode->i_blocks = ((inode->i_size + (sbi->fs_info.cluster_size - 1))
                & ~((loff_t)sbi->fs_info.cluster_size - 1)) >> 9;
 
-    subfiles = sfat_count_subdirs(inode);
+    if (sbi->root_buckets)
+    {
+        inodei->i_attrs |= SFAT_ATTR_HASHED;
+        error = sfat_dir_load_index(inode);
+        if (error)
+        {
+            return error;
+        }
+    }
+
+    subfiles = sfat_count_child_dirs(inode);
     if (subfiles < 0) {
         return subfiles;
     }
-    inode->i_nlink = subfiles + 2 + 1; // count in . and ..
-    printk(KERN_INFO "sfat: sfat_read_root success\n");
+    inode->i_nlink = subfiles + 2; // count in . and the .. of each subdir
+
+    sfat_dbg(1, "sfat: sfat_read_root success\n");
     return 0;
 }
 
-// count the number of subdirs
-// assumption:
-//   inode represents a directory
-// Return Value:
-//   >= 0 valid number
-//   < 0 error code
-int sfat_count_subdirs(struct inode *inode) {
-    struct super_block *sb = inode->i_sb;
-    struct block_device *bdev = sb->s_bdev;
+/*
+ * Desc: call fn for every valid entry in one directory chain, until the
+ *   end of the chain or until fn returns non-zero
+ * In:
+ *   cls: first cluster of the chain
+ *   fn, arg: the callback and its argument, which gets the entry and its
+ *            position in the volume (in byte)
+ * Return:
+ *   0: the whole chain was walked
+ *   else: the error code of the walk or the value of fn
+ */
+static int sfat_walk_chain(struct super_block *sb, size_t cls,
+        int (*fn)(struct sfat_dir_entry *de, loff_t pos, void *arg), void *arg)
+{
     struct sfat_sb_info *sbi = SFAT_SB(sb);
-    struct sfat_inode_info *inodei = SFAT_I(inode);
     struct sfat_fs_info *fs_info = &sbi->fs_info;
 
     int error = 0;
-    int count = 0;
-    size_t cls = inodei->i_start;
-    size_t size = inode->i_size; // type changing from loff_t to size_t
 
-    size_t rounds = 1 + ((size + fs_info->cluster_size - 1) >> fs_info->cluster_bits);
+    size_t rounds = fs_info->clusters;  // just for protection of loop
 
     size_t blk = 0;
 
-    struct block_holder *bh = NULL;
+    struct sfat_mblock *mb = NULL;
 
     char *data = NULL;
     struct sfat_dir_entry *de = NULL;
 
     int i, j = 0;
     // --------------------------
-    printk(KERN_INFO "sfat: sfat_count_subdirs\n");
-
-    if (size < 32) {
-        return 0; // empty directory
-    }
-
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
-    }
+    sfat_dbg(2, "sfat: sfat_walk_chain\n");
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
 
-    printk(KERN_INFO "sfat: sfat_count_subdirs  001 rounds is %zu\n", rounds);
     while (rounds > 0) {  // just for protection of loop
         --rounds;
         if (cls >= SFAT_ENTRY_MAX) {
             error = -EINVAL;
-            printk(KERN_INFO "sfat: sfat_count_subdirs  002\n");
+            sfat_dbg(3, "sfat: sfat_walk_chain  002\n");
             break;
         }
-        printk(KERN_INFO "sfat: sfat_count_subdirs  x0000\n");
         blk = CLS_TO_BLK(fs_info, cls);
-        printk(KERN_INFO "sfat: sfat_count_subdirs  x0010\n");
         for (i = 0; i < fs_info->blk_per_clus; ++i) {
-            printk(KERN_INFO "sfat: sfat_count_subdirs  003\n");
-            error = read_block(bdev, bh, sbi->fs_info.block_size, blk + i);
-            if (error) {
-                printk(KERN_INFO "sfat: sfat_count_subdirs  004\n");
+            mb = sfat_mblock_get(sb, blk + i, &error);
+            if (!mb) {
+                sfat_dbg(3, "sfat: sfat_walk_chain  004\n");
                 goto outloop;
             }
 
-            data = sfat_blkholder_get_data(bh);
+            data = sfat_mblock_data(mb);
             for (j = 0; j < fs_info->block_size; j += 32) {
-                printk(KERN_INFO "sfat: sfat_count_subdirs  005\n");
                 de = (struct sfat_dir_entry *) (data + j);
                 if (de->attr & SFAT_ATTR_EMPTY_END) {
-                    printk(KERN_INFO "sfat: sfat_count_subdirs  006\n");
+                    sfat_mblock_put(sb, mb);
                     goto outloop;
                 } else if (de->attr & SFAT_ATTR_EMPTY) {
-                    printk(KERN_INFO "sfat: sfat_count_subdirs  007\n");
                     continue;
-                } else {
-                    printk(KERN_INFO "sfat: sfat_count_subdirs  008\n");
-                    ++count;
+                }
+                error = fn(de, form_dir_entry_pos(fs_info, cls, i, j), arg);
+                if (error) {
+                    sfat_mblock_put(sb, mb);
+                    goto outloop;
                 }
             }
+            sfat_mblock_put(sb, mb);
         }
-        printk(KERN_INFO "sfat: sfat_count_subdirs  009\n");
-        error = sfat_get_entry_content(fs_info, bdev, cls, &cls);
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cls, &cls);
         // read error or abnormal cluster normal
         if (error || cls > fs_info->clusters) {
-            printk(KERN_INFO "sfat: sfat_count_subdirs  020\n");
+            sfat_dbg(3, "sfat: sfat_walk_chain  020\n");
             break;
         }
     }
 
 outloop:
-    printk(KERN_INFO "sfat: sfat_count_subdirs  x0030\n");
     // loop in the fat chain
     if (rounds == 0) {
         error = -EINVAL;
     }
+    return error;
+}
 
-    sfat_blkholder_free(bh);
-    if (error) {
-        printk(KERN_INFO "sfat: sfat_count_subdirs  031\n");
-        return error;
-    } else {
-        printk(KERN_INFO "sfat: sfat_count_subdirs  032 count is %d\n", count);
-        return count;
+static int sfat_count_entry(struct sfat_dir_entry *de, loff_t pos, void *arg)
+{
+    ++*(int *)arg;
+    return 0;
+}
+
+/*
+ * Desc: count the valid entries in one directory chain
+ * In:
+ *   cls: first cluster of the chain
+ * Return:
+ *   >= 0 valid number
+ *   < 0 error code
+ */
+static int sfat_count_chain_entries(struct super_block *sb, size_t cls)
+{
+    int count = 0;
+    int error = sfat_walk_chain(sb, cls, sfat_count_entry, &count);
+
+    sfat_dbg(2, "sfat: sfat_count_chain_entries count is %d\n", count);
+    return error? error: count;
+}
+
+// count the number of subdirs
+// assumption:
+//   inode represents a directory
+// Return Value:
+//   >= 0 valid number
+//   < 0 error code
+int sfat_count_subdirs(struct inode *inode) {
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+
+    int count = 0;
+    int ret = 0;
+    unsigned int i = 0;
+    // --------------------------
+    sfat_dbg(2, "sfat: sfat_count_subdirs\n");
+
+    if (inode->i_size < 32) {
+        return 0; // empty directory
+    }
+
+    if (!inodei->i_buckets) {
+        return sfat_count_chain_entries(inode->i_sb, inodei->i_start);
+    }
+
+    for (i = 0; i < inodei->i_nbuckets; ++i) {
+        ret = sfat_count_chain_entries(inode->i_sb, inodei->i_buckets[i]);
+        if (ret < 0) {
+            return ret;
+        }
+        count += ret;
+    }
+
+    sfat_dbg(2, "sfat: sfat_count_subdirs count is %d\n", count);
+    return count;
+}
+
+static int sfat_count_dir_entry(struct sfat_dir_entry *de, loff_t pos, void *arg)
+{
+    if (de->attr & SFAT_ATTR_DIR)
+    {
+        ++*(int *)arg;
+    }
+    return 0;
+}
+
+/*
+ * Desc: count the directories in a directory, for its link count
+ * In:
+ *   inode: the directory
+ * Return:
+ *   >= 0 valid number
+ *   < 0 error code
+ */
+int sfat_count_child_dirs(struct inode *inode)
+{
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    int count = 0;
+    int error = 0;
+    unsigned int i = 0;
+
+    if (inode->i_size < 32)
+    {
+        return 0; // empty directory
+    }
+
+    if (!inodei->i_buckets)
+    {
+        error = sfat_walk_chain(inode->i_sb, inodei->i_start, sfat_count_dir_entry, &count);
+    }
+    for (i = 0; !error && inodei->i_buckets && i < inodei->i_nbuckets; ++i)
+    {
+        error = sfat_walk_chain(inode->i_sb, inodei->i_buckets[i], sfat_count_dir_entry, &count);
     }
 
+    sfat_dbg(2, "sfat: sfat_count_child_dirs count is %d\n", count);
+    return error? error: count;
 }
 
 /*
@@ -321,12 +519,12 @@ outloop:
  * return: 0 is success
  *         < 0 is error code
  */
-int sfat_get_entry_content(struct sfat_fs_info *fs, struct block_device *bdev, size_t cls,
-        size_t *next) {
+int sfat_get_entry_content(struct super_block *sb, size_t cls, size_t *next) {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     size_t blk = 0; // block
     size_t pos = 0; // entry location in the block in bytes
 
-    struct block_holder *bh = NULL;
+    struct sfat_mblock *mb = NULL;
     int error = 0;
 
     if (cls >= fs->clusters - 1) {
@@ -338,57 +536,195 @@ int sfat_get_entry_content(struct sfat_fs_info *fs, struct block_device *bdev, s
 
     blk = blk + fs->fat_start_blk;
 
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
+    sfat_stat_inc(sb, SFAT_STAT_FAT_LOOKUP);
+    mb = sfat_mblock_get(sb, blk, &error);
+    if (!mb) {
+        return error;
     }
 
-    error = read_block(bdev, bh, fs->block_size, blk);
-    if (error) {
-        sfat_blkholder_free(bh);
+    *next = le32_to_cpu(*(__le32 *)(sfat_mblock_data(mb) + pos));
+    trace_sfat_fat_get(sb, cls, *next);
+
+    sfat_mblock_put(sb, mb);
+    return 0;
+}
+
+/*
+ * Desc: memory for a table of n buckets, which may be too large for
+ *   kmalloc (see SFAT_DIR_MAX_BUCKETS)
+ */
+static u32 *sfat_dir_alloc_buckets(unsigned int n)
+{
+    if (n * sizeof(u32) <= PAGE_SIZE)
+    {
+        return kmalloc(n * sizeof(u32), GFP_NOFS);
+    }
+    return vmalloc(n * sizeof(u32));
+}
+
+static void sfat_dir_free_buckets(u32 *buckets)
+{
+    if (is_vmalloc_addr(buckets))
+    {
+        vfree(buckets);
+    }
+    else
+    {
+        kfree(buckets);
+    }
+}
+
+/*
+ * Desc: load the index of a hashed directory into inode_info
+ *   The table of buckets goes on from block to block and from cluster to
+ *   cluster of the chain of the directory.
+ * In:
+ *   dir: directory with SFAT_ATTR_HASHED, i_start must be valid
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+int sfat_dir_load_index(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    struct sfat_inode_info *inodei = SFAT_I(dir);
+
+    struct sfat_mblock *mb = NULL;
+    struct sfat_dir_index *idx = NULL;
+    u32 *buckets = NULL;
+    size_t cls = inodei->i_start;
+    size_t blk = 0;  // in the cluster
+    unsigned int per_blk = fs->block_size / sizeof(__le32);
+    unsigned int w = 0;  // word in the block
+    unsigned int n = 0;
+    unsigned int i = 0;
+    int error = 0;
+
+    if (cls >= fs->clusters) {
+        return -EINVAL;
+    }
+
+    mb = sfat_mblock_get(sb, CLS_TO_BLK(fs, cls), &error);
+    if (!mb) {
         return error;
     }
 
-    *next = le32_to_cpu((__le32 *)(sfat_blkholder_get_data(bh) + pos));
+    idx = (struct sfat_dir_index *)sfat_mblock_data(mb);
+    n = le32_to_cpu(idx->buckets);
+    if (SFAT_DIR_INDEX_MAGIC != le32_to_cpu(idx->magic)
+        || 0 == n || n > SFAT_DIR_MAX_BUCKETS)
+    {
+        printk(KERN_ERR "sfat: bad directory index at cluster %zu\n", inodei->i_start);
+        error = -EINVAL;
+        goto out;
+    }
+
+    buckets = sfat_dir_alloc_buckets(n);
+    if (!buckets) {
+        error = -ENOMEM;
+        goto out;
+    }
 
-    sfat_blkholder_free(bh);
-    return 0;
+    w = offsetof(struct sfat_dir_index, bucket) / sizeof(__le32);
+    for (i = 0; i < n; ++i, ++w)
+    {
+        if (w == per_blk)  // on to the next block of the index
+        {
+            sfat_mblock_put(sb, mb);
+            mb = NULL;
+            w = 0;
+            if (++blk == fs->blk_per_clus)
+            {
+                blk = 0;
+                error = sfat_get_entry_content(sb, cls, &cls);
+                if (!error && cls >= fs->clusters) {
+                    error = -EINVAL;  // the chain is shorter than the index
+                }
+                if (error) {
+                    goto fail;
+                }
+            }
+            mb = sfat_mblock_get(sb, CLS_TO_BLK(fs, cls) + blk, &error);
+            if (!mb) {
+                goto fail;
+            }
+        }
+        buckets[i] = le32_to_cpu(((__le32 *)sfat_mblock_data(mb))[w]);
+        if (buckets[i] >= fs->clusters) {
+            error = -EINVAL;
+            goto fail;
+        }
+    }
+
+    sfat_dir_free_buckets(inodei->i_buckets);
+    inodei->i_buckets = buckets;
+    inodei->i_nbuckets = n;
+    goto out;
+
+fail:
+    printk(KERN_ERR "sfat: bad directory index at cluster %zu\n", inodei->i_start);
+    sfat_dir_free_buckets(buckets);
+out:
+    if (mb) {
+        sfat_mblock_put(sb, mb);
+    }
+    return error;
+}
+
+/*
+ * Desc: the first cluster of the chain which holds (or would hold) name
+ *   For a linear directory this is the directory itself, for a hashed
+ *   directory it is the bucket of the name. The index is in memory and
+ *   only changes under the i_mutex of dir, which the caller holds, so no
+ *   block is read and no lock is taken here.
+ * In:
+ *   name: SFAT_NAME_LEN bytes, padded by '\0'
+ */
+static inline size_t sfat_dir_chain_start(struct inode *dir, const unsigned char *name)
+{
+    struct sfat_inode_info *inodei = SFAT_I(dir);
+
+    if (!inodei->i_buckets)
+    {
+        return inodei->i_start;
+    }
+    return inodei->i_buckets[sfat_dir_bucket(sfat_name_hash(name), inodei->i_nbuckets)];
 }
 
 /*
  * Scans a directory for a given file
  * Input:
- *   fs:
- *   bdev:
+ *   sb:
  *   start_cls: start cluster to be searched
  *   name: name of the file, length is at least SFAT_NAME_LEN (padded by \0)
  * Output:
  *   de: directory entry if found
  *   cls:
- *   blk:
+ *   blk: block no. in the cluster
  *   offset:
  * Return:
  *   0: success
  *   < 0: error code
  *
  */
-int sfat_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
+int sfat_dentry_locate(struct super_block *sb,
         size_t start_cls, const unsigned char *name,
          struct sfat_dir_entry *de, size_t *cls, size_t *blk, size_t *offset)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     size_t i, j, k = 0;
     size_t cur_cls = start_cls;
     size_t cur_blk = 0;
     struct sfat_dir_entry *ent = NULL;
 
-    struct block_holder *bh = NULL;
+    struct sfat_mblock *mb = NULL;
+    unsigned long visited = 0;  // entries examined
     int found = 0;
     int error = 0;
 
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
-    }
+    sfat_stat_inc(sb, SFAT_STAT_DIR_SCAN);
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
 
     for (i = 0; i < fs->clusters; ++i)  // just for protection
     {
@@ -398,17 +734,19 @@ int sfat_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
         {
 
             // read block
-            error = read_block(bdev, bh, fs->block_size, cur_blk++);
-            if (error) {
+            mb = sfat_mblock_get(sb, cur_blk + j, &error);
+            if (!mb) {
                 goto outloop;
             }
 
-            ent = (struct sfat_dir_entry *)sfat_blkholder_get_data(bh);
+            ent = (struct sfat_dir_entry *)sfat_mblock_data(mb);
 
             for (k = 0; k < fs->dirent_per_blk; ++k)
             {
+                ++visited;
                 if (ent[k].attr & SFAT_ATTR_EMPTY_END)
                 {
+                    sfat_mblock_put(sb, mb);
                     goto outloop;
                 }
                 else if (ent[k].attr & SFAT_ATTR_EMPTY)
@@ -422,16 +760,19 @@ int sfat_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
                     {
                         memcpy(de, &ent[k], sizeof(struct sfat_dir_entry));
                         *cls = cur_cls;
-                        *blk = cur_blk;
+                        *blk = j;  // in the cluster
                         *offset = k * sizeof(struct sfat_dir_entry);
                         found = 1;
+                        sfat_mblock_put(sb, mb);
                         goto outloop;
                     }
                 }
             }
+            sfat_mblock_put(sb, mb);
         }
 
-        error = sfat_get_entry_content(fs, bdev, cur_cls, &cur_cls);
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cur_cls, &cur_cls);
         if (error || cur_cls > fs->clusters)
         {
             goto outloop;
@@ -439,7 +780,7 @@ int sfat_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
     }
 
 outloop:
-    sfat_blkholder_free(bh);
+    sfat_stat_add(sb, SFAT_STAT_DIRENT_VISIT, visited);
 
     if (error)
     {
@@ -459,11 +800,11 @@ outloop:
 /*
  * Scans a directory for a free entry
  * Input:
- *   fs:
- *   bdev:
- *   bh: block_holder: holding the data for the whole block
+ *   sb:
  *   start_cls: start cluster to be searched
  * Output:
+ *   pmb: the cached block holding the free entry (release it by
+ *        sfat_mblock_put) if found
  *   cls:
  *   blk:
  *   offset:
@@ -472,18 +813,22 @@ outloop:
  *   < 0: error code
  *
  */
-int sfat_free_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
-        struct block_holder *bh,
+int sfat_free_dentry_locate(struct super_block *sb, struct sfat_mblock **pmb,
         size_t start_cls, size_t *cls, size_t *blk, size_t *offset)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     size_t i, j, k = 0;
     size_t cur_cls = start_cls;
     size_t cur_blk = 0;
     struct sfat_dir_entry *ent = NULL;
+    struct sfat_mblock *mb = NULL;
 
     int found = 0;
     int error = 0;
 
+    sfat_stat_inc(sb, SFAT_STAT_DIR_SCAN);
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
+
     for (i = 0; i < fs->clusters; ++i)  // just for protection
     {
         cur_blk = CLS_TO_BLK(fs, cur_cls);
@@ -491,12 +836,12 @@ int sfat_free_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
         for (j = 0; j < fs->blk_per_clus; ++j)
         {
             // read block
-            error = read_block(bdev, bh, fs->block_size, cur_blk);
-            if (error) {
+            mb = sfat_mblock_get(sb, cur_blk, &error);
+            if (!mb) {
                 goto outloop;
             }
 
-            ent = (struct sfat_dir_entry *)sfat_blkholder_get_data(bh);
+            ent = (struct sfat_dir_entry *)sfat_mblock_data(mb);
 
             // search the entries in one block
             for (k = 0; k < fs->dirent_per_blk; ++k)
@@ -507,6 +852,7 @@ int sfat_free_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
                     *cls = cur_cls;
                     *blk = cur_blk - CLS_TO_BLK(fs, cur_cls);
                     *offset = k * sizeof(struct sfat_dir_entry);
+                    *pmb = mb;
                     found = 1;
                     goto outloop;
                 }
@@ -515,10 +861,12 @@ int sfat_free_dentry_locate(struct sfat_fs_info *fs, struct block_device *bdev,
                     continue;
                 }
             }
+            sfat_mblock_put(sb, mb);
             ++cur_blk;
         }
 
-        error = sfat_get_entry_content(fs, bdev, cur_cls, &cur_cls);
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cur_cls, &cur_cls);
         if (error || cur_cls > (fs->clusters)) {
             goto outloop;
         }
@@ -573,7 +921,7 @@ void sfat_form_dir_entry(struct sfat_dir_entry *de, int isdir,
 
     de->attr = isdir? SFAT_ATTR_DIR: SFAT_ATTR_NONE;
     de->size = cpu_to_le32(size);
-    printk(KERN_INFO "sfat: sfat_form_dir_entry, file size is %u\n", le32_to_cpu(de->size));
+    sfat_dbg(3, "sfat: sfat_form_dir_entry, file size is %u\n", le32_to_cpu(de->size));
     de->fst_cls_no = cpu_to_le32(size? start_cls: SFAT_ENTRY_FREE);
 
     de->crt_time =     cpu_to_le32(ts->tv_sec);
@@ -583,96 +931,148 @@ void sfat_form_dir_entry(struct sfat_dir_entry *de, int isdir,
 }
 
 /*
- * Desc: Find the free entry in FAT (scanning from the beginning)
- *       allocate it (initialize it by SFAT_ENTRY_EOC) once found.
- * Input:
- * Output:
- *   cls: 
+ * Desc: Find a free entry of one allocation group in FAT, scanning from
+ *       cluster from to the end of the group and wrapping around to its
+ *       start, and allocate it (initialize it by SFAT_ENTRY_EOC).
+ *       The caller holds ag->lock.
+ * Out:
+ *   cls: the cluster allocated
  * Return:
- *   < 0: error
+ *   -ENOSPC: the group is full
+ *   < 0: other error
  *   0: success
- *
  */
-int sfat_fat_entry_acquire(struct sfat_fs_info *fs, struct block_device *bdev, size_t *cls)
+static int sfat_ag_claim(struct super_block *sb, struct sfat_alloc_group *ag,
+        size_t from, size_t *cls)
 {
+    struct sfat_fs_info *fs = &SFAT_SB(sb)->fs_info;
+    size_t per_blk_mask = (fs->block_size >> 2) - 1;
+    size_t c = from;
+    size_t n = 0;
+    unsigned long blk = SFAT_BLK_NONE;
     int error = 0;
 
-    unsigned long blk = fs->fat_start_blk;
-    unsigned long blk_end = blk + fs->fat_length_blk;
-
-    struct block_holder *bh = NULL;
+    struct sfat_mblock *mb = NULL;
     __le32 *ent = NULL;
-    __le32 *ent_end = NULL;
-
-    char * data = NULL;
-    int kkk = 0;
 
-    printk(KERN_INFO "sfat: sfat_fat_entry_acquire, fat table starts at %lu\n", blk * 512);
-
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
+    if (!ag->free)
+    {
+        return -ENOSPC;
     }
-    // data = sfat_blkholder_get_data(bh);
 
-    while (blk < blk_end)
+    for (; n < ag->end - ag->start; ++n, ++c)
     {
-        error = read_block(bdev, bh, fs->block_size, blk);
-
-        if (error)
-        {
-            sfat_blkholder_free(bh);
-            return -EIO;
-        }
-        data = sfat_blkholder_get_data(bh);
-        ent = (__le32 *)data;
-        ent_end = (__le32 *)(data + fs->block_size);
-
-        if (0 == kkk)
+        if (c >= ag->end)
         {
-            printk(KERN_INFO "sfat: sfat_fat_entry_acquire  ent[0] is %x\n", le32_to_cpu(*(ent+0)));
-            printk(KERN_INFO "sfat: sfat_fat_entry_acquire  ent[1] is %x\n", le32_to_cpu(*(ent+1)));
-            printk(KERN_INFO "sfat: sfat_fat_entry_acquire  ent[2] is %x\n", le32_to_cpu(*(ent+2)));
-            ++kkk;
+            c = ag->start;
         }
-
-        while (ent < ent_end)
+        if (fs->fat_start_blk + (c >> (fs->block_bits - 2)) != blk)
         {
-            if (le32_to_cpu(*ent) == 0)
+            if (mb)
             {
-                // printk(KERN_INFO "sfat: sfat_fat_entry_acquire  SFAT_ENTRY_FREE is %x\n", SFAT_ENTRY_FREE);
-
-                // printk(KERN_INFO "sfat: sfat_fat_entry_acquire  ent is 0\n");
+                sfat_mblock_put(sb, mb);
             }
-            else
+            blk = fs->fat_start_blk + (c >> (fs->block_bits - 2));
+            sfat_stat_inc(sb, SFAT_STAT_FAT_SCAN_BLK);
+            mb = sfat_mblock_get(sb, blk, &error);
+            if (!mb)
             {
-                // printk(KERN_INFO "sfat: sfat_fat_entry_acquire  ent is %x\n", le32_to_cpu(*ent));
+                return error;
             }
+            ent = (__le32 *)sfat_mblock_data(mb);
+        }
 
-
-            if (SFAT_ENTRY_FREE == le32_to_cpu(*ent))
-            {
-                printk(KERN_INFO "sfat: sfat_fat_entry_acquire  0050\n");
-                *ent = cpu_to_le32(SFAT_ENTRY_EOC);
-                error = write_block(bdev, bh, fs->block_size, blk);
-                if (error)
-                {
-                    printk(KERN_INFO "sfat: sfat_fat_entry_acquire  0070\n");
-                    sfat_blkholder_free(bh);
-                    return -EIO;
-                }
-                *cls = ((blk - fs->fat_start_blk) << (fs->block_bits - 2)) + (ent - (__le32 *)data);
-                printk(KERN_INFO "sfat: sfat_fat_entry_acquire  ret cls is %u\n", *cls);
-                sfat_blkholder_free(bh);
-                return 0;
-            }
-            ++ent;
+        if (SFAT_ENTRY_FREE == le32_to_cpu(ent[c & per_blk_mask]))
+        {
+            ent[c & per_blk_mask] = cpu_to_le32(SFAT_ENTRY_EOC);
+            sfat_mblock_mark_dirty(sb, mb);
+            sfat_mblock_put(sb, mb);
+            *cls = c;
+            --ag->free;
+            percpu_counter_dec(&SFAT_SB(sb)->free_clusters);
+            ag->next_free = c + 1 < ag->end? c + 1: ag->start;
+            return 0;
         }
-        ++blk;
+    }
+    if (mb)
+    {
+        sfat_mblock_put(sb, mb);
     }
 
-    sfat_blkholder_free(bh);
-    return -ENOENT;
+    // the count was wrong, don't scan the group again for nothing
+    printk(KERN_ERR "sfat: allocation group at cluster %lu has no free cluster"
+            " but counts %lu\n", ag->start, ag->free);
+    percpu_counter_sub(&SFAT_SB(sb)->free_clusters, ag->free);
+    ag->free = 0;
+    return -ENOSPC;
+}
+
+/*
+ * Desc: Allocate a free cluster (its entry in FAT is set to SFAT_ENTRY_EOC).
+ *       The search starts in the allocation group of goal, at goal itself,
+ *       so that a file appending after cluster c passes c + 1 and gets
+ *       contiguous clusters where possible. Without a goal (SFAT_CLS_NONE)
+ *       it starts in the group of the current cpu, so that writers on
+ *       different cpus take different group locks and FAT blocks. Full
+ *       groups are skipped for the following ones.
+ * Input:
+ *   goal: cluster wanted or SFAT_CLS_NONE
+ * Output:
+ *   cls: 
+ * Return:
+ *   < 0: error
+ *   0: success
+ *
+ */
+int sfat_fat_entry_acquire(struct super_block *sb, size_t goal, size_t *cls)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_alloc_group *ag = NULL;
+    unsigned long g = 0;
+    unsigned long n = 0;
+    int error = 0;
+
+    if (!sbi->nr_groups)
+    {
+        return -ENOSPC;
+    }
+    if (goal < sbi->fs_info.clusters)
+    {
+        g = goal >> sbi->group_bits;
+    }
+    else
+    {
+        g = raw_smp_processor_id() % sbi->nr_groups;
+        goal = SFAT_CLS_NONE;
+    }
+
+    for (; n < sbi->nr_groups; ++n, g = (g + 1) % sbi->nr_groups)
+    {
+        ag = &sbi->groups[g];
+        if (!ag->free)  // unlocked peek, checked again under the lock
+        {
+            continue;
+        }
+        mutex_lock(&ag->lock);
+        error = sfat_ag_claim(sb, ag, 0 == n && goal != SFAT_CLS_NONE? goal: ag->next_free, cls);
+        if (!error)
+        {
+            trace_sfat_alloc(sb, *cls, g, ag->free);
+        }
+        mutex_unlock(&ag->lock);
+
+        if (!error)
+        {
+            sfat_dbg(2, "sfat: sfat_fat_entry_acquire  ret cls is %zu\n", *cls);
+            sfat_stat_inc(sb, SFAT_STAT_CLS_ALLOC);
+            return 0;
+        }
+        if (error != -ENOSPC)
+        {
+            return error;
+        }
+    }
+    return -ENOSPC;
 }
 
 /*
@@ -686,13 +1086,13 @@ int sfat_fat_entry_acquire(struct sfat_fs_info *fs, struct block_device *bdev, s
  *
  *
  */
-int sfat_fat_entry_modify(struct sfat_fs_info *fs, struct block_device *bdev,
-                                size_t cls, __le32 attr)
+int sfat_fat_entry_modify(struct super_block *sb, size_t cls, __le32 attr)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     size_t blk = 0; // block
     size_t pos = 0; // entry location in the block in bytes
 
-    struct block_holder *bh = NULL;
+    struct sfat_mblock *mb = NULL;
     int error = 0;
     __le32 *ent = NULL;
 
@@ -705,27 +1105,17 @@ int sfat_fat_entry_modify(struct sfat_fs_info *fs, struct block_device *bdev,
 
     blk = blk + fs->fat_start_blk;
 
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
-    }
-
-    error = read_block(bdev, bh, fs->block_size, blk);
-    if (error) {
-        sfat_blkholder_free(bh);
+    mb = sfat_mblock_get(sb, blk, &error);
+    if (!mb) {
         return error;
     }
 
-    ent = (__le32*)(sfat_blkholder_get_data(bh) + pos);
+    ent = (__le32*)(sfat_mblock_data(mb) + pos);
     *ent = attr;
-    
-    error = write_block(bdev, bh, fs->block_size, blk);
-    if (error) {
-        sfat_blkholder_free(bh);
-        return error;
-    }
+    trace_sfat_fat_set(sb, cls, le32_to_cpu(attr));
+    sfat_mblock_mark_dirty(sb, mb);
 
-    sfat_blkholder_free(bh);
+    sfat_mblock_put(sb, mb);
     return 0;
 }
 
@@ -738,17 +1128,20 @@ int sfat_fat_entry_modify(struct sfat_fs_info *fs, struct block_device *bdev,
  *   0: success
  *   < 0: error code
  */
-int sfat_file_append_cls(struct sfat_fs_info *fs, struct block_device *bdev, size_t start_cls, size_t end_cls)
+int sfat_file_append_cls(struct super_block *sb, size_t start_cls, size_t end_cls)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     int error = 0;
     size_t cur_cls = start_cls;
     size_t next_cls = start_cls;
     unsigned long counter = fs->clusters;
 
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
     while (counter > 0)  // just an extra protection
     {
         --counter;
-        error = sfat_get_entry_content(fs, bdev, cur_cls, &next_cls);
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cur_cls, &next_cls);
         if (error < 0)
         {
             return error;
@@ -757,7 +1150,7 @@ int sfat_file_append_cls(struct sfat_fs_info *fs, struct block_device *bdev, siz
         {
             if (SFAT_ENTRY_EOC == next_cls)
             {
-                return sfat_fat_entry_modify(fs, bdev, cur_cls, cpu_to_le32(end_cls));
+                return sfat_fat_entry_modify(sb, cur_cls, cpu_to_le32(end_cls));
 
             }
             else if (next_cls > fs->clusters)  // stop prematurely
@@ -774,7 +1167,191 @@ int sfat_file_append_cls(struct sfat_fs_info *fs, struct block_device *bdev, siz
 }
 
 
+/*
+ * Desc: free the cluster chain of a file which is gone. Each entry is set
+ *   to SFAT_ENTRY_FREE under the lock of its allocation group and counted
+ *   back to the group.
+ *   The caller makes this one journal operation.
+ * In:
+ *   start_cls: the first cluster of the chain
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+int sfat_fat_chain_release(struct super_block *sb, size_t start_cls)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs = &sbi->fs_info;
+    struct sfat_alloc_group *ag = NULL;
+    size_t cls = start_cls;
+    size_t next_cls = 0;
+    unsigned long counter = fs->clusters;
+    int error = 0;
+
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
+    while (counter > 0)  // just an extra protection
+    {
+        --counter;
+        if (cls >= fs->clusters)
+        {
+            return -EINVAL;
+        }
+        error = sfat_get_entry_content(sb, cls, &next_cls);
+        if (error)
+        {
+            return error;
+        }
+
+        ag = &sbi->groups[cls >> sbi->group_bits];
+        mutex_lock(&ag->lock);
+        error = sfat_fat_entry_modify(sb, cls, cpu_to_le32(SFAT_ENTRY_FREE));
+        if (!error)
+        {
+            ++ag->free;
+            percpu_counter_inc(&sbi->free_clusters);
+        }
+        mutex_unlock(&ag->lock);
+        if (error)
+        {
+            return error;
+        }
+        sfat_stat_inc(sb, SFAT_STAT_CLS_FREE);
+
+        if (SFAT_ENTRY_EOC == next_cls)
+        {
+            return 0;
+        }
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        cls = next_cls;
+    }
+    return -EINVAL;
+}
+
+/*
+ * Desc: set up the allocation groups and count their free entries in FAT,
+ *   done once at mount so that statfs only has to read sbi->free_clusters
+ *   afterwards.
+ *   The blocks are read directly instead of through the cache, so the
+ *   scan doesn't push the useful blocks out of it.
+ *   sbi->groups is freed by put_super (or the error path of fill_super).
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+int sfat_count_free_clusters(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs = &sbi->fs_info;
+
+    unsigned long blk = fs->fat_start_blk;
+    unsigned long blk_end = blk + fs->fat_length_blk;
+    unsigned long cls = 0;
+    unsigned long free = 0;
+    unsigned long i = 0;
+
+    struct block_holder *bh = NULL;
+    __le32 *ent = NULL;
+    __le32 *ent_end = NULL;
+    int error = 0;
+
+    sbi->group_bits = ilog2(SFAT_AG_FAT_BLKS) + fs->block_bits - 2;
+    sbi->nr_groups = (fs->clusters + (1UL << sbi->group_bits) - 1) >> sbi->group_bits;
+    sbi->groups = kcalloc(sbi->nr_groups, sizeof(struct sfat_alloc_group), GFP_KERNEL);
+    if (!sbi->groups)
+    {
+        sbi->nr_groups = 0;
+        return -ENOMEM;
+    }
+    for (i = 0; i < sbi->nr_groups; ++i)
+    {
+        mutex_init(&sbi->groups[i].lock);
+        sbi->groups[i].start = i << sbi->group_bits;
+        sbi->groups[i].end = min(fs->clusters, (i + 1) << sbi->group_bits);
+        sbi->groups[i].next_free = sbi->groups[i].start;
+    }
+
+    bh = sfat_blkholder_alloc();
+    if (!bh) {
+        return -ENOMEM;
+    }
+
+    for (; blk < blk_end && cls < fs->clusters; ++blk)
+    {
+        error = sfat_read_block(sb, bh, blk);
+        if (error)
+        {
+            sfat_blkholder_free(bh);
+            return error;
+        }
+
+        ent = (__le32 *)sfat_blkholder_get_data(bh);
+        ent_end = (__le32 *)(sfat_blkholder_get_data(bh) + fs->block_size);
+        for (; ent < ent_end && cls < fs->clusters; ++ent, ++cls)
+        {
+            if (SFAT_ENTRY_FREE == le32_to_cpu(*ent))
+            {
+                ++sbi->groups[cls >> sbi->group_bits].free;
+                ++free;
+            }
+        }
+    }
+
+    sfat_blkholder_free(bh);
+
+    error = percpu_counter_init(&sbi->free_clusters, free);
+    if (error)
+    {
+        return error;
+    }
+
+    printk(KERN_INFO "sfat: %lu of %lu clusters are free in %lu allocation groups\n",
+            free, fs->clusters, sbi->nr_groups);
+    return 0;
+}
+
 /* doesn't deal with root inode */
+/*
+ * Desc: size of the file of an entry; an entry of a file over 4GB
+ *   (SFAT_ATTR_LARGE) has the high 32 bits in place of the creation time
+ */
+static inline loff_t sfat_entry_size(const struct sfat_dir_entry *de)
+{
+    const struct sfat_dir_entry_large *lde = (const struct sfat_dir_entry_large *)de;
+    loff_t size = le32_to_cpu(de->size);
+
+    if (de->attr & SFAT_ATTR_LARGE)
+    {
+        size |= (loff_t)le32_to_cpu(lde->size_hi) << 32;
+    }
+    return size;
+}
+
+/*
+ * Desc: store the size and the times of an inode into its entry, as an
+ *   extended entry (SFAT_ATTR_LARGE) if the size doesn't fit in 32 bits.
+ *   Such a size is only reached on a volume with SFAT_FEATURE_LARGEFILE
+ *   (see s_maxbytes).
+ */
+static void sfat_entry_store(struct sfat_dir_entry *de, struct inode *inode)
+{
+    struct sfat_dir_entry_large *lde = (struct sfat_dir_entry_large *)de;
+    u64 size = i_size_read(inode);
+
+    de->size = cpu_to_le32((u32)size);
+    if (size >> 32)
+    {
+        de->attr |= SFAT_ATTR_LARGE;
+        lde->size_hi = cpu_to_le32((u32)(size >> 32));
+    }
+    else
+    {
+        de->attr &= ~SFAT_ATTR_LARGE;
+        de->crt_time = cpu_to_le32(inode->i_ctime.tv_sec);
+    }
+    de->lst_acc_time = cpu_to_le32(inode->i_atime.tv_sec);
+    de->wrt_time =     cpu_to_le32(inode->i_mtime.tv_sec);
+}
+
 /*
  * fill an inode (along with inode_info) based on the information in dir_entry
  * and the position info
@@ -795,7 +1372,13 @@ static int sfat_fill_inode(struct inode *inode, struct sfat_dir_entry *de, loff_
     inode->i_version++;
     inode->i_generation = get_seconds();
 
-    printk(KERN_INFO "sfat: sfat_fill_inode, file size is %u\n", le32_to_cpu(de->size));
+    sfat_dbg(2, "sfat: sfat_fill_inode, file size is %u\n", le32_to_cpu(de->size));
+
+    // the chain must be known before the directory is scanned
+    inode_info->i_start = le32_to_cpu(de->fst_cls_no);
+    inode_info->i_attrs = de->attr;
+    inode_info->i_pos = i_pos;
+
     if (de->attr & SFAT_ATTR_DIR) {  // is a directory
         inode->i_generation &= ~1;  // This line is copied from FAT, no reason why
         inode->i_mode = sfat_make_mode(sbi, de->attr, S_IRWXUGO);
@@ -804,18 +1387,25 @@ static int sfat_fill_inode(struct inode *inode, struct sfat_dir_entry *de, loff_
 
         inode->i_size = le32_to_cpu(de->size);
 
-        subfiles = sfat_count_subdirs(inode);
+        if (de->attr & SFAT_ATTR_HASHED) {
+            int error = sfat_dir_load_index(inode);
+            if (error) {
+                return error;
+            }
+        }
+
+        subfiles = sfat_count_child_dirs(inode);
         if (subfiles < 0) {
-            subfiles = 0;  // todo error checking
+            return subfiles;
         }
-        inode->i_nlink = subfiles;
+        inode->i_nlink = subfiles + 2; // its entry, . and the .. of each subdir
     } else { /* not a directory */
         inode->i_generation |= 1;
         inode->i_mode = sfat_make_mode(sbi, de->attr, S_IRWXUGO);
         inode->i_op = &sfat_file_inode_operations;
         inode->i_fop = &sfat_file_file_operations;
 
-        inode->i_size = le32_to_cpu(de->size);
+        inode->i_size = sfat_entry_size(de);
     }
 
     // no. of blocks consumed by the file
@@ -823,17 +1413,117 @@ static int sfat_fill_inode(struct inode *inode, struct sfat_dir_entry *de, loff_
                & ~((loff_t)fs->cluster_size - 1)) >> fs->block_bits;
 
     inode->i_mtime.tv_sec = le32_to_cpu(de->wrt_time);
-    inode->i_ctime.tv_sec = le32_to_cpu(de->crt_time);
+    inode->i_ctime.tv_sec = (de->attr & SFAT_ATTR_LARGE)?
+        le32_to_cpu(de->wrt_time): le32_to_cpu(de->crt_time);
     inode->i_atime.tv_sec = le32_to_cpu(de->lst_acc_time);
-
-    inode_info->i_start = le32_to_cpu(de->fst_cls_no);
-    inode_info->i_attrs = de->attr;
-    inode_info->i_pos = i_pos;
     return 0;
 }
 
+/* ********** ********** ************* */
+/* inodes hashed by i_pos (copied from fat) */
+
+static inline unsigned long sfat_hash_pos(loff_t i_pos)
+{
+    return hash_32((u32)(i_pos >> 5), SFAT_HASH_BITS);  // one entry is 32 bytes
+}
+
+static void sfat_attach(struct inode *inode, loff_t i_pos)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(inode->i_sb);
+    struct hlist_head *head = sbi->inode_hashtable + sfat_hash_pos(i_pos);
+
+    spin_lock(&sbi->inode_hash_lock);
+    write_seqcount_begin(&sbi->inode_hash_seq);
+    SFAT_I(inode)->i_pos = i_pos;
+    hlist_add_head_rcu(&SFAT_I(inode)->i_sfat_hash, head);
+    write_seqcount_end(&sbi->inode_hash_seq);
+    spin_unlock(&sbi->inode_hash_lock);
+}
+
+/*
+ * Desc: hash a new inode for the entry at i_pos, unless another one got
+ *   there first (two lookups of the entry may both miss in sfat_iget)
+ * Return:
+ *   NULL: inode is hashed
+ *   else: the inode already there (reference is taken), inode isn't hashed
+ */
+static struct inode *sfat_attach_new(struct inode *inode, loff_t i_pos)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(inode->i_sb);
+    struct hlist_head *head = sbi->inode_hashtable + sfat_hash_pos(i_pos);
+    struct hlist_node *_p;
+    struct sfat_inode_info *i;
+    struct inode *old = NULL;
+
+    spin_lock(&sbi->inode_hash_lock);
+    hlist_for_each_entry(i, _p, head, i_sfat_hash) {
+        if (i->i_pos != i_pos)
+            continue;
+        old = igrab(&i->vfs_inode);
+        if (old)
+            break;
+    }
+    if (!old) {
+        write_seqcount_begin(&sbi->inode_hash_seq);
+        SFAT_I(inode)->i_pos = i_pos;
+        hlist_add_head_rcu(&SFAT_I(inode)->i_sfat_hash, head);
+        write_seqcount_end(&sbi->inode_hash_seq);
+    }
+    spin_unlock(&sbi->inode_hash_lock);
+    return old;
+}
+
+static void sfat_detach(struct inode *inode)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(inode->i_sb);
+
+    spin_lock(&sbi->inode_hash_lock);
+    write_seqcount_begin(&sbi->inode_hash_seq);
+    SFAT_I(inode)->i_pos = 0;
+    hlist_del_init_rcu(&SFAT_I(inode)->i_sfat_hash);
+    write_seqcount_end(&sbi->inode_hash_seq);
+    spin_unlock(&sbi->inode_hash_lock);
+}
+
+/*
+ * Desc: find the inode in memory whose directory entry is at i_pos
+ *   Lockless, so that lookups of the same names from many cpus don't meet
+ *   in inode_hash_lock. An inode found while it is being freed is still
+ *   valid memory (see sfat_destroy_inode) and igrab refuses it. A miss is
+ *   only trusted if the table didn't change during the walk: a node moved
+ *   to another bucket by rename takes the walk along with it.
+ * Return:
+ *   the inode (reference is taken) or NULL
+ */
+static struct inode *sfat_iget(struct super_block *sb, loff_t i_pos)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct hlist_head *head = sbi->inode_hashtable + sfat_hash_pos(i_pos);
+    struct hlist_node *_p;
+    struct sfat_inode_info *i;
+    struct inode *inode = NULL;
+    unsigned seq = 0;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&sbi->inode_hash_seq);
+        hlist_for_each_entry_rcu(i, _p, head, i_sfat_hash) {
+            if (i->i_pos != i_pos)
+                continue;
+            inode = igrab(&i->vfs_inode);
+            if (inode)
+                goto out;
+        }
+    } while (read_seqcount_retry(&sbi->inode_hash_seq, seq));
+out:
+    rcu_read_unlock();
+    return inode;
+}
+
 /*
  * Desc: Build an inode
+ *   The inode in memory is reused if there is one for the entry, so that
+ *   its (maybe dirty) state is never overwritten by the one on disk.
  * In:
  *   de: dir entry used to fill the info for the inode
  * Return:
@@ -846,9 +1536,16 @@ int sfat_build_inode(struct super_block *sb,
             struct sfat_dir_entry *de, loff_t i_pos, struct inode **pinode)
 {
     struct inode *inode;
+    struct inode *old;
     int error;
 
-    printk (KERN_INFO "sfat: sfat_build_inode, i_pos is %llu\n", i_pos);
+    sfat_dbg(2, "sfat: sfat_build_inode, i_pos is %llu\n", i_pos);
+    inode = sfat_iget(sb, i_pos);
+    if (inode) {
+        *pinode = inode;
+        return 0;
+    }
+
     inode = new_inode(sb);
     if (!inode) {
         return -ENOMEM;
@@ -858,9 +1555,16 @@ int sfat_build_inode(struct super_block *sb,
     error = sfat_fill_inode(inode, de, i_pos);
     if (error) {
         iput(inode);
-        return -ENOMEM;
+        return error;
     }
 
+    old = sfat_attach_new(inode, i_pos);
+    if (old) {
+        // lost the race, the new inode is dropped unhashed and clean
+        iput(inode);
+        *pinode = old;
+        return 0;
+    }
     insert_inode_hash(inode);  // vfs function
     *pinode = inode;
     return 0;
@@ -875,58 +1579,60 @@ int sfat_build_inode(struct super_block *sb,
  *   < 0: error code
  *
  */
-int sfat_inode_write_to_hd(struct sfat_fs_info *fs, struct block_device *bdev, struct inode *inode)
+int sfat_inode_write_to_hd(struct super_block *sb, struct inode *inode)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     struct sfat_inode_info *inodei = SFAT_I(inode);
     struct sfat_dir_entry * de = NULL;
     size_t blk = 0; // block
     size_t pos = 0; // entry location in the block in bytes
     int error = 0;
-    struct block_holder *bh = NULL;
+    struct sfat_mblock *mb = NULL;
 
-    printk(KERN_INFO "sfat: sfat_inode_write_to_hd\n");
+    sfat_dbg(2, "sfat: sfat_inode_write_to_hd\n");
 
     if (SFAT_ROOT_INO == inode->i_ino)
     {
         return 0;  // no need to write root inode
     }
 
-    printk(KERN_INFO "sfat: sfat_inode_write_to_hd, i_pos is %llu\n", inodei->i_pos);
-    blk = (inodei->i_pos) >> (fs->block_bits);
-    printk(KERN_INFO "sfat: sfat_inode_write_to_hd, blk is %u\n", blk);
-    pos = (inodei->i_pos) & (fs->block_size - 1);
-    printk(KERN_INFO "sfat: sfat_inode_write_to_hd, pos is %u\n", pos);
-
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
+    // a writer may be extending the file meanwhile, and rename or the
+    // rebuild of its directory may be moving the entry to another slot
+    down_read(&inodei->i_chain_sem);
+    if (!inodei->i_pos)
+    {
+        up_read(&inodei->i_chain_sem);
+        return 0;  // no entry on disk (any more)
     }
 
-    error = read_block(bdev, bh, fs->block_size, blk);
-    printk(KERN_INFO "sfat: sfat_inode_write_to_hd  0030\n");
-    if (error) {
-        sfat_blkholder_free(bh);
+    sfat_dbg(2, "sfat: sfat_inode_write_to_hd, i_pos is %llu\n", inodei->i_pos);
+    blk = (inodei->i_pos) >> (fs->block_bits);
+    sfat_dbg(3, "sfat: sfat_inode_write_to_hd, blk is %u\n", blk);
+    pos = (inodei->i_pos) & (fs->block_size - 1);
+    sfat_dbg(3, "sfat: sfat_inode_write_to_hd, pos is %u\n", pos);
+
+    sfat_journal_start(sb);
+    mb = sfat_mblock_get(sb, blk, &error);
+    sfat_dbg(3, "sfat: sfat_inode_write_to_hd  0030\n");
+    if (!mb) {
+        sfat_journal_stop(sb);
+        up_read(&inodei->i_chain_sem);
         return error;
     }
 
-    de = (struct sfat_dir_entry *)(sfat_blkholder_get_data(bh) + pos);
+    de = (struct sfat_dir_entry *)(sfat_mblock_data(mb) + pos);
 
     // update the entry
     de->fst_cls_no = cpu_to_le32(inodei->i_start);
-    de->size = cpu_to_le32(inode->i_size);
-    de->crt_time =     cpu_to_le32(inode->i_ctime.tv_sec);
-    de->lst_acc_time = cpu_to_le32(inode->i_atime.tv_sec);
-    de->wrt_time =     cpu_to_le32(inode->i_mtime.tv_sec);
+    sfat_entry_store(de, inode);
 
-    error = write_block(bdev, bh, fs->block_size, blk);
-    printk(KERN_INFO "sfat: sfat_inode_write_to_hd  0080\n");
-    if (error) {
-        sfat_blkholder_free(bh);
-        return error;
-    }
+    // the block goes to disk with the other metadata (sync_fs, fsync)
+    sfat_mblock_mark_dirty(sb, mb);
 
-    printk(KERN_INFO "sfat: sfat_inode_write_to_hd  0100\n");
-    sfat_blkholder_free(bh);
+    sfat_dbg(3, "sfat: sfat_inode_write_to_hd  0100\n");
+    sfat_mblock_put(sb, mb);
+    sfat_journal_stop(sb);
+    up_read(&inodei->i_chain_sem);
     return 0;
 }
 
@@ -934,22 +1640,155 @@ int sfat_inode_write_to_hd(struct sfat_fs_info *fs, struct block_device *bdev, s
 
 
 /*
- * The following operations are conveyed by super_block for
- * operating inode.
- */
-// ====================================================
-/*
- * the generic code from Linux would initialize the
- * content of inode after the function returns
+ * Desc: write the directory entry of a dirty inode back (callback of
+ *   writeback, so many updates of an inode end up in one write)
+ * In:
+ *   wait: whether the caller waits for the I/O (our I/O is always synchronous)
+ * Return:
+ *   0: Success
+ *   < 0: error code
  */
-struct inode *sfat_alloc_inode(struct super_block *sb) {
-    struct sfat_inode_info *ei;
+int sfat_write_inode(struct inode *inode, int wait)
+{
+    struct super_block *sb = inode->i_sb;
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_write_inode\n");
+
+    if (!inodei->i_dirty)
+    {
+        return 0;
+    }
+    inodei->i_dirty = 0;
+
+    error = sfat_inode_write_to_hd(sb, inode);
+    if (error)
+    {
+        inodei->i_dirty = 1;  // try again next time
+    }
+    return error;
+}
+
+/*
+ * Desc: called by VFS whenever the inode is marked dirty,
+ *   the directory entry is left to sfat_write_inode
+ */
+void sfat_dirty_inode(struct inode *inode)
+{
+    SFAT_I(inode)->i_dirty = 1;
+}
+
+/*
+ * Desc: make the file durable, the metadata it depends on is written in
+ *   one batch sorted by block no. and the device cache is flushed once
+ *   at the end (instead of a barrier for every block).
+ *   For a regular file, these are the dirty FAT blocks and the block of
+ *   its directory entry. For a directory, all the dirty metadata blocks
+ *   are written since its entries may be anywhere in its chain.
+ * In:
+ *   datasync: only what is needed to read the data back is written, i.e.
+ *             the directory entry is skipped if only the times changed
+ * Return:
+ *   0: Success
+ *   < 0: error code
+ */
+int sfat_fsync_inode(struct inode *inode, int datasync)
+{
+    struct super_block *sb = inode->i_sb;
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    size_t entry_blk = SFAT_BLK_NONE;
+    unsigned long mark = sfat_journal_flush_mark(sb);
+    int error = 0;
+    int err = 0;
+
+    // data blocks are written synchronously by sfat_sync_write already
+
+    if (!datasync || (inode->i_state & I_DIRTY_DATASYNC))
+    {
+        // put the directory entry into its (cached) block
+        error = write_inode_now(inode, 1);
+    }
+
+    if (S_ISDIR(inode->i_mode))
+    {
+        err = sfat_mcache_write(sb, 0, SFAT_BLK_NONE, SFAT_BLK_NONE);
+    }
+    else
+    {
+        if (inodei->i_pos)
+        {
+            entry_blk = inodei->i_pos >> fs->block_bits;
+        }
+        err = sfat_mcache_write(sb, fs->fat_start_blk, fs->data_start_blk, entry_blk);
+    }
+    if (!error)
+    {
+        error = err;
+    }
+
+    // with the journal the commit (ours or a concurrent one) has flushed,
+    // which is the group commit of fsyncs
+    if (!sfat_journal_flushed_since(sb, mark))
+    {
+        err = sfat_flush_device(sb);
+        if (!error)
+        {
+            error = err;
+        }
+    }
+    return error;
+}
+
+/*
+ * Desc: ioctl for files and directories
+ */
+int sfat_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case SFAT_IOCTL_GET_STATS:
+        return sfat_ioctl_get_stats(inode->i_sb, (void __user *)arg);
+    case SFAT_IOCTL_CREATE_BATCH:
+        return sfat_ioctl_create_batch(filp, (void __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Desc: fsync/fdatasync for files and directories
+ */
+int sfat_file_fsync(struct file *filp, struct dentry *dentry, int datasync)
+{
+    sfat_dbg(2, "sfat: sfat_file_fsync\n");
+    return sfat_fsync_inode(dentry->d_inode, datasync);
+}
+
+/*
+ * The following operations are conveyed by super_block for
+ * operating inode.
+ */
+// ====================================================
+/*
+ * the generic code from Linux would initialize the
+ * content of inode after the function returns
+ */
+struct inode *sfat_alloc_inode(struct super_block *sb) {
+    struct sfat_inode_info *ei;
 
-    printk(KERN_INFO "sfat: sfat_alloc_inode\n");
+    sfat_dbg(2, "sfat: sfat_alloc_inode\n");
 
     ei = kmem_cache_alloc(sfat_cache_inodeinfo, GFP_NOFS);
     if (!ei)
         return NULL;
+
+    ei->i_buckets = NULL;
+    ei->i_nbuckets = 0;
+    ei->i_reshape = 0;
+    ei->i_dirty = 0;
+    ei->i_hint_idx = 0;
+    ei->i_hint_cls = SFAT_CLS_NONE;
     return &ei->vfs_inode;
 }
 
@@ -957,8 +1796,32 @@ struct inode *sfat_alloc_inode(struct super_block *sb) {
  * This function shall be invoked on those inodes which
  * correspond to the deleted files.
  */
+/*
+ * Desc: drop the cached blocks of a directory chain which is about to be
+ *   freed (see sfat_mcache_forget)
+ */
+static void sfat_dir_forget_chain(struct super_block *sb, size_t cls)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    unsigned long counter = fs->clusters;  // just for protection of loop
+
+    while (counter-- > 0 && cls < fs->clusters)
+    {
+        sfat_mcache_forget(sb, CLS_TO_BLK(fs, cls), fs->blk_per_clus);
+        if (sfat_get_entry_content(sb, cls, &cls))
+        {
+            break;
+        }
+    }
+}
+
 void sfat_delete_inode(struct inode *inode) {
-    printk(KERN_INFO "sfat: sfat_delete_inode\n");
+    struct super_block *sb = inode->i_sb;
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    unsigned int i = 0;
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_delete_inode\n");
 
     // quoted from fs/inode.c
     /* Filesystems implementing their own
@@ -970,8 +1833,44 @@ void sfat_delete_inode(struct inode *inode) {
     // we didn't use address space at all.
     truncate_inode_pages(&inode->i_data, 0);
 
-    // inode->i_size = 0; todo clean the file content
-    // fat_truncate(inode);
+    // The entry was removed (by rmdir or overwritten by rename), so nothing
+    // but this inode referred to the clusters. (An empty directory has no
+    // links either, but keeps its entry and i_pos.)
+    if (!inodei->i_pos && SFAT_ROOT_INO != inode->i_ino
+        && inodei->i_start < SFAT_SB(sb)->fs_info.clusters)
+    {
+        // the blocks of a directory are cached and logged as metadata,
+        // neither may reach the clusters once they hold something else
+        if (S_ISDIR(inode->i_mode))
+        {
+            for (i = 0; i < inodei->i_nbuckets; ++i)
+            {
+                sfat_dir_forget_chain(sb, inodei->i_buckets[i]);
+            }
+            sfat_dir_forget_chain(sb, inodei->i_start);
+        }
+
+        sfat_journal_start(sb);
+        for (i = 0; i < inodei->i_nbuckets && !error; ++i)
+        {
+            error = sfat_fat_chain_release(sb, inodei->i_buckets[i]);
+        }
+        if (!error)
+        {
+            error = sfat_fat_chain_release(sb, inodei->i_start);
+        }
+        if (S_ISDIR(inode->i_mode))
+        {
+            sfat_journal_revoke(sb);
+        }
+        sfat_journal_stop(sb);
+        if (error)
+        {
+            printk(KERN_ERR "sfat: clusters of a removed file starting at %zu"
+                    " are not freed (%d)\n", inodei->i_start, error);
+        }
+    }
+
     clear_inode(inode);
 }
 
@@ -981,98 +1880,192 @@ void sfat_delete_inode(struct inode *inode) {
  * This function is called before destroy_inode.
  */
 void sfat_clear_inode(struct inode *inode) {
-    printk(KERN_INFO "sfat: sfat_clear_inode\n");
-    // todo
-    // so far I am not sure what needs to be done here.
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+
+    sfat_dbg(2, "sfat: sfat_clear_inode\n");
+
+    sfat_detach(inode);
+    sfat_dir_free_buckets(inodei->i_buckets);
+    inodei->i_buckets = NULL;
+    inodei->i_nbuckets = 0;
 
 //    fat_cache_inval_inode(inode);
 //    fat_detach(inode);
 }
 
+static void sfat_i_callback(struct rcu_head *head)
+{
+    kmem_cache_free(sfat_cache_inodeinfo,
+            container_of(head, struct sfat_inode_info, i_rcu));
+}
+
 /*
  * This function shall be invoked whenever an inode
  * is to be released.
+ * The memory is freed after a grace period, since sfat_iget may still
+ * be looking at it.
  */
 void sfat_destroy_inode(struct inode *inode) {
-    printk(KERN_INFO "sfat: sfat_destroy_inode\n");
-    kmem_cache_free(sfat_cache_inodeinfo, SFAT_I(inode));
+    sfat_dbg(2, "sfat: sfat_destroy_inode\n");
+    call_rcu(&SFAT_I(inode)->i_rcu, sfat_i_callback);
 }
 
 
-/***** Create a normal file (not directory) */
-int sfat_create_file(struct inode *dir, struct dentry *dentry, int mode,
-            struct nameidata *nd)
+/*
+ * Desc: dir has grown, note if it is to be rebuilt (see sfat_dir_reshape):
+ *   a hashed directory whose bucket outgrew its first cluster, or a linear
+ *   subdirectory of SFAT_DIR_HASH_CLUSTERS clusters or more. The caller
+ *   holds the i_mutex of dir.
+ */
+static void sfat_dir_grown(struct inode *dir)
 {
-    struct super_block *sb = dir->i_sb;
-    struct block_device *bdev = sb->s_bdev;
-    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs_info = &(SFAT_SB(dir->i_sb)->fs_info);
     struct sfat_inode_info *inodei = SFAT_I(dir);
-    struct sfat_fs_info *fs_info = &sbi->fs_info;
-
-    struct block_holder *bh = NULL;
 
-    struct sfat_dir_entry de;
-    struct sfat_dir_entry *pde = NULL;
+    if (!(fs_info->features & SFAT_FEATURE_HASHDIR))
+    {
+        return;
+    }
+    if (inodei->i_buckets? inodei->i_nbuckets < SFAT_DIR_MAX_BUCKETS
+        : (SFAT_ROOT_INO != dir->i_ino
+           && dir->i_size >= ((loff_t)SFAT_DIR_HASH_CLUSTERS << fs_info->cluster_bits)))
+    {
+        inodei->i_reshape = 1;
+    }
+}
 
-    struct inode *inode = NULL;
-    struct timespec ts;
+/*
+ * Desc: grow the chain start_cls of dir by up to SFAT_DIR_GROW_CLUSTERS
+ *   clusters at once, contiguous where possible, so that a large directory
+ *   walks its chain and goes to the allocator only every so many entries.
+ *   Only the first new cluster gets entries now. The others are left as
+ *   they are on disk, the end marker keeps the scans out of them until
+ *   the entries get there (see sfat_dir_add_entry).
+ *   The caller holds the i_mutex of dir and makes this one journal
+ *   operation.
+ * Out:
+ *   first_cls: the first new cluster
+ * Return:
+ *   0: success (at least one cluster)
+ *   < 0: error code
+ */
+static int sfat_dir_grow(struct inode *dir, size_t start_cls, size_t *first_cls)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
+    size_t last_cls = start_cls;
+    size_t next_cls = 0;
+    size_t cls = 0;
+    unsigned long counter = fs_info->clusters;
+    unsigned long n = 0;
     int error = 0;
-    int i = 0;
-    size_t len = (dentry->d_name.len < SFAT_NAME_LEN)? dentry->d_name.len: SFAT_NAME_LEN;
-
-    size_t cls, blk, offset = 0;
-    loff_t i_pos = 0;  // position of entry in the volume in byte
-    size_t next_cls, next_blk = 0;
-
-    int is_empty_end = 0;
-
-    printk (KERN_INFO "sfat: sfat_create_file\n");
 
-    for (i = 0; i < len; ++i)
+    // the last cluster of the chain
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
+    for (;;)
     {
-        de.name[i] = dentry->d_name.name[i];
+        if (!counter--)  // just an extra protection
+        {
+            return -EINVAL;
+        }
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, last_cls, &next_cls);
+        if (error)
+        {
+            return error;
+        }
+        if (SFAT_ENTRY_EOC == next_cls)
+        {
+            break;
+        }
+        if (next_cls >= fs_info->clusters)
+        {
+            return -EINVAL;
+        }
+        last_cls = next_cls;
     }
 
-    for (;i < SFAT_NAME_LEN; ++i)
+    for (n = 0; n < SFAT_DIR_GROW_CLUSTERS; ++n)
     {
-        de.name[i] = '\0';
+        error = sfat_fat_entry_acquire(sb, last_cls + 1, &cls);
+        if (error)
+        {
+            break;
+        }
+        error = sfat_fat_entry_modify(sb, last_cls, cpu_to_le32(cls));
+        if (error)
+        {
+            sfat_fat_chain_release(sb, cls);
+            break;
+        }
+        if (!n)
+        {
+            *first_cls = cls;
+        }
+        last_cls = cls;
+        dir->i_size += fs_info->cluster_size;
+        dir->i_blocks += fs_info->blk_per_clus;
     }
 
-    error = sfat_dentry_locate(fs_info, bdev, inodei->i_start, de.name,
-             &de, &cls, &blk, &offset);
-    if (!error)  // file exists
-    {
-        return -EEXIST;
-    }
-    if (error != -ENOENT)  // error other than file not exist
+    // an almost full volume gives what it has
+    if (!n)
     {
         return error;
     }
+    sfat_dir_grown(dir);
+    return 0;
+}
+
+/*
+ * Desc: put an entry into a free slot of the chain start_cls of dir,
+ *   growing the chain if it is full (see sfat_dir_grow)
+ *   The caller holds the i_mutex of dir and makes this one journal
+ *   operation.
+ * In:
+ *   start_cls: chain (directory or bucket) of the name
+ *   de: the entry, name and all
+ * Out:
+ *   pi_pos: its position
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_dir_add_entry(struct inode *dir, size_t start_cls,
+            const struct sfat_dir_entry *de, loff_t *pi_pos)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs_info = &sbi->fs_info;
 
-    error = 0;
+    struct sfat_mblock *mb = NULL;
 
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
-    }
+    struct sfat_dir_entry *pde = NULL;
+
+    struct timespec ts;
+    int error = 0;
+
+    size_t cls, blk, offset = 0;
+    loff_t i_pos = 0;  // position of entry in the volume in byte
+    size_t next_cls, next_blk = 0;
+
+    int is_empty_end = 0;
 
     // find free entry
-    error = sfat_free_dentry_locate(fs_info, bdev, bh, inodei->i_start, &cls, &blk, &offset);
+    error = sfat_free_dentry_locate(sb, &mb, start_cls, &cls, &blk, &offset);
 
     if (error && error != -ENOENT)  // if error is not "not found"
     {
-        sfat_blkholder_free(bh);
         return error;
     }
 
     ts = CURRENT_TIME_SEC;
 
-    if (!error)  // We found a free entry. bh contains the whole block.
+    if (!error)  // We found a free entry. mb contains the whole block.
     {
         i_pos = form_dir_entry_pos(fs_info, cls, blk, offset);
-        printk (KERN_INFO "sfat: sfat_create_file, i_pos is %llu\n", i_pos);
+        sfat_dbg(2, "sfat: sfat_dir_add_entry, i_pos is %llu\n", i_pos);
 
-        pde = (struct sfat_dir_entry *)(sfat_blkholder_get_data(bh) + offset);
+        pde = (struct sfat_dir_entry *)(sfat_mblock_data(mb) + offset);
         if (SFAT_ATTR_EMPTY_END == pde->attr)  // last valid entry
         {
             // more entries in the block
@@ -1087,16 +2080,11 @@ int sfat_create_file(struct inode *dir, struct dentry *dentry, int mode,
         }
 
         // We update the block.
-        sfat_form_dir_entry(pde, 0/* common file */, de.name,
-                0/*choose at will due to size = 0*/, 0, &ts);
-        memcpy(&de, pde, sizeof(struct sfat_dir_entry));
+        memcpy(pde, de, sizeof(struct sfat_dir_entry));
 
-        error = write_block(bdev, bh, fs_info->block_size, CLS_TO_BLK(fs_info, cls) + blk);
-        if (error)
-        {
-            sfat_blkholder_free(bh);
-            return error;
-        }
+        sfat_mblock_mark_dirty(sb, mb);
+        sfat_mblock_put(sb, mb);
+        mb = NULL;
 
         // only need to change the time for directory
         dir->i_mtime.tv_sec = ts.tv_sec;
@@ -1108,14 +2096,14 @@ int sfat_create_file(struct inode *dir, struct dentry *dentry, int mode,
             // more blocks in the cluster
             if (blk < fs_info->blk_per_clus - 1)
             {
+                next_cls = cls;
                 next_blk = blk + 1;
             }
             else  // more cluster in the chain
             {
-                error = sfat_get_entry_content(fs_info, bdev, cls, &next_cls);
+                error = sfat_get_entry_content(sb, cls, &next_cls);
                 if (error)
                 {
-                    sfat_blkholder_free(bh);
                     return error;
                 }
                 // last the cluster
@@ -1126,8 +2114,7 @@ int sfat_create_file(struct inode *dir, struct dentry *dentry, int mode,
                 // mysterious error
                 else if (next_cls > fs_info->clusters)
                 {
-                    sfat_blkholder_free(bh);
-                    return error;
+                    return -EINVAL;
                 }
                 else
                 {
@@ -1137,164 +2124,1906 @@ int sfat_create_file(struct inode *dir, struct dentry *dentry, int mode,
 
             if (is_empty_end)
             {
-                error = read_block(bdev, bh, fs_info->block_size, CLS_TO_BLK(fs_info, next_cls) + next_blk);
-                if (error)
+                mb = sfat_mblock_get(sb, CLS_TO_BLK(fs_info, next_cls) + next_blk, &error);
+                if (!mb)
                 {
-                    sfat_blkholder_free(bh);
                     return error;
                 }
-                pde = (struct sfat_dir_entry *)(sfat_blkholder_get_data(bh));
+                pde = (struct sfat_dir_entry *)(sfat_mblock_data(mb));
                 pde->attr = SFAT_ATTR_EMPTY_END;
-                error = write_block(bdev, bh, fs_info->block_size, CLS_TO_BLK(fs_info, next_cls) + next_blk);
-                if (error)
-                {
-                    sfat_blkholder_free(bh);
-                    return error;
-                }
+                sfat_mblock_mark_dirty(sb, mb);
+                sfat_mblock_put(sb, mb);
             }
         }
     }
     else  // error is -ENOENT (no free entry)
     {
-        // allocate one entry
-        // I am in a hurry. If something bad happens later, I
-        // don't return it back.
-        error = sfat_fat_entry_acquire(fs_info, bdev, &cls);
-        if (error)
-        {
-            printk (KERN_INFO "sfat: sfat_create_file, no free entry in FAT.\n");
-            sfat_blkholder_free(bh);
-            return error;
-        }
-
-        // add the newly allocated cluster to the chain of the dir
-        error = sfat_file_append_cls(fs_info, bdev, inodei->i_start, cls);
+        // grow the chain, the size of the directory is updated
+        error = sfat_dir_grow(dir, start_cls, &cls);
         if (error)
         {
-            sfat_blkholder_free(bh);
+            sfat_dbg(1, "sfat: sfat_dir_add_entry, no free entry in FAT.\n");
             return error;
         }
-        // update size and time of the directory
-        dir->i_size += fs_info->cluster_size;
-        dir->i_blocks += fs_info->blk_per_clus;
         // change the time for directory
         dir->i_mtime.tv_sec = ts.tv_sec;
         // inode->i_atime.tv_sec = ts.tv_sec;  // I didn't change the access time
 
-        error = read_block(bdev, bh, fs_info->block_size, CLS_TO_BLK(fs_info, cls));
-        if (error)
+        mb = sfat_mblock_get(sb, CLS_TO_BLK(fs_info, cls), &error);
+        if (!mb)
         {
-            sfat_blkholder_free(bh);
             return error;
         }
 
-        i_pos = form_dir_entry_pos(fs_info, cls, blk, offset);
+        // the new entry is the first one in the new cluster
+        i_pos = form_dir_entry_pos(fs_info, cls, 0, 0);
 
         // We update the block.
-        pde = (struct sfat_dir_entry *)(sfat_blkholder_get_data(bh));
-        // write down the entry (as the first one in the cluster) for the new file
-        sfat_form_dir_entry(pde, 0/* common file */, de.name,
-                0/*choose at will due to size = 0*/, 0, &ts);
-        memcpy(&de, pde, sizeof(struct sfat_dir_entry));
+        pde = (struct sfat_dir_entry *)(sfat_mblock_data(mb));
+        // write down the entry (as the first one in the cluster)
+        memcpy(pde, de, sizeof(struct sfat_dir_entry));
 
         ++pde;
         // change the next entry
         pde->attr = SFAT_ATTR_EMPTY_END;
-        error = write_block(bdev, bh, fs_info->block_size, CLS_TO_BLK(fs_info, cls));
-        if (error)
-        {
-            sfat_blkholder_free(bh);
-            return error;
-        }
+        sfat_mblock_mark_dirty(sb, mb);
+        sfat_mblock_put(sb, mb);
     }
 
     // so far the meta data of the dir (inside the inode)
     // as well as the fat chain of the dir have been updated.
 
-    error = sfat_inode_write_to_hd(fs_info, bdev, dir);
-    sfat_blkholder_free(bh);
-    if (error)
-    {
-        return error;
-    }
-
-    error = sfat_build_inode(sb, &de, i_pos, &inode);
-
-    if (error) {
-        return error;
-    }
+    mark_inode_dirty(dir);
 
-    d_instantiate(dentry, inode);
+    *pi_pos = i_pos;
     return 0;
 }
 
-
 /*
- * Desc:
- *   look up certain file in a directory according to file's name
- *
- * In:
- *   dir: directory
- *   dentry: dentry prepared for file to be looked up.
- *   data: name info of the file to be looked up.
- *
- * Ret:
- *   NULL: no such file
- *   not NULL (< 0): error code formed by ERR_PTR(err)
- *
+ * Desc: mark the slot at i_pos free (the end marker stays where it is)
+ *   The caller holds the i_mutex of the directory and makes this one
+ *   journal operation.
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_dir_free_slot(struct super_block *sb, loff_t i_pos)
+{
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
+    struct sfat_mblock *mb = NULL;
+    struct sfat_dir_entry *pde = NULL;
+    int error = 0;
+
+    mb = sfat_mblock_get(sb, i_pos >> fs_info->block_bits, &error);
+    if (!mb)
+    {
+        return error;
+    }
+    pde = (struct sfat_dir_entry *)(sfat_mblock_data(mb)
+            + (i_pos & (fs_info->block_size - 1)));
+    pde->attr = SFAT_ATTR_EMPTY;
+    sfat_mblock_mark_dirty(sb, mb);
+    sfat_mblock_put(sb, mb);
+    return 0;
+}
+
+/*
+ * one entry of a directory being rebuilt, see sfat_dir_reshape
+ */
+struct sfat_reshape_item {
+    struct sfat_dir_entry de;
+    u32 bucket;                  /* in the new layout */
+    loff_t old_pos;
+    loff_t new_pos;
+    struct inode *inode;         /* its inode in memory (referenced) or NULL */
+};
+
+/*
+ * Desc: block holders for the blocks of one cluster of a directory
+ *   written without the cache (see sfat_dir_write_cluster)
+ */
+static struct block_holder **sfat_dir_alloc_holders(struct super_block *sb)
+{
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
+    struct block_holder **bhs = NULL;
+    size_t i = 0;
+
+    bhs = kcalloc(fs_info->blk_per_clus, sizeof(*bhs), GFP_NOFS);
+    if (!bhs)
+    {
+        return NULL;
+    }
+    for (i = 0; i < fs_info->blk_per_clus; ++i)
+    {
+        bhs[i] = sfat_blkholder_alloc();
+        if (!bhs[i])
+        {
+            break;
+        }
+    }
+    if (i < fs_info->blk_per_clus)
+    {
+        while (i-- > 0)
+        {
+            sfat_blkholder_free(bhs[i]);
+        }
+        kfree(bhs);
+        return NULL;
+    }
+    return bhs;
+}
+
+static void sfat_dir_free_holders(struct super_block *sb, struct block_holder **bhs)
+{
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
+    size_t i = 0;
+
+    for (i = 0; i < fs_info->blk_per_clus; ++i)
+    {
+        sfat_blkholder_free(bhs[i]);
+    }
+    kfree(bhs);
+}
+
+/*
+ * Desc: write one cluster of a directory by one multi-block write: the
+ *   entries of items, the end marker after them if there is room, zeros
+ *   in the rest. The blocks are neither read nor cached; the cluster is
+ *   on disk before any entry points to it.
+ * In:
+ *   items, n: the entries (at most one cluster of them), new_pos of each
+ *             is set to its slot
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_dir_write_cluster(struct super_block *sb, size_t cls,
+        struct block_holder **bhs, struct sfat_reshape_item *items, unsigned long n)
+{
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
+    struct sfat_dir_entry *pde = NULL;
+    unsigned long i = 0;
+    size_t b = 0;
+    size_t k = 0;
+
+    for (b = 0; b < fs_info->blk_per_clus; ++b)
+    {
+        pde = (struct sfat_dir_entry *)sfat_blkholder_get_data(bhs[b]);
+        memset(pde, 0, fs_info->block_size);
+        for (k = 0; k < fs_info->dirent_per_blk; ++k, ++i)
+        {
+            if (i < n)
+            {
+                memcpy(&pde[k], &items[i].de, sizeof(struct sfat_dir_entry));
+                items[i].new_pos = form_dir_entry_pos(fs_info, cls, b,
+                        k * sizeof(struct sfat_dir_entry));
+            }
+            else if (i == n)
+            {
+                pde[k].attr = SFAT_ATTR_EMPTY_END;
+            }
+        }
+    }
+
+    return sfat_write_blocks(sb, bhs, fs_info->blk_per_clus, CLS_TO_BLK(fs_info, cls));
+}
+
+/*
+ * Desc: write the first cluster of a new directory, all zeros but the end
+ *   marker in its first entry (see sfat_dir_write_cluster)
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_dir_init_cluster(struct super_block *sb, size_t cls)
+{
+    struct block_holder **bhs = NULL;
+    int error = 0;
+
+    bhs = sfat_dir_alloc_holders(sb);
+    if (!bhs)
+    {
+        return -ENOMEM;
+    }
+    error = sfat_dir_write_cluster(sb, cls, bhs, NULL, 0);
+    sfat_dir_free_holders(sb, bhs);
+    return error;
+}
+
+/*
+ * Desc: claim a chain of nclus clusters for a directory, contiguous where
+ *   possible. The caller makes this one journal operation. Nothing stays
+ *   claimed if it fails.
+ * In:
+ *   goal: where to look first (see sfat_fat_entry_acquire)
+ * Out:
+ *   first: the first cluster of the chain
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_dir_claim_chain(struct super_block *sb, size_t goal,
+        unsigned long nclus, size_t *first)
+{
+    size_t prev = 0;
+    size_t cls = 0;
+    unsigned long i = 0;
+    int error = 0;
+
+    for (i = 0; i < nclus; ++i)
+    {
+        error = sfat_fat_entry_acquire(sb, goal, &cls);
+        if (error)
+        {
+            break;
+        }
+        if (!i)
+        {
+            *first = cls;
+        }
+        else
+        {
+            error = sfat_fat_entry_modify(sb, prev, cpu_to_le32(cls));
+            if (error)
+            {
+                sfat_fat_chain_release(sb, cls);
+                break;
+            }
+        }
+        prev = cls;
+        goal = cls + 1;
+    }
+    if (error && i)
+    {
+        sfat_fat_chain_release(sb, *first);
+    }
+    return error;
+}
+
+/*
+ * Desc: make the chain at cls at least nclus clusters long, for the index
+ *   of a hashed root which stays where it is. The caller makes this one
+ *   journal operation.
+ * Out:
+ *   have: no. of clusters of the chain
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_dir_extend_chain(struct super_block *sb, size_t cls,
+        unsigned long nclus, unsigned long *have)
+{
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
+    unsigned long len = 1;
+    size_t next = 0;
+    size_t first = 0;
+    int error = 0;
+
+    for (;;)
+    {
+        error = sfat_get_entry_content(sb, cls, &next);
+        if (error)
+        {
+            return error;
+        }
+        if (SFAT_ENTRY_EOC == next)
+        {
+            break;
+        }
+        if (next >= fs_info->clusters || len >= fs_info->clusters)
+        {
+            return -EINVAL;
+        }
+        cls = next;
+        ++len;
+    }
+
+    *have = len;
+    if (len >= nclus)
+    {
+        return 0;
+    }
+    error = sfat_dir_claim_chain(sb, cls + 1, nclus - len, &first);
+    if (error)
+    {
+        return error;
+    }
+    error = sfat_fat_entry_modify(sb, cls, cpu_to_le32(first));
+    if (error)
+    {
+        sfat_fat_chain_release(sb, first);
+        return error;
+    }
+    *have = nclus;
+    return 0;
+}
+
+/*
+ * Desc: write the index of nb buckets into the chain at cls through the
+ *   cache. All of its blocks are in hand before the first one changes, so
+ *   a failure leaves the chain as it was. The caller makes this one
+ *   journal operation.
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_dir_store_index(struct super_block *sb, size_t cls,
+        const u32 *buckets, unsigned int nb)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    unsigned long nblk = DIV_ROUND_UP(SFAT_DIR_INDEX_SIZE(nb), fs->block_size);
+    unsigned int per_blk = fs->block_size / sizeof(__le32);
+    struct sfat_mblock **mbs = NULL;
+    struct sfat_dir_index *idx = NULL;
+    __le32 *words = NULL;
+    unsigned long k = 0;
+    unsigned int w = 0;
+    unsigned int i = 0;
+    int error = 0;
+
+    mbs = kcalloc(nblk, sizeof(*mbs), GFP_NOFS);
+    if (!mbs)
+    {
+        return -ENOMEM;
+    }
+    for (k = 0; k < nblk; ++k)
+    {
+        if (k && !(k & (fs->blk_per_clus - 1)))  // on to the next cluster
+        {
+            error = sfat_get_entry_content(sb, cls, &cls);
+            if (!error && cls >= fs->clusters)
+            {
+                error = -EINVAL;
+            }
+            if (error)
+            {
+                goto out;
+            }
+        }
+        mbs[k] = sfat_mblock_get(sb, CLS_TO_BLK(fs, cls) + (k & (fs->blk_per_clus - 1)), &error);
+        if (!mbs[k])
+        {
+            goto out;
+        }
+    }
+
+    idx = (struct sfat_dir_index *)sfat_mblock_data(mbs[0]);
+    idx->magic = cpu_to_le32(SFAT_DIR_INDEX_MAGIC);
+    idx->buckets = cpu_to_le32(nb);
+    w = offsetof(struct sfat_dir_index, bucket) / sizeof(__le32);
+    for (k = 0; k < nblk; ++k, w = 0)
+    {
+        words = (__le32 *)sfat_mblock_data(mbs[k]);
+        for (; w < per_blk; ++w)
+        {
+            words[w] = (i < nb)? cpu_to_le32(buckets[i++]): 0;
+        }
+        sfat_mblock_mark_dirty(sb, mbs[k]);
+    }
+
+out:
+    for (k = 0; k < nblk && mbs[k]; ++k)
+    {
+        sfat_mblock_put(sb, mbs[k]);
+    }
+    kfree(mbs);
+    return error;
+}
+
+/*
+ * Desc: free directory chains nothing points to (any more). Their blocks
+ *   leave the cache first, as in sfat_delete_inode, so this is not called
+ *   inside a journal operation.
+ * In:
+ *   chains, n: the first clusters, a cluster no. out of the volume is
+ *              skipped
+ */
+static void sfat_dir_free_chains(struct super_block *sb, const u32 *chains, unsigned int n)
+{
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
+    unsigned int i = 0;
+    int error = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        if (chains[i] < fs_info->clusters)
+        {
+            sfat_dir_forget_chain(sb, chains[i]);
+        }
+    }
+
+    sfat_journal_start(sb);
+    for (i = 0; i < n && !error; ++i)
+    {
+        if (chains[i] < fs_info->clusters)
+        {
+            error = sfat_fat_chain_release(sb, chains[i]);
+        }
+    }
+    sfat_journal_revoke(sb);
+    sfat_journal_stop(sb);
+    if (error)
+    {
+        printk(KERN_ERR "sfat: old clusters of a rebuilt directory are not freed (%d)\n", error);
+    }
+}
+
+/* where sfat_reshape_collect puts the next entry */
+struct sfat_reshape_walk {
+    struct sfat_reshape_item *next;
+    struct sfat_reshape_item *end;
+};
+
+static int sfat_reshape_collect(struct sfat_dir_entry *de, loff_t pos, void *arg)
+{
+    struct sfat_reshape_walk *w = arg;
+
+    if (w->next == w->end)
+    {
+        return -EIO;  // more entries than counted
+    }
+    memcpy(&w->next->de, de, sizeof(struct sfat_dir_entry));
+    w->next->old_pos = pos;
+    w->next->inode = NULL;
+    ++w->next;
+    return 0;
+}
+
+static int sfat_reshape_item_cmp(const void *a, const void *b)
+{
+    const struct sfat_reshape_item *x = a;
+    const struct sfat_reshape_item *y = b;
+
+    if (x->bucket != y->bucket)
+        return x->bucket < y->bucket? -1: 1;
+    return 0;
+}
+
+/* no. of clusters of a new bucket of n entries, an empty one has one */
+static inline unsigned long sfat_bucket_clusters(struct sfat_fs_info *fs, unsigned long n)
+{
+    unsigned long per_clus = fs->dirent_per_blk << fs->blk_per_clus_bits;
+
+    return n? DIV_ROUND_UP(n, per_clus): 1;
+}
+
+/*
+ * Desc: rebuild dir as a hashed directory with as many buckets as its
+ *   entries need, about half a cluster of entries each (up to
+ *   SFAT_DIR_MAX_BUCKETS). A linear subdirectory becomes hashed this way,
+ *   a hashed directory gets more buckets. Nothing is done if there
+ *   wouldn't be more buckets than now.
+ *   The entries are copied from the cache into new chains, which are
+ *   written directly. One journal operation then switches to them: the
+ *   new index, and for a subdirectory its entry (the index chain and
+ *   SFAT_ATTR_HASHED). The inodes in memory move to their new slots, and
+ *   a second operation frees the old chains; a crash between the two can
+ *   only leak the old clusters. The root has no entry, so the index of a
+ *   hashed root is rewritten where it is.
+ *   The caller holds the i_mutex of dir, which keeps the slots of dir and
+ *   the entries in them where they are, and is outside any journal
+ *   operation. All the entries are in memory at once.
+ * Return:
+ *   0: success (or nothing to do)
+ *   < 0: error code, dir is as it was
+ */
+static int sfat_dir_reshape(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs_info = &sbi->fs_info;
+    struct sfat_inode_info *inodei = SFAT_I(dir);
+    unsigned long per_clus = fs_info->dirent_per_blk << fs_info->blk_per_clus_bits;
+    int is_root = (SFAT_ROOT_INO == dir->i_ino);
+
+    struct sfat_reshape_item *items = NULL;
+    struct sfat_reshape_item *it = NULL;
+    struct sfat_reshape_walk walk;
+    struct block_holder **bhs = NULL;
+    struct sfat_mblock *mb = NULL;
+    struct sfat_dir_entry *pde = NULL;
+    struct inode *child = NULL;
+    u32 *buckets = NULL;         // first cluster of each new bucket
+    u32 *counts = NULL;          // no. of entries of each new bucket
+    u32 *old = NULL;             // the chains which go in the end
+    unsigned int nold = 0;
+    unsigned int nb = 0;
+    unsigned int b = 0;
+    unsigned long n = 0;
+    unsigned long nclus = 0;     // clusters of the new buckets
+    unsigned long ic = 0;        // clusters the index needs
+    unsigned long have = 0;      // clusters of the index chain
+    unsigned long i = 0;
+    unsigned long c = 0;
+    size_t idx_cls = inodei->i_start;
+    size_t cls = 0;
+    int idx_new = 0;             // idx_cls is a new chain
+    int count = 0;
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_dir_reshape\n");
+
+    count = sfat_count_subdirs(dir);
+    if (count <= 0)
+    {
+        return count;
+    }
+    n = count;
+
+    nb = min_t(unsigned long, DIV_ROUND_UP(2 * n, per_clus), SFAT_DIR_MAX_BUCKETS);
+    if (nb <= (inodei->i_buckets? inodei->i_nbuckets: 1))
+    {
+        return 0;
+    }
+    ic = DIV_ROUND_UP(SFAT_DIR_INDEX_SIZE(nb), fs_info->cluster_size);
+
+    // the old chains: the buckets, and the chain of a subdirectory (its
+    // index or its entries)
+    nold = inodei->i_buckets? inodei->i_nbuckets: 0;
+    old = sfat_dir_alloc_buckets(nold + 1);
+    items = vmalloc(n * sizeof(*items));
+    buckets = sfat_dir_alloc_buckets(nb);
+    counts = sfat_dir_alloc_buckets(nb);
+    bhs = sfat_dir_alloc_holders(sb);
+    if (!old || !items || !buckets || !counts || !bhs)
+    {
+        error = -ENOMEM;
+        goto out;
+    }
+    if (nold)
+    {
+        memcpy(old, inodei->i_buckets, nold * sizeof(u32));
+    }
+    if (!is_root)
+    {
+        old[nold++] = inodei->i_start;
+    }
+
+    // the entries as they are in the cache, and their slots
+    walk.next = items;
+    walk.end = items + n;
+    if (!inodei->i_buckets)
+    {
+        error = sfat_walk_chain(sb, inodei->i_start, sfat_reshape_collect, &walk);
+    }
+    for (b = 0; !error && inodei->i_buckets && b < inodei->i_nbuckets; ++b)
+    {
+        error = sfat_walk_chain(sb, inodei->i_buckets[b], sfat_reshape_collect, &walk);
+    }
+    if (!error && walk.next != walk.end)
+    {
+        error = -EIO;  // fewer entries than counted
+    }
+    if (error)
+    {
+        goto out;
+    }
+
+    memset(counts, 0, nb * sizeof(u32));
+    for (i = 0; i < n; ++i)
+    {
+        items[i].bucket = sfat_dir_bucket(sfat_name_hash(items[i].de.name), nb);
+        ++counts[items[i].bucket];
+    }
+    sort(items, n, sizeof(*items), sfat_reshape_item_cmp, NULL);
+
+    for (b = 0; b < nb; ++b)
+    {
+        buckets[b] = ~0U;  // not claimed (yet)
+        nclus += sfat_bucket_clusters(fs_info, counts[b]);
+    }
+    if (ic + nclus > sfat_free_clusters(sbi))
+    {
+        error = -ENOSPC;
+        goto out;
+    }
+
+    // the new chains, after the index
+    sfat_journal_start(sb);
+    if (is_root)
+    {
+        error = sfat_dir_extend_chain(sb, idx_cls, ic, &have);
+    }
+    else
+    {
+        error = sfat_dir_claim_chain(sb, inodei->i_start, ic, &idx_cls);
+        idx_new = !error;
+        have = ic;
+    }
+    cls = idx_cls;
+    for (b = 0; !error && b < nb; ++b)
+    {
+        error = sfat_dir_claim_chain(sb, cls + 1, sfat_bucket_clusters(fs_info, counts[b]), &cls);
+        if (!error)
+        {
+            buckets[b] = cls;
+        }
+    }
+    sfat_journal_stop(sb);
+
+    // the entries into the buckets, a cluster at a time
+    for (b = 0, it = items; !error && b < nb; ++b)
+    {
+        cls = buckets[b];
+        i = counts[b];
+        do
+        {
+            c = min_t(unsigned long, i, per_clus);
+            error = sfat_dir_write_cluster(sb, cls, bhs, it, c);
+            it += c;
+            i -= c;
+            if (!error && i)
+            {
+                error = sfat_get_entry_content(sb, cls, &cls);
+                if (!error && cls >= fs_info->clusters)
+                {
+                    error = -EIO;
+                }
+            }
+        } while (!error && i);
+    }
+    if (error)
+    {
+        goto out_free_new;
+    }
+
+    // the switch, writeback and rename keep out of the entry of dir
+    down_write(&inodei->i_chain_sem);
+    sfat_journal_start(sb);
+    if (!is_root)
+    {
+        mb = sfat_mblock_get(sb, inodei->i_pos >> fs_info->block_bits, &error);
+    }
+    if (!error)
+    {
+        error = sfat_dir_store_index(sb, idx_cls, buckets, nb);
+    }
+    if (!error)
+    {
+        sfat_dir_free_buckets(inodei->i_buckets);
+        inodei->i_buckets = buckets;
+        inodei->i_nbuckets = nb;
+        inodei->i_attrs |= SFAT_ATTR_HASHED;
+        inodei->i_start = idx_cls;
+        dir->i_size = (loff_t)(have + nclus) << fs_info->cluster_bits;
+        dir->i_blocks = (have + nclus) * fs_info->blk_per_clus;
+        buckets = NULL;
+        if (mb)
+        {
+            pde = (struct sfat_dir_entry *)(sfat_mblock_data(mb)
+                    + (inodei->i_pos & (fs_info->block_size - 1)));
+            pde->fst_cls_no = cpu_to_le32(idx_cls);
+            pde->attr |= SFAT_ATTR_HASHED;
+            sfat_entry_store(pde, dir);
+            sfat_mblock_mark_dirty(sb, mb);
+        }
+    }
+    if (mb)
+    {
+        sfat_mblock_put(sb, mb);
+    }
+    sfat_journal_stop(sb);
+    up_write(&inodei->i_chain_sem);
+    if (error)
+    {
+        goto out_free_new;
+    }
+
+    // the inodes in memory go to their new slots, and the next writeback
+    // puts there what went to an old one after it was copied
+    for (i = 0; i < n; ++i)
+    {
+        child = sfat_iget(sb, items[i].old_pos);
+        if (!child)
+        {
+            continue;
+        }
+        down_write(&SFAT_I(child)->i_chain_sem);
+        sfat_detach(child);
+        sfat_attach(child, items[i].new_pos);
+        up_write(&SFAT_I(child)->i_chain_sem);
+        mark_inode_dirty(child);
+        items[i].inode = child;
+    }
+
+    sfat_dir_free_chains(sb, old, nold);
+
+    for (i = 0; i < n; ++i)
+    {
+        if (items[i].inode)
+        {
+            iput(items[i].inode);
+        }
+    }
+    goto out;
+
+out_free_new:
+    sfat_dir_free_chains(sb, buckets, nb);
+    if (idx_new)
+    {
+        buckets[0] = idx_cls;
+        sfat_dir_free_chains(sb, buckets, 1);
+    }
+out:
+    if (bhs)
+    {
+        sfat_dir_free_holders(sb, bhs);
+    }
+    sfat_dir_free_buckets(counts);
+    sfat_dir_free_buckets(buckets);
+    sfat_dir_free_buckets(old);
+    vfree(items);
+    return error;
+}
+
+/*
+ * Desc: rebuild dir if the operation which grew it asked for it (see
+ *   sfat_dir_grown). The caller holds the i_mutex of dir and is outside
+ *   any journal operation. If it fails, dir stays as it is, only slower.
+ */
+static void sfat_dir_maybe_reshape(struct inode *dir)
+{
+    int error = 0;
+
+    if (!SFAT_I(dir)->i_reshape)
+    {
+        return;
+    }
+    SFAT_I(dir)->i_reshape = 0;
+
+    error = sfat_dir_reshape(dir);
+    if (error && error != -ENOSPC)
+    {
+        printk(KERN_WARNING "sfat: directory %lu is not rebuilt (%d)\n", dir->i_ino, error);
+    }
+}
+
+/*
+ * Desc: put the entry of a new file (not directory) into dir
+ *   The caller makes this one journal operation.
+ * Out:
+ *   new_de: the entry
+ *   pi_pos: its position
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_create_entry(struct inode *dir, struct dentry *dentry,
+            struct sfat_dir_entry *new_de, loff_t *pi_pos)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_dir_entry de;
+    unsigned char sname[SFAT_NAME_LEN];
+    struct timespec ts;
+    size_t cls, blk, offset = 0;
+    size_t start_cls = 0;  // chain (directory or bucket) holding the name
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_create_file\n");
+
+    sfat_format_name(dentry->d_name.name, dentry->d_name.len, sname);
+
+    start_cls = sfat_dir_chain_start(dir, sname);
+
+    error = sfat_dentry_locate(sb, start_cls, sname,
+             &de, &cls, &blk, &offset);
+    if (!error)  // file exists
+    {
+        return -EEXIST;
+    }
+    if (error != -ENOENT)  // error other than file not exist
+    {
+        return error;
+    }
+
+    ts = CURRENT_TIME_SEC;
+    sfat_form_dir_entry(&de, 0/* common file */, sname,
+            0/*choose at will due to size = 0*/, 0, &ts);
+
+    error = sfat_dir_add_entry(dir, start_cls, &de, pi_pos);
+    if (error)
+    {
+        return error;
+    }
+
+    memcpy(new_de, &de, sizeof(struct sfat_dir_entry));
+    return 0;
+}
+
+/***** Create a normal file (not directory) */
+static int __sfat_create_file(struct inode *dir, struct dentry *dentry, int mode,
+            struct nameidata *nd)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_dir_entry de;
+    struct inode *inode = NULL;
+    loff_t i_pos = 0;
+    int error = 0;
+
+    sfat_journal_start(sb);
+    error = sfat_create_entry(dir, dentry, &de, &i_pos);
+    sfat_journal_stop(sb);
+    if (error)
+    {
+        return error;
+    }
+
+    error = sfat_build_inode(sb, &de, i_pos, &inode);
+
+    if (error) {
+        return error;
+    }
+
+    // after the inode is there, so that it moves along
+    sfat_dir_maybe_reshape(dir);
+
+    if (IS_DIRSYNC(dir))
+    {
+        error = sfat_fsync_inode(dir, 0);
+        if (error)
+        {
+            iput(inode);
+            return error;
+        }
+    }
+
+    d_instantiate(dentry, inode);
+    return 0;
+}
+
+/***** Create a directory (linear, one cluster) */
+int sfat_mkdir(struct inode *dir, struct dentry *dentry, int mode)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs_info = &sbi->fs_info;
+    struct sfat_dir_entry de;
+    unsigned char sname[SFAT_NAME_LEN];
+    struct inode *inode = NULL;
+    struct timespec ts;
+    size_t cls, blk, offset = 0;
+    size_t start_cls = 0;  // chain (directory or bucket) holding the name
+    loff_t i_pos = 0;
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_mkdir\n");
+
+    sfat_format_name(dentry->d_name.name, dentry->d_name.len, sname);
+    start_cls = sfat_dir_chain_start(dir, sname);
+
+    error = sfat_dentry_locate(sb, start_cls, sname, &de, &cls, &blk, &offset);
+    if (!error)
+    {
+        return -EEXIST;
+    }
+    if (error != -ENOENT)
+    {
+        return error;
+    }
+
+    sfat_journal_start(sb);
+    // near the parent, whose clusters are read together
+    error = sfat_fat_entry_acquire(sb, start_cls, &cls);
+    if (error)
+    {
+        goto out;
+    }
+    error = sfat_dir_init_cluster(sb, cls);
+    if (!error)
+    {
+        ts = CURRENT_TIME_SEC;
+        sfat_form_dir_entry(&de, 1/* directory */, sname, cls, fs_info->cluster_size, &ts);
+        error = sfat_dir_add_entry(dir, start_cls, &de, &i_pos);
+    }
+    if (error)
+    {
+        sfat_fat_chain_release(sb, cls);
+    }
+out:
+    sfat_journal_stop(sb);
+    if (error)
+    {
+        return error;
+    }
+
+    inc_nlink(dir);  // the .. of the new directory
+
+    error = sfat_build_inode(sb, &de, i_pos, &inode);
+    if (error)
+    {
+        return error;
+    }
+
+    // after the inode is there, so that it moves along
+    sfat_dir_maybe_reshape(dir);
+
+    if (IS_DIRSYNC(dir))
+    {
+        error = sfat_fsync_inode(dir, 0);
+        if (error)
+        {
+            iput(inode);
+            return error;
+        }
+    }
+
+    d_instantiate(dentry, inode);
+    return 0;
+}
+
+/*
+ * Desc: remove an empty directory. Only its entry is freed here, the
+ *   clusters go in sfat_delete_inode once the last user has let go of it.
+ *   VFS holds the i_mutex of dir and of the directory itself, so it stays
+ *   empty.
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+int sfat_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    struct super_block *sb = dir->i_sb;
+    struct inode *inode = dentry->d_inode;
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    struct timespec ts;
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_rmdir\n");
+
+    error = sfat_count_subdirs(inode);
+    if (error)
+    {
+        return error > 0? -ENOTEMPTY: error;
+    }
+
+    // no writeback of the entry while its slot is freed
+    down_write(&inodei->i_chain_sem);
+    sfat_journal_start(sb);
+    error = sfat_dir_free_slot(sb, inodei->i_pos);
+    if (!error)
+    {
+        sfat_detach(inode);
+    }
+    sfat_journal_stop(sb);
+    up_write(&inodei->i_chain_sem);
+    if (error)
+    {
+        return error;
+    }
+
+    clear_nlink(inode);
+    drop_nlink(dir);  // its ..
+
+
+    ts = CURRENT_TIME_SEC;
+    dir->i_mtime.tv_sec = ts.tv_sec;
+    mark_inode_dirty(dir);
+
+    if (IS_DIRSYNC(dir))
+    {
+        error = sfat_fsync_inode(dir, 0);
+    }
+    return error;
+}
+
+/*
+ * one file of SFAT_IOCTL_CREATE_BATCH
+ */
+struct sfat_batch_item {
+    unsigned char sname[SFAT_NAME_LEN];
+    size_t chain;                /* chain (directory or bucket) of the name */
+    unsigned long idx;           /* in the array of the caller */
+    unsigned long nclus;         /* no. of data clusters */
+    size_t *clus;                /* the data clusters */
+    int error;
+};
+
+/*
+ * the files of one chain, see sfat_batch_scan
+ */
+struct sfat_batch_group {
+    struct sfat_batch_item *items;
+    unsigned long n;
+    unsigned long needed;        /* no. of them to be created */
+    loff_t *slots;               /* free slots in chain order, room for n + 1 */
+    unsigned long nslots;
+    unsigned long tail;          /* slots[tail] ... are after the end marker */
+    size_t last_cls;             /* last cluster of the chain */
+};
+
+static int sfat_batch_item_cmp(const void *a, const void *b)
+{
+    const struct sfat_batch_item *x = a;
+    const struct sfat_batch_item *y = b;
+
+    if (x->chain != y->chain)
+        return x->chain < y->chain? -1: 1;
+    return strncmp((const char *)x->sname, (const char *)y->sname, SFAT_NAME_LEN);
+}
+
+/* as sfat_batch_item_cmp, a name given twice in the order of the caller */
+static int sfat_batch_item_cmp_idx(const void *a, const void *b)
+{
+    const struct sfat_batch_item *x = a;
+    const struct sfat_batch_item *y = b;
+    int c = sfat_batch_item_cmp(a, b);
+
+    if (c || x->idx == y->idx)
+        return c;
+    return x->idx < y->idx? -1: 1;
+}
+
+/*
+ * items of one group are sorted by name, a name given twice has adjacent
+ * items
+ * Return: the index of the first item with the name, or g->n
+ */
+static unsigned long sfat_batch_find(struct sfat_batch_group *g, const unsigned char *name)
+{
+    unsigned long lo = 0;
+    unsigned long hi = g->n;
+    unsigned long mid = 0;
+
+    while (lo < hi)  // the lowest item not below name
+    {
+        mid = lo + (hi - lo) / 2;
+        if (strncmp((const char *)g->items[mid].sname, (const char *)name, SFAT_NAME_LEN) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo < g->n && !strncmp((const char *)g->items[lo].sname, (const char *)name, SFAT_NAME_LEN))
+    {
+        return lo;
+    }
+    return g->n;
+}
+
+/*
+ * Desc: walk the chain of a group once, marking the names which exist
+ *   already (-EEXIST) and collecting up to n + 1 free slots: the free
+ *   entries before the end marker and the ones from it on.
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_batch_scan(struct super_block *sb, struct sfat_batch_group *g)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    unsigned long it = 0;
+    struct sfat_dir_entry *ent = NULL;
+    struct sfat_mblock *mb = NULL;
+    unsigned long max = g->n + 1;
+    size_t cur_cls = g->items[0].chain;
+    size_t next_cls = 0;
+    size_t i, j, k = 0;
+    int ended = 0;
+    int error = 0;
+
+    sfat_stat_inc(sb, SFAT_STAT_DIR_SCAN);
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
+
+    g->nslots = 0;
+    g->tail = ~0UL;
+    for (i = 0; i < fs->clusters; ++i)  // just for protection
+    {
+        g->last_cls = cur_cls;
+        for (j = 0; j < fs->blk_per_clus; ++j)
+        {
+            if (ended && g->nslots >= max)
+            {
+                return 0;  // nothing more to learn
+            }
+            mb = sfat_mblock_get(sb, CLS_TO_BLK(fs, cur_cls) + j, &error);
+            if (!mb)
+            {
+                return error;
+            }
+            ent = (struct sfat_dir_entry *)sfat_mblock_data(mb);
+
+            for (k = 0; k < fs->dirent_per_blk; ++k)
+            {
+                if (!ended && (ent[k].attr & SFAT_ATTR_EMPTY_END))
+                {
+                    ended = 1;
+                    g->tail = g->nslots;
+                }
+                if (ended || (ent[k].attr & SFAT_ATTR_EMPTY))
+                {
+                    if (g->nslots < max)
+                    {
+                        g->slots[g->nslots++] = form_dir_entry_pos(fs, cur_cls, j,
+                                k * sizeof(struct sfat_dir_entry));
+                    }
+                    continue;
+                }
+                // every copy of a name given twice
+                for (it = sfat_batch_find(g, ent[k].name); it < g->n
+                        && !strncmp((const char *)g->items[it].sname,
+                            (const char *)ent[k].name, SFAT_NAME_LEN); ++it)
+                {
+                    g->items[it].error = -EEXIST;
+                }
+            }
+            sfat_mblock_put(sb, mb);
+        }
+
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cur_cls, &next_cls);
+        if (error)
+        {
+            return error;
+        }
+        if (SFAT_ENTRY_EOC == next_cls)
+        {
+            break;
+        }
+        if (next_cls > fs->clusters)
+        {
+            return -EINVAL;
+        }
+        cur_cls = next_cls;
+    }
+
+    if (~0UL == g->tail)
+    {
+        g->tail = g->nslots;  // the chain is full
+    }
+    return 0;
+}
+
+/*
+ * Desc: grow the chain of a group by the clusters its files are short of,
+ *   all at once and contiguous where possible; their slots are added
+ */
+static int sfat_batch_grow(struct inode *dir, struct sfat_batch_group *g)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    unsigned long per_clus = fs->dirent_per_blk << fs->blk_per_clus_bits;
+    unsigned long nclus = 0;
+    unsigned long i = 0;
+    unsigned long k = 0;
+    size_t cls = 0;
+    int error = 0;
+
+    if (g->nslots >= g->needed)
+    {
+        return 0;
+    }
+    nclus = DIV_ROUND_UP(g->needed - g->nslots, per_clus);
+
+    for (i = 0; i < nclus; ++i)
+    {
+        error = sfat_fat_entry_acquire(sb, g->last_cls + 1, &cls);
+        if (!error)
+        {
+            error = sfat_fat_entry_modify(sb, g->last_cls, cpu_to_le32(cls));
+        }
+        if (error)
+        {
+            return error;
+        }
+        g->last_cls = cls;
+        dir->i_size += fs->cluster_size;
+        dir->i_blocks += fs->blk_per_clus;
+
+        for (k = 0; k < per_clus && g->nslots < g->n + 1; ++k)
+        {
+            g->slots[g->nslots++] = form_dir_entry_pos(fs, cls, k / fs->dirent_per_blk,
+                    (k % fs->dirent_per_blk) * sizeof(struct sfat_dir_entry));
+        }
+    }
+    sfat_dir_grown(dir);
+    return 0;
+}
+
+/*
+ * Desc: allocate the data clusters of the files, one run for all of them
+ *   (each file is chained on its own)
+ * In:
+ *   clus: room for all the clusters
+ */
+static int sfat_batch_alloc_data(struct super_block *sb, struct sfat_batch_item *items,
+        unsigned long n, size_t *clus)
+{
+    size_t goal = SFAT_CLS_NONE;
+    unsigned long i = 0;
+    unsigned long c = 0;
+    int error = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        if (items[i].error || !items[i].nclus)
+        {
+            continue;
+        }
+        items[i].clus = clus;
+        for (c = 0; c < items[i].nclus; ++c)
+        {
+            error = sfat_fat_entry_acquire(sb, goal, &clus[c]);
+            if (!error && c)
+            {
+                error = sfat_fat_entry_modify(sb, clus[c - 1], cpu_to_le32(clus[c]));
+            }
+            if (error)
+            {
+                return error;
+            }
+            goal = clus[c] + 1;
+        }
+        clus += items[i].nclus;
+    }
+    return 0;
+}
+
+/*
+ * Desc: write the contents of the files into their clusters, blocks
+ *   following each other on the volume by one bio (unused bytes of the
+ *   last block are zeroed)
+ */
+static int sfat_batch_write_data(struct super_block *sb, struct sfat_batch_item *items,
+        unsigned long n, struct sfat_batch_file *files)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    struct block_holder *bhs[SFAT_WB_MAX_RUN] = {NULL};
+    const char __user *data = NULL;
+    unsigned long len = 0;       // blocks in bhs
+    size_t run_blk = 0;          // block of bhs[0]
+    size_t blk = 0;
+    size_t left = 0;
+    size_t part = 0;
+    unsigned long i = 0;
+    unsigned long c = 0;
+    unsigned long b = 0;
+    int error = 0;
+
+    for (i = 0; i < SFAT_WB_MAX_RUN; ++i)
+    {
+        bhs[i] = sfat_blkholder_alloc();
+        if (!bhs[i])
+        {
+            error = -ENOMEM;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        if (items[i].error || !items[i].nclus)
+        {
+            continue;
+        }
+        data = (const char __user *)(unsigned long)files[items[i].idx].data;
+        left = files[items[i].idx].size;
+
+        for (c = 0; c < items[i].nclus; ++c)
+        {
+            blk = CLS_TO_BLK(fs, items[i].clus[c]);
+            for (b = 0; b < fs->blk_per_clus && left; ++b, ++blk)
+            {
+                if (len && (len == SFAT_WB_MAX_RUN || blk != run_blk + len))
+                {
+                    error = sfat_write_blocks(sb, bhs, len, run_blk);
+                    if (error)
+                    {
+                        goto out;
+                    }
+                    len = 0;
+                }
+                if (!len)
+                {
+                    run_blk = blk;
+                }
+
+                part = min_t(size_t, left, fs->block_size);
+                if (copy_from_user(sfat_blkholder_get_data(bhs[len]), data, part))
+                {
+                    error = -EFAULT;
+                    goto out;
+                }
+                memset(sfat_blkholder_get_data(bhs[len]) + part, 0, fs->block_size - part);
+                ++len;
+                data += part;
+                left -= part;
+            }
+        }
+    }
+    if (len)
+    {
+        error = sfat_write_blocks(sb, bhs, len, run_blk);
+    }
+
+out:
+    for (i = 0; i < SFAT_WB_MAX_RUN && bhs[i]; ++i)
+    {
+        sfat_blkholder_free(bhs[i]);
+    }
+    return error;
+}
+
+/*
+ * Desc: put the entries of a group into its slots, in order, and the end
+ *   marker after the last one if it went beyond the old one
+ *   Every block is changed in the cache once for all its slots.
+ * Return:
+ *   no. of entries written or < 0: error code
+ */
+static long sfat_batch_fill(struct super_block *sb, struct sfat_batch_group *g,
+        struct sfat_batch_file *files, struct timespec *ts)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    struct sfat_mblock *mb = NULL;
+    struct sfat_dir_entry *pde = NULL;
+    struct sfat_batch_item *it = NULL;
+    size_t blk = SFAT_BLK_NONE;
+    unsigned long s = 0;
+    unsigned long i = 0;
+    int error = 0;
+
+    for (i = 0; i <= g->n; ++i)
+    {
+        if (i < g->n)
+        {
+            it = &g->items[i];
+            if (it->error)
+            {
+                continue;
+            }
+        }
+        else if (s <= g->tail || s >= g->nslots)
+        {
+            break;  // the old end marker is still behind, or the chain is full
+        }
+
+        if ((size_t)(g->slots[s] >> fs->block_bits) != blk)
+        {
+            if (mb)
+            {
+                sfat_mblock_mark_dirty(sb, mb);
+                sfat_mblock_put(sb, mb);
+            }
+            blk = g->slots[s] >> fs->block_bits;
+            mb = sfat_mblock_get(sb, blk, &error);
+            if (!mb)
+            {
+                return error;
+            }
+        }
+        pde = (struct sfat_dir_entry *)(sfat_mblock_data(mb) + (g->slots[s] & (fs->block_size - 1)));
+
+        if (i == g->n)
+        {
+            pde->attr = SFAT_ATTR_EMPTY_END;
+            break;
+        }
+        sfat_form_dir_entry(pde, 0/* common file */, it->sname,
+                it->nclus? it->clus[0]: 0, files[it->idx].size, ts);
+        ++s;
+    }
+    if (mb)
+    {
+        sfat_mblock_mark_dirty(sb, mb);
+        sfat_mblock_put(sb, mb);
+    }
+    return s;
+}
+
+/*
+ * Desc: a negative dentry of a created name would hide the file, drop it
+ *   The caller holds the i_mutex of the directory.
+ */
+static void sfat_batch_drop_negative(struct dentry *parent, const char *name)
+{
+    struct dentry *dentry = NULL;
+    struct qstr q;
+
+    q.name = (const unsigned char *)name;
+    q.len = strlen(name);
+    sfat_hash(parent, &q);
+    dentry = d_lookup(parent, &q);
+    if (dentry)
+    {
+        if (!dentry->d_inode)
+        {
+            d_drop(dentry);
+        }
+        dput(dentry);
+    }
+}
+
+/*
+ * Desc: SFAT_IOCTL_CREATE_BATCH, create many files in a directory at once
+ *   (see sfat_fs.h)
+ *   The directory is scanned once per chain. The entries and the new
+ *   clusters are one journal operation each; the contents are written
+ *   between them without holding operations off, so a crash there can at
+ *   most leak the data clusters.
+ * In:
+ *   arg: struct sfat_ioctl_batch in user space
+ * Return:
+ *   0: success, the results of the files are in their error fields
+ *   < 0: error code, for the whole call
+ */
+static int sfat_ioctl_create_batch(struct file *filp, void __user *arg)
+{
+    struct dentry *parent = filp->f_path.dentry;
+    struct inode *dir = parent->d_inode;
+    struct super_block *sb = dir->i_sb;
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs = &sbi->fs_info;
+    struct sfat_ioctl_batch req;
+    struct sfat_batch_file *files = NULL;
+    struct sfat_batch_item *items = NULL;
+    struct sfat_batch_group *groups = NULL;
+    loff_t *slots = NULL;
+    size_t *clus = NULL;
+    unsigned long per_clus = fs->dirent_per_blk << fs->blk_per_clus_bits;
+    unsigned long ngroups = 0;
+    unsigned long nclus = 0;   // data clusters
+    unsigned long dclus = 0;   // directory clusters
+    unsigned long created = 0;
+    unsigned long total = 0;
+    unsigned long i = 0;
+    unsigned long k = 0;
+    size_t len = 0;
+    struct timespec ts;
+    long ret = 0;
+    int error = 0;
+
+    if (!S_ISDIR(dir->i_mode))
+    {
+        return -ENOTDIR;
+    }
+    if (IS_RDONLY(dir))
+    {
+        return -EROFS;
+    }
+
+    // the checks VFS makes before create, the directory may have been
+    // opened read-only
+    error = mnt_want_write(filp->f_path.mnt);
+    if (error)
+    {
+        return error;
+    }
+    error = inode_permission(dir, MAY_WRITE | MAY_EXEC);
+    if (error)
+    {
+        goto out;
+    }
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+    {
+        error = -EFAULT;
+        goto out;
+    }
+    if (!req.count || req.count > SFAT_BATCH_MAX_FILES)
+    {
+        error = -EINVAL;
+        goto out;
+    }
+
+    files = vmalloc(req.count * sizeof(*files));
+    items = vmalloc(req.count * sizeof(*items));
+    groups = vmalloc(req.count * sizeof(*groups));
+    slots = vmalloc(2 * req.count * sizeof(*slots));  // n + 1 per group
+    if (!files || !items || !groups || !slots)
+    {
+        error = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(files, (void __user *)(unsigned long)req.files,
+            req.count * sizeof(*files)))
+    {
+        error = -EFAULT;
+        goto out;
+    }
+
+    for (i = 0; i < req.count; ++i)
+    {
+        len = strnlen(files[i].name, SFAT_BATCH_NAME_LEN);
+        if (!len || SFAT_BATCH_NAME_LEN == len || strchr(files[i].name, '/')
+            || !strcmp(files[i].name, ".") || !strcmp(files[i].name, ".."))
+        {
+            error = -EINVAL;
+            goto out;
+        }
+        if (files[i].size && !access_ok(VERIFY_READ,
+                (void __user *)(unsigned long)files[i].data, files[i].size))
+        {
+            error = -EFAULT;
+            goto out;
+        }
+        total += files[i].size;
+        if (total > SFAT_BATCH_MAX_DATA)
+        {
+            error = -EINVAL;
+            goto out;
+        }
+        files[i].error = 0;
+
+        sfat_format_name((const unsigned char *)files[i].name, len, items[i].sname);
+        items[i].idx = i;
+        items[i].nclus = DIV_ROUND_UP(files[i].size, fs->cluster_size);
+        items[i].clus = NULL;
+        items[i].error = 0;
+    }
+
+    mutex_lock(&dir->i_mutex);
+
+    for (i = 0; i < req.count; ++i)
+    {
+        items[i].chain = sfat_dir_chain_start(dir, items[i].sname);
+    }
+    sort(items, req.count, sizeof(*items), sfat_batch_item_cmp_idx, NULL);
+
+    // one group per chain, a name given twice is taken by the first one
+    for (i = 0; i < req.count; i += k)
+    {
+        for (k = 1; i + k < req.count && items[i + k].chain == items[i].chain; ++k)
+        {
+            if (!sfat_batch_item_cmp(&items[i + k - 1], &items[i + k]))
+            {
+                items[i + k].error = -EEXIST;
+            }
+        }
+        groups[ngroups].items = &items[i];
+        groups[ngroups].n = k;
+        groups[ngroups].slots = slots + i + ngroups;
+        ++ngroups;
+    }
+
+    for (i = 0; i < ngroups; ++i)
+    {
+        error = sfat_batch_scan(sb, &groups[i]);
+        if (error)
+        {
+            goto out_unlock;
+        }
+        groups[i].needed = 0;
+        for (k = 0; k < groups[i].n; ++k)
+        {
+            if (!groups[i].items[k].error)
+            {
+                ++groups[i].needed;
+                nclus += groups[i].items[k].nclus;
+            }
+        }
+        if (groups[i].nslots < groups[i].needed)
+        {
+            dclus += DIV_ROUND_UP(groups[i].needed - groups[i].nslots, per_clus);
+        }
+    }
+
+    // all or nothing rather than running out halfway
+    if (nclus + dclus > sfat_free_clusters(sbi))
+    {
+        error = -ENOSPC;
+        goto out_unlock;
+    }
+    if (nclus)
+    {
+        clus = vmalloc(nclus * sizeof(*clus));
+        if (!clus)
+        {
+            error = -ENOMEM;
+            goto out_unlock;
+        }
+    }
+
+    sfat_journal_start(sb);
+    for (i = 0; i < ngroups && !error; ++i)
+    {
+        error = sfat_batch_grow(dir, &groups[i]);
+    }
+    if (dclus)
+    {
+        mark_inode_dirty(dir);
+    }
+    if (!error)
+    {
+        error = sfat_batch_alloc_data(sb, items, req.count, clus);
+    }
+    sfat_journal_stop(sb);
+    if (error)
+    {
+        goto out_unlock;
+    }
+
+    if (nclus)
+    {
+        error = sfat_batch_write_data(sb, items, req.count, files);
+        if (error)
+        {
+            goto out_unlock;
+        }
+    }
+
+    ts = CURRENT_TIME_SEC;
+    sfat_journal_start(sb);
+    for (i = 0; i < ngroups; ++i)
+    {
+        ret = sfat_batch_fill(sb, &groups[i], files, &ts);
+        if (ret < 0)
+        {
+            error = ret;
+            break;
+        }
+        created += ret;
+    }
+    dir->i_mtime.tv_sec = ts.tv_sec;
+    mark_inode_dirty(dir);
+    sfat_journal_stop(sb);
+    if (error)
+    {
+        goto out_unlock;
+    }
+
+    sfat_stat_add(sb, SFAT_STAT_BATCH_FILE, created);
+
+    for (i = 0; i < req.count; ++i)
+    {
+        files[items[i].idx].error = items[i].error;
+        if (!items[i].error)
+        {
+            sfat_batch_drop_negative(parent, files[items[i].idx].name);
+        }
+    }
+
+out_unlock:
+    sfat_dir_maybe_reshape(dir);
+    mutex_unlock(&dir->i_mutex);
+
+    if (!error && IS_DIRSYNC(dir))
+    {
+        error = sfat_fsync_inode(dir, 0);
+    }
+    if (!error)
+    {
+        req.created = created;
+        if (copy_to_user((void __user *)(unsigned long)req.files, files,
+                req.count * sizeof(*files))
+            || copy_to_user(arg, &req, sizeof(req)))
+        {
+            error = -EFAULT;
+        }
+    }
+
+out:
+    vfree(clus);
+    vfree(slots);
+    vfree(groups);
+    vfree(items);
+    vfree(files);
+    mnt_drop_write(filp->f_path.mnt);
+    return error;
+}
+
+
+/*
+ * Desc: rename, the directory entry is moved to its new slot (in the same
+ *   or another directory) with the new name. The data clusters and the
+ *   inode in memory stay as they are, only i_pos changes. So at most the
+ *   two blocks holding the slots are changed (plus the end marker or the
+ *   growth of the new directory if it needs a new slot).
+ *   An existing target gives its slot to the entry. Its inode is detached
+ *   from the volume and its clusters are freed by sfat_delete_inode once
+ *   the last user has let go of it.
+ *   VFS holds the i_mutex of both directories (and of the target), has
+ *   checked the types of both sides and returns before calling this if
+ *   both names are the same entry.
+ * Return:
+ *   0: success
+ *   < 0: error code
  */
-struct dentry * sfat_lookup(struct inode *dir,struct dentry *dentry, struct nameidata *data)
+int sfat_rename(struct inode *old_dir, struct dentry *old_dentry,
+            struct inode *new_dir, struct dentry *new_dentry)
 {
-    struct super_block *sb = dir->i_sb;
-    struct block_device *bdev = sb->s_bdev;
+    struct super_block *sb = old_dir->i_sb;
     struct sfat_sb_info *sbi = SFAT_SB(sb);
-    struct sfat_inode_info *inodei = SFAT_I(dir);
     struct sfat_fs_info *fs_info = &sbi->fs_info;
+    struct inode *inode = old_dentry->d_inode;
+    struct inode *target = new_dentry->d_inode;
+    struct sfat_inode_info *inodei = SFAT_I(inode);
 
-    struct inode *inode = NULL;
-
+    struct sfat_mblock *mb = NULL;
     struct sfat_dir_entry de;
-    size_t len = (dentry->d_name.len < SFAT_NAME_LEN)? dentry->d_name.len: SFAT_NAME_LEN;
+    struct sfat_dir_entry *pde = NULL;
+    unsigned char sname[SFAT_NAME_LEN];
+    struct timespec ts;
+    loff_t old_pos = 0;
+    loff_t new_pos = 0;
+    int error = 0;
 
-    size_t cls, blk, offset = 0;
-    loff_t i_pos = 0;  // position of entry in the volume in byte
+    sfat_dbg(2, "sfat: sfat_rename\n");
 
-    int i = 0;
-    int error = 0;
+    if (target && S_ISDIR(target->i_mode))
+    {
+        error = sfat_count_subdirs(target);
+        if (error)
+        {
+            return error > 0? -ENOTEMPTY: error;
+        }
+    }
+
+    sfat_format_name(new_dentry->d_name.name, new_dentry->d_name.len, sname);
+    ts = CURRENT_TIME_SEC;
 
-    printk (KERN_INFO "sfat: sfat_lookup\n");
+    // no writeback of either entry while the slots change hands,
+    // the i_mutex of the directories keeps other renames of them out
+    down_write(&inodei->i_chain_sem);
+    if (target)
+    {
+        down_write(&SFAT_I(target)->i_chain_sem);
+    }
+    sfat_journal_start(sb);
 
-    for (i = 0; i < len; ++i)
+    old_pos = inodei->i_pos;
+    mb = sfat_mblock_get(sb, old_pos >> fs_info->block_bits, &error);
+    if (!mb)
     {
-        de.name[i] = dentry->d_name.name[i];
+        goto out;
     }
+    memcpy(&de, sfat_mblock_data(mb) + (old_pos & (fs_info->block_size - 1)),
+            sizeof(struct sfat_dir_entry));
+    sfat_mblock_put(sb, mb);
 
-    for (;i < SFAT_NAME_LEN; ++i)
+    // the new entry, as the inode is now (the old slot may be behind)
+    memcpy(de.name, sname, SFAT_NAME_LEN);
+    de.fst_cls_no = cpu_to_le32(inodei->i_start);
+    sfat_entry_store(&de, inode);
+
+    if (target)
+    {
+        new_pos = SFAT_I(target)->i_pos;
+        mb = sfat_mblock_get(sb, new_pos >> fs_info->block_bits, &error);
+        if (!mb)
+        {
+            goto out;
+        }
+        pde = (struct sfat_dir_entry *)(sfat_mblock_data(mb)
+                + (new_pos & (fs_info->block_size - 1)));
+        memcpy(pde, &de, sizeof(struct sfat_dir_entry));
+        sfat_mblock_mark_dirty(sb, mb);
+        sfat_mblock_put(sb, mb);
+    }
+    else
     {
-        de.name[i] = '\0';
+        // a negative dentry: the name is not on disk
+        error = sfat_dir_add_entry(new_dir, sfat_dir_chain_start(new_dir, sname),
+                &de, &new_pos);
+        if (error)
+        {
+            goto out;
+        }
     }
 
-    error = sfat_dentry_locate(fs_info, bdev, inodei->i_start, de.name,
-             &de, &cls, &blk, &offset);
+    error = sfat_dir_free_slot(sb, old_pos);
+    if (error)
+    {
+        goto out;
+    }
+
+    // the target first, so the slot never has two inodes
+    if (target)
+    {
+        sfat_detach(target);
+    }
+    sfat_detach(inode);
+    sfat_attach(inode, new_pos);
+
+out:
+    sfat_journal_stop(sb);
+    if (target)
+    {
+        up_write(&SFAT_I(target)->i_chain_sem);
+    }
+    up_write(&inodei->i_chain_sem);
     if (error)
     {
-        if (-ENOENT == error)
+        return error;
+    }
+
+    if (target)
+    {
+        if (S_ISDIR(target->i_mode))
         {
-            return NULL;
+            clear_nlink(target);
+            drop_nlink(new_dir);  // the .. of the target
         }
         else
         {
-            return ERR_PTR(error);
+            drop_nlink(target);
         }
     }
 
-    i_pos = form_dir_entry_pos(fs_info, cls, blk, offset);
+    // a directory takes its .. along
+    if (S_ISDIR(inode->i_mode) && new_dir != old_dir)
+    {
+        drop_nlink(old_dir);
+        inc_nlink(new_dir);
+    }
 
-    error = sfat_build_inode(sb, &de, i_pos, &inode);
-    if (error) {
+    old_dir->i_mtime.tv_sec = ts.tv_sec;
+    mark_inode_dirty(old_dir);
+    if (new_dir != old_dir)
+    {
+        new_dir->i_mtime.tv_sec = ts.tv_sec;
+        mark_inode_dirty(new_dir);
+    }
+    sfat_dir_maybe_reshape(new_dir);
+
+    if (IS_DIRSYNC(old_dir))
+    {
+        error = sfat_fsync_inode(old_dir, 0);
+    }
+    if (!error && new_dir != old_dir && IS_DIRSYNC(new_dir))
+    {
+        error = sfat_fsync_inode(new_dir, 0);
+    }
+    return error;
+}
+
+
+/*
+ * Desc:
+ *   look up certain file in a directory according to file's name
+ *
+ * In:
+ *   dir: directory
+ *   dentry: dentry prepared for file to be looked up.
+ *   data: name info of the file to be looked up.
+ *
+ * Ret:
+ *   NULL: dentry is used (negative if there is no such file)
+ *   not NULL: the dentry to be used instead
+ *             or error code formed by ERR_PTR(err)
+ *
+ */
+static struct dentry * __sfat_lookup(struct inode *dir,struct dentry *dentry, struct nameidata *data)
+{
+    struct super_block *sb = dir->i_sb;
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs_info = &sbi->fs_info;
+
+    struct inode *inode = NULL;
+
+    struct sfat_dir_entry de;
+
+    size_t cls, blk, offset = 0;
+    loff_t i_pos = 0;  // position of entry in the volume in byte
+
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_lookup\n");
+
+    sfat_format_name(dentry->d_name.name, dentry->d_name.len, de.name);
+
+    error = sfat_dentry_locate(sb, sfat_dir_chain_start(dir, de.name), de.name,
+             &de, &cls, &blk, &offset);
+    trace_sfat_lookup(dir, de.name, error);
+    if (error && -ENOENT != error)
+    {
         return ERR_PTR(error);
     }
 
+    if (!error)
+    {
+        i_pos = form_dir_entry_pos(fs_info, cls, blk, offset);
+
+        error = sfat_build_inode(sb, &de, i_pos, &inode);
+        if (error) {
+            return ERR_PTR(error);
+        }
+    }
+    // else no such file: inode stays NULL and the dentry is added as a
+    // negative one, later probes of the name are answered by dcache.
+
     // The following code is copied from msdos(namei_msdos.c)
     dentry->d_op = &sfat_dentry_operations;
     dentry = d_splice_alias(inode, dentry);
@@ -1307,7 +4036,7 @@ struct dentry * sfat_lookup(struct inode *dir,struct dentry *dentry, struct name
 // todo: to be implemented
 int sfat_setattr(struct dentry *de, struct iattr *attr)
 {
-    printk (KERN_INFO "sfat: sfat_setattr\n");
+    sfat_dbg(2, "sfat: sfat_setattr\n");
     return -EINVAL;
 }
 
@@ -1315,13 +4044,13 @@ int sfat_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat
 {
     struct inode *inode = dentry->d_inode;
 
-    printk (KERN_INFO "sfat: sfat_getattr, inode no. is %lu\n", inode->i_ino);
+    sfat_dbg(2, "sfat: sfat_getattr, inode no. is %lu\n", inode->i_ino);
 
     generic_fillattr(inode, stat);  // linux library function
     // stat->blksize = SFAT_SB(inode->i_sb)->fs_info.cluster_size;  // copied from FAT
     stat->blksize = SFAT_SB(inode->i_sb)->fs_info.block_size;
 
-    printk (KERN_INFO "sfat: sfat_getattr \n"
+    sfat_dbg(2, "sfat: sfat_getattr \n"
             "dev = %u\n"
             "ino = %llu\n"
             "mode = %u\n"
@@ -1352,71 +4081,148 @@ int sfat_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat
     return 0;
 }
 
+/*
+ * Desc: report the clusters of a file as extents (FS_IOC_FIEMAP)
+ *   The FAT chain is walked from the first cluster, clusters which follow
+ *   each other on disk are merged into one extent.
+ * In:
+ *   start, len: the range of the file asked for, in bytes
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+int sfat_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    size_t cls = 0;
+    size_t nr_cls = 0;  // clusters of the file
+    size_t i = 0;
+
+    u64 end = 0;
+    u64 logical = 0;     // current extent, in bytes
+    u64 phys = 0;
+    u64 ext_len = 0;
+    u64 cls_phys = 0;
+
+    int at_eof = 0;  // the last cluster of the file was reached
+    int error = 0;
+
+    sfat_dbg(2, "sfat: sfat_fiemap, inode no. is %lu\n", inode->i_ino);
+
+    error = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+    if (error) {
+        return error;
+    }
+
+    down_read(&SFAT_I(inode)->i_chain_sem);
+    cls = SFAT_I(inode)->i_start;
+    nr_cls = (inode->i_size + fs->cluster_size - 1) >> fs->cluster_bits;
+    if (0 == nr_cls || cls >= fs->clusters) {
+        goto out;  // no cluster allocated
+    }
+
+    end = (start + len < start)? ~(u64)0: start + len;  // overflow of FIEMAP_MAX_OFFSET
+
+    sfat_stat_inc(sb, SFAT_STAT_CHAIN_WALK);
+    for (i = 0; i < nr_cls; ++i)
+    {
+        if ((u64)i << fs->cluster_bits >= end) {
+            break;
+        }
+
+        cls_phys = (u64)CLS_TO_BLK(fs, cls) << fs->block_bits;
+        if (ext_len && phys + ext_len == cls_phys) {
+            ext_len += fs->cluster_size;
+        } else {
+            if (ext_len && logical + ext_len > start) {
+                error = fiemap_fill_next_extent(fieinfo, logical, phys, ext_len, 0);
+                if (error) {
+                    goto out;
+                }
+            }
+            logical = (u64)i << fs->cluster_bits;
+            phys = cls_phys;
+            ext_len = fs->cluster_size;
+        }
+
+        if (i + 1 == nr_cls) {
+            at_eof = 1;
+            break;
+        }
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cls, &cls);
+        if (error) {
+            goto out;
+        }
+        if (cls >= fs->clusters) {  // chain shorter than the size
+            printk(KERN_ERR "sfat: chain of inode %lu ends early\n", inode->i_ino);
+            error = -EIO;
+            goto out;
+        }
+    }
+
+    if (ext_len && logical + ext_len > start) {
+        error = fiemap_fill_next_extent(fieinfo, logical, phys, ext_len,
+                at_eof? FIEMAP_EXTENT_LAST: 0);
+    }
+
+out:
+    up_read(&SFAT_I(inode)->i_chain_sem);
+    // 1 => the array of the caller is full, which is no error
+    return error < 0? error: 0;
+}
+
 
 /*
- * Desc: fill the dirent as much as possible, may add more than one dir
- * Para:
- *   In:
- *   dirent: struct kernel uses to contain direntry
- *   filldir: function kernel provides for others to use to fill the dir entry
- *
- *   Return:
- *       0: O.K.
- *       < 0: error code
+ * Desc: fill the dirent with the entries of one directory chain, in the
+ *   order of their slots
+ * In:
+ *   start_cls: first cluster of the chain
+ * InOut:
+ *   cpos: position (in byte) in the chain, stays on SFAT_ATTR_EMPTY_END
+ *         once the end is reached so that the order is stable
+ * Return:
+ *   0: end of the chain is reached
+ *   1: filldir has no more room
+ *   < 0: error code
  */
-int sfat_readdir(struct file *filp, void *dirent, filldir_t filldir) {
-    struct inode *inode = filp->f_path.dentry->d_inode;
+static int sfat_readdir_chain(struct inode *inode, size_t start_cls,
+        loff_t *cpos, void *dirent, filldir_t filldir)
+{
     struct super_block *sb = inode->i_sb;
-    struct block_device *bdev = sb->s_bdev;
-    struct sfat_sb_info *sbi = SFAT_SB(sb);
-    struct sfat_inode_info *inodei = SFAT_I(inode);
-    struct sfat_fs_info *fs_info = &sbi->fs_info;
+    struct sfat_fs_info *fs_info = &(SFAT_SB(sb)->fs_info);
 
     int error = 0;
-    size_t cls = inodei->i_start;
-    size_t size = inode->i_size; // type changing from loff_t to size_t
-                                 // since the size in dir entry has only 32-bit
-
-    size_t rounds = 1 + ((size + fs_info->cluster_size - 1) >> fs_info->cluster_bits);
-
+    size_t cls = 0;
+    size_t rounds = fs_info->clusters;  // just for protection of loop
     size_t blk = 0;
 
-    struct block_holder *bh = NULL;
+    struct sfat_mblock *mb = NULL;
 
     char *data = NULL;
     struct sfat_dir_entry *de = NULL;
 
     ino_t inode_no = 0;
     size_t len = 0;
-    loff_t cpos = filp->f_pos;  // pos in the directory file
     size_t offset = 0;
     size_t blk_off = 0;
-    // --------------------------
-    printk(KERN_INFO "sfat: sfat_readdir\n");
-
-    if (size < 32) {
-        return 0; // empty directory
-    }
-    if (cpos >= size) {  // nothing left to read
-        return -EINVAL;
-    }
 
     // Boundary checking
-    if (cpos & (sizeof(struct sfat_dir_entry) - 1)) {
+    if (*cpos & (sizeof(struct sfat_dir_entry) - 1)) {
         return -ENOENT;
     }
 
-    error = sfat_seek(fs_info, bdev, cls, cpos, &cls, &offset);
+    error = sfat_seek(sb, start_cls, *cpos, &cls, &offset);
+    if (-EINVAL == error)
+    {
+        return 0;  // the chain is full and cpos is right after its end
+    }
     if (error)
     {
         return error;
     }
 
-    bh = sfat_blkholder_alloc();
-    if (!bh) {
-        return -ENOMEM;
-    }
-
     blk = CLS_TO_BLK(fs_info, cls);
     blk_off = (offset >> fs_info->block_bits);  // in one cluster
     offset = offset & (fs_info->block_size - 1);  // in one block
@@ -1424,39 +4230,37 @@ int sfat_readdir(struct file *filp, void *dirent, filldir_t filldir) {
     // rounds -> cluster
     // blk_off -> block
     // offset -> entry
-    while (rounds > 0) {  // just for protection of loop
+    while (rounds > 0) {
         --rounds;
 
         while (blk_off < fs_info->blk_per_clus)
         {
-            error = read_block(bdev, bh, fs_info->block_size, blk + blk_off);
-            if (error) {
+            mb = sfat_mblock_get(sb, blk + blk_off, &error);
+            if (!mb) {
                 goto outloop;
             }
-            data = sfat_blkholder_get_data(bh);
+            data = sfat_mblock_data(mb);
             while (offset < fs_info->block_size)
             {
                 de = (struct sfat_dir_entry *) (data + offset);
                 if (de->attr & SFAT_ATTR_EMPTY_END) {
-                    cpos += sizeof(struct sfat_dir_entry);  // adjust cpos (increase cpos gradually)
+                    sfat_mblock_put(sb, mb);
                     goto outloop;
-                } else if (de->attr & SFAT_ATTR_EMPTY) {
-                    cpos += sizeof(struct sfat_dir_entry);  // adjust cpos
-                    offset += sizeof(struct sfat_dir_entry);
-                    continue;
-                } else {  // certain valid entry
+                } else if (!(de->attr & SFAT_ATTR_EMPTY)) {  // certain valid entry
                     len = str_len(de->name, 11);
                     inode_no = iunique(sb, SFAT_ROOT_INO);  // get a unique inode no.
-                    error = filldir(dirent, de->name, len, cpos, inode_no,
-                        (de->attr & SFAT_ATTR_DIR) ? DT_DIR : DT_REG);
-                    if (error < 0)
+                    if (filldir(dirent, de->name, len, *cpos, inode_no,
+                        (de->attr & SFAT_ATTR_DIR) ? DT_DIR : DT_REG) < 0)
                     {
+                        error = 1;
+                        sfat_mblock_put(sb, mb);
                         goto outloop;
                     }
-                    cpos += sizeof(struct sfat_dir_entry);
-                    offset += sizeof(struct sfat_dir_entry);
                 }
+                *cpos += sizeof(struct sfat_dir_entry);
+                offset += sizeof(struct sfat_dir_entry);
             }
+            sfat_mblock_put(sb, mb);
 
             offset = 0;
             ++blk_off;
@@ -1464,7 +4268,8 @@ int sfat_readdir(struct file *filp, void *dirent, filldir_t filldir) {
         blk_off = 0;
 
         // try to find the next cluster
-        error = sfat_get_entry_content(fs_info, bdev, cls, &cls);
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cls, &cls);
         // read error or abnormal cluster normal
         if (error || cls > fs_info->clusters) {
             break;
@@ -1473,17 +4278,220 @@ int sfat_readdir(struct file *filp, void *dirent, filldir_t filldir) {
         blk = CLS_TO_BLK(fs_info, cls);
     }
 
-outloop:
     // loop in the fat chain
     if (rounds == 0) {
         error = -EINVAL;
     }
-    filp->f_pos = cpos;
 
-    sfat_blkholder_free(bh);
+outloop:
+    return error;
+}
+
+/*
+ * f_pos of a directory which is or may become hashed is
+ * (h << SFAT_HPOS_SEQ_BITS) + k: the k-th name (in the order of the names)
+ * of those whose hash has h as its top SFAT_DIR_HASH_BITS. It doesn't
+ * depend on the buckets, so a readdir goes on where it was after the
+ * directory was rebuilt (sfat_dir_reshape) between two calls. Positions
+ * stay below 2^31 for llseek/telldir.
+ */
+#define SFAT_HPOS_SEQ_BITS  8
+#define SFAT_HPOS_END       (1LL << (SFAT_DIR_HASH_BITS + SFAT_HPOS_SEQ_BITS))
+
+/* one name of a chain in hash order, see sfat_readdir_hashed_chain */
+struct sfat_hpos_item {
+    u32 h;                       /* top SFAT_DIR_HASH_BITS of the hash */
+    u8 attr;
+    u8 name[SFAT_NAME_LEN];
+};
+
+/* where sfat_hpos_collect puts the next name */
+struct sfat_hpos_walk {
+    struct sfat_hpos_item *next;
+    struct sfat_hpos_item *end;
+    u32 from;                    /* names below it are left out */
+};
+
+static int sfat_hpos_collect(struct sfat_dir_entry *de, loff_t pos, void *arg)
+{
+    struct sfat_hpos_walk *w = arg;
+    u32 h = sfat_name_hash(de->name) >> (32 - SFAT_DIR_HASH_BITS);
+
+    if (h < w->from)
+    {
+        return 0;
+    }
+    if (w->next == w->end)
+    {
+        return -EIO;  // more entries than counted
+    }
+    w->next->h = h;
+    w->next->attr = de->attr;
+    memcpy(w->next->name, de->name, SFAT_NAME_LEN);
+    ++w->next;
+    return 0;
+}
+
+static int sfat_hpos_item_cmp(const void *a, const void *b)
+{
+    const struct sfat_hpos_item *x = a;
+    const struct sfat_hpos_item *y = b;
+
+    if (x->h != y->h)
+        return x->h < y->h? -1: 1;
+    return strncmp((const char *)x->name, (const char *)y->name, SFAT_NAME_LEN);
+}
+
+/*
+ * Desc: fill the dirent with the names of one chain from position *pos on,
+ *   in the order of their positions (see SFAT_HPOS_SEQ_BITS). The names
+ *   of the chain are sorted in memory each time.
+ * In:
+ *   start_cls: first cluster of the chain
+ * InOut:
+ *   pos: the position of the next name to be reported
+ * Return:
+ *   0: all the names from *pos on are reported
+ *   1: filldir has no more room
+ *   -EOVERFLOW: too many names with the same top bits of the hash
+ *   < 0: error code
+ */
+static int sfat_readdir_hashed_chain(struct inode *inode, size_t start_cls,
+        loff_t *pos, void *dirent, filldir_t filldir)
+{
+    struct super_block *sb = inode->i_sb;
+    struct sfat_hpos_item *items = NULL;
+    struct sfat_hpos_walk walk;
+    unsigned long n = 0;
+    unsigned long i = 0;
+    unsigned long k = 0;  // of the names with the same h
+    loff_t p = 0;
+    int count = 0;
+    int error = 0;
+
+    count = sfat_count_chain_entries(sb, start_cls);
+    if (count <= 0)
+    {
+        return count;
+    }
+
+    items = vmalloc(count * sizeof(*items));
+    if (!items)
+    {
+        return -ENOMEM;
+    }
+    walk.next = items;
+    walk.end = items + count;
+    walk.from = *pos >> SFAT_HPOS_SEQ_BITS;
+    error = sfat_walk_chain(sb, start_cls, sfat_hpos_collect, &walk);
+    if (error)
+    {
+        goto out;
+    }
+    n = walk.next - items;
+    sort(items, n, sizeof(*items), sfat_hpos_item_cmp, NULL);
+
+    for (i = 0; i < n; ++i)
+    {
+        k = (i && items[i].h == items[i - 1].h)? k + 1: 0;
+        p = ((loff_t)items[i].h << SFAT_HPOS_SEQ_BITS) + k;
+        if (p < *pos)
+        {
+            continue;
+        }
+        if (k >> SFAT_HPOS_SEQ_BITS)  // f_pos can't address it
+        {
+            error = -EOVERFLOW;
+            break;
+        }
+        if (filldir(dirent, items[i].name, str_len(items[i].name, SFAT_NAME_LEN), p,
+                iunique(sb, SFAT_ROOT_INO), (items[i].attr & SFAT_ATTR_DIR)? DT_DIR: DT_REG) < 0)
+        {
+            error = 1;
+            break;
+        }
+        *pos = p + 1;
+    }
+
+out:
+    vfree(items);
     return error;
 }
 
+/*
+ * Desc: fill the dirent as much as possible, may add more than one dir
+ *   A directory which is or may become hashed (a subdirectory on a
+ *   volume with SFAT_FEATURE_HASHDIR) reports its names in hash order,
+ *   bucket by bucket; a bucket holds a range of it (see sfat_dir_bucket).
+ *   Only a linear root, or any directory of a volume without hashed
+ *   directories, reports them in the order of the slots.
+ * Para:
+ *   In:
+ *   dirent: struct kernel uses to contain direntry
+ *   filldir: function kernel provides for others to use to fill the dir entry
+ *
+ *   Return:
+ *       0: O.K.
+ *       < 0: error code
+ */
+static int __sfat_readdir(struct file *filp, void *dirent, filldir_t filldir) {
+    struct inode *inode = filp->f_path.dentry->d_inode;
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    struct sfat_fs_info *fs_info = &(SFAT_SB(inode->i_sb)->fs_info);
+
+    int error = 0;
+    loff_t pos = filp->f_pos;
+    u32 nb = inodei->i_nbuckets;
+    u32 bucket = 0;
+    // --------------------------
+    sfat_dbg(2, "sfat: sfat_readdir\n");
+    sfat_stat_inc(inode->i_sb, SFAT_STAT_READDIR);
+    trace_sfat_readdir(inode, filp->f_pos);
+
+    if (inode->i_size < 32) {
+        return 0; // empty directory
+    }
+
+    if (!inodei->i_buckets && (SFAT_ROOT_INO == inode->i_ino
+                || !(fs_info->features & SFAT_FEATURE_HASHDIR)))
+    {
+        error = sfat_readdir_chain(inode, inodei->i_start, &pos, dirent, filldir);
+        filp->f_pos = pos;
+        return error < 0? error: 0;
+    }
+
+    if (!inodei->i_buckets)
+    {
+        if (pos < SFAT_HPOS_END)
+        {
+            error = sfat_readdir_hashed_chain(inode, inodei->i_start, &pos, dirent, filldir);
+            if (!error)
+            {
+                pos = SFAT_HPOS_END;
+            }
+        }
+        filp->f_pos = pos;
+        return error < 0? error: 0;
+    }
+
+    while (pos < SFAT_HPOS_END)
+    {
+        bucket = sfat_dir_bucket((u32)(pos >> SFAT_HPOS_SEQ_BITS) << (32 - SFAT_DIR_HASH_BITS), nb);
+        error = sfat_readdir_hashed_chain(inode, inodei->i_buckets[bucket],
+                &pos, dirent, filldir);
+        if (error)
+        {
+            break;
+        }
+        // the first h of the next bucket
+        pos = (loff_t)div_u64(((u64)(bucket + 1) << SFAT_DIR_HASH_BITS) + nb - 1, nb)
+            << SFAT_HPOS_SEQ_BITS;
+    }
+
+    filp->f_pos = pos;
+    return error < 0? error: 0;
+}
+
 /*
  * Desc:
  *   Copy data into certain cluster from user space according to the offset in the cluster.
@@ -1496,12 +4504,16 @@ outloop:
  *   no error code is given if copy_from_user failed
  *
  * Return: length of the data actually written (may be less than len)
+ *
+ * A block written in part is read, modified and written under its rmw_lock
+ * (writers of other bytes of it may run at the same time).
  */
 
-size_t sfat_write_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
+size_t sfat_write_cluster(struct super_block *sb,
         const char __user *buf, size_t len,
         size_t cls, size_t offset, int *perror)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     size_t blk = CLS_TO_BLK(fs, cls) + (offset >> fs->block_bits);
     size_t blk_offset = offset & (fs->block_size - 1);
 
@@ -1509,6 +4521,7 @@ size_t sfat_write_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
 
     struct block_holder *bh = NULL;
     char *data = NULL;
+    struct mutex *rmw = NULL;  // held during a read-modify-write
 
     size_t write_len = 0;
 
@@ -1516,7 +4529,7 @@ size_t sfat_write_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
 
     size_t ret_len = 0;
 
-    printk(KERN_INFO "sfat: sfat_write_cluster  len is %u, cls is %u, offset is %u\n", len, cls, offset);
+    sfat_dbg(3, "sfat: sfat_write_cluster  len is %u, cls is %u, offset is %u\n", len, cls, offset);
 
     *perror = 0;
 
@@ -1530,86 +4543,360 @@ size_t sfat_write_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
 
     if (blk_offset)  // offset isn't on the block edge
     {
-        *perror = read_block(bdev, bh, fs->block_size, blk);
-        if (*perror)
+        rmw = sfat_rmw_lock(SFAT_SB(sb), blk);
+        mutex_lock(rmw);
+        *perror = sfat_read_block(sb, bh, blk);
+        if (*perror)
+        {
+            mutex_unlock(rmw);
+            sfat_blkholder_free(bh);
+            return ret_len;
+        }
+
+        write_len = len < blk_space? len: blk_space;
+        copied = copy_from_user(data + blk_offset, buf, write_len);
+        if (copied)
+        {
+            mutex_unlock(rmw);
+            sfat_blkholder_free(bh);
+            return ret_len;  // don't give reason for failure of copy
+        }
+        *perror = sfat_write_block(sb, bh, blk);
+        mutex_unlock(rmw);
+        if (*perror)
+        {
+            sfat_blkholder_free(bh);
+            return ret_len;
+        }
+        buf += write_len;
+        blk++;
+        ret_len += write_len;
+        len -= write_len;
+    }
+
+    while (len >= fs->block_size)
+    {
+        copied = copy_from_user(data, buf, fs->block_size);
+        if (copied)
+        {
+            sfat_blkholder_free(bh);
+            return ret_len;  // don't give reason for failure of copy
+        }
+        *perror = sfat_write_block(sb, bh, blk);
+        if (*perror)
+        {
+            sfat_blkholder_free(bh);
+            return ret_len;
+        }
+        buf += fs->block_size;
+        blk++;
+        ret_len += fs->block_size;
+        len -= fs->block_size;
+    }
+
+    if (len > 0)
+    {
+        rmw = sfat_rmw_lock(SFAT_SB(sb), blk);
+        mutex_lock(rmw);
+        *perror = sfat_read_block(sb, bh, blk);
+        if (*perror)
+        {
+            mutex_unlock(rmw);
+            sfat_blkholder_free(bh);
+            return ret_len;
+        }
+
+        sfat_dbg(3, "sfat: sfat_write_cluster 0080\n");
+        copied = copy_from_user(data, buf, len);
+        if (copied)
+        {
+            sfat_dbg(3, "sfat: sfat_write_cluster 0085\n");
+            mutex_unlock(rmw);
+            sfat_blkholder_free(bh);
+            return ret_len;  // don't give reason for failure of copy
+        }
+        sfat_dbg(3, "sfat: sfat_write_cluster 0090, data[0] is %c, data[1] is %c\n", data[0], data[1]);
+        *perror = sfat_write_block(sb, bh, blk);
+        mutex_unlock(rmw);
+        sfat_dbg(3, "sfat: sfat_write_cluster 0100\n");
+        if (*perror)
+        {
+            sfat_dbg(3, "sfat: sfat_write_cluster 0110\n");
+            sfat_blkholder_free(bh);
+            return ret_len;
+        }
+        ret_len += len;
+    }
+
+    sfat_dbg(3, "sfat: sfat_write_cluster 0220\n");
+    sfat_blkholder_free(bh);
+    return ret_len;
+}
+
+
+/*
+ * Desc: remember the cluster last reached in the chain of a file (see
+ *   sfat_file_seek)
+ */
+static inline void sfat_file_hint(struct inode *inode, size_t idx, size_t cls)
+{
+    spin_lock(&inode->i_lock);
+    SFAT_I(inode)->i_hint_idx = idx;
+    SFAT_I(inode)->i_hint_cls = cls;
+    spin_unlock(&inode->i_lock);
+}
+
+/*
+ * Desc: locate a position in a regular file like sfat_seek, but from the
+ *   cluster last reached (i_hint_xxx) when it isn't behind the position,
+ *   so sequential reads and writes don't walk the chain from its start
+ *   every time. The chain of a file only grows while the inode lives, so
+ *   the hint stays valid. Called with i_chain_sem held.
+ * In:
+ *   pos: position in the file, within its clusters
+ * Out:
+ *   cls, offset: the cluster and the offset in it
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_file_seek(struct inode *inode, loff_t pos, size_t *cls, size_t *offset)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(inode->i_sb)->fs_info);
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    size_t idx = pos >> fs->cluster_bits;
+    size_t start_idx = 0;
+    size_t start_cls = inodei->i_start;
+    int error = 0;
+
+    spin_lock(&inode->i_lock);
+    if (SFAT_CLS_NONE != inodei->i_hint_cls && inodei->i_hint_idx <= idx)
+    {
+        start_idx = inodei->i_hint_idx;
+        start_cls = inodei->i_hint_cls;
+    }
+    spin_unlock(&inode->i_lock);
+
+    error = sfat_seek(inode->i_sb, start_cls,
+            pos - ((loff_t)start_idx << fs->cluster_bits), cls, offset);
+    if (!error)
+    {
+        sfat_file_hint(inode, idx, *cls);
+    }
+    return error;
+}
+
+/*
+ * Desc: write zeros to n blocks from blk on, by multi-block writes of one
+ *   zeroed block (neither read nor cached)
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_zero_blocks(struct super_block *sb, size_t blk, size_t n)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    struct block_holder *bhs[SFAT_WB_MAX_RUN];
+    struct block_holder *bh = NULL;
+    size_t len = 0;
+    size_t i = 0;
+    int error = 0;
+
+    bh = sfat_blkholder_alloc();
+    if (!bh)
+    {
+        return -ENOMEM;
+    }
+    memset(sfat_blkholder_get_data(bh), 0, fs->block_size);
+    for (i = 0; i < SFAT_WB_MAX_RUN; ++i)
+    {
+        bhs[i] = bh;
+    }
+
+    while (n > 0 && !error)
+    {
+        len = min_t(size_t, n, SFAT_WB_MAX_RUN);
+        error = sfat_write_blocks(sb, bhs, len, blk);
+        blk += len;
+        n -= len;
+    }
+
+    sfat_blkholder_free(bh);
+    return error;
+}
+
+/*
+ * Desc: zero the bytes of a cluster from offset to its end (a block
+ *   partly kept is read, modified and written)
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_zero_cluster_tail(struct super_block *sb, size_t cls, size_t offset)
+{
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    size_t blk = CLS_TO_BLK(fs, cls) + (offset >> fs->block_bits);
+    size_t blk_offset = offset & (fs->block_size - 1);
+    struct block_holder *bh = NULL;
+    int error = 0;
+
+    if (blk_offset)
+    {
+        bh = sfat_blkholder_alloc();
+        if (!bh)
         {
-            sfat_blkholder_free(bh);
-            return ret_len;
+            return -ENOMEM;
         }
-
-        write_len = len < blk_space? len: blk_space;
-        copied = copy_from_user(data + blk_offset, buf, write_len);
-        if (copied)
+        error = sfat_read_block(sb, bh, blk);
+        if (!error)
         {
-            sfat_blkholder_free(bh);
-            return ret_len;  // don't give reason for failure of copy
+            memset(sfat_blkholder_get_data(bh) + blk_offset, 0,
+                    fs->block_size - blk_offset);
+            error = sfat_write_block(sb, bh, blk);
         }
-        *perror = write_block(bdev, bh, fs->block_size, blk);
-        if (*perror)
+        sfat_blkholder_free(bh);
+        if (error)
         {
-            sfat_blkholder_free(bh);
-            return ret_len;
+            return error;
         }
-        buf += write_len;
-        blk++;
-        ret_len += write_len;
-        len -= write_len;
+        ++blk;
     }
 
-    while (len >= fs->block_size)
+    return sfat_zero_blocks(sb, blk, CLS_TO_BLK(fs, cls) + fs->blk_per_clus - blk);
+}
+
+/*
+ * Desc: make a regular file ready for a write of [pos, end) which goes
+ *   beyond its clusters or leaves a gap after its end. Clusters are linked
+ *   to the chain until end is covered, one journal operation per cluster
+ *   (clusters linked by a failed write before are used again). A gap is
+ *   filled with zeros: the rest of the last cluster and the new clusters
+ *   below pos, runs of them by multi-block writes. Then i_size is pos.
+ *   Called with i_chain_sem held for write.
+ * Out:
+ *   alloc_end: bytes of the file covered by clusters afterwards
+ * Return:
+ *   0: success
+ *   < 0: error code (-ENOSPC: the volume is full before end is reached,
+ *        see alloc_end)
+ */
+static int sfat_file_reserve(struct inode *inode, loff_t pos, loff_t end, loff_t *alloc_end)
+{
+    struct super_block *sb = inode->i_sb;
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
+    struct sfat_inode_info *inodei = SFAT_I(inode);
+    loff_t fsize = inode->i_size;
+    size_t nr_cls = (fsize + fs->cluster_size - 1) >> fs->cluster_bits;  // clusters with data
+    size_t need = (end + fs->cluster_size - 1) >> fs->cluster_bits;
+    size_t idx = nr_cls;
+    size_t tail = SFAT_CLS_NONE;  // last cluster of the chain so far
+    size_t next = 0;
+    size_t offset = 0;
+    size_t run_blk = 0;  // clusters to be zeroed, following each other
+    size_t run_len = 0;  // in blocks
+    int error = 0;
+
+    if (nr_cls)
     {
-        copied = copy_from_user(data, buf, fs->block_size);
-        if (copied)
+        error = sfat_file_seek(inode, fsize - 1, &tail, &offset);
+        if (error)
         {
-            sfat_blkholder_free(bh);
-            return ret_len;  // don't give reason for failure of copy
+            goto out;
         }
-        *perror = write_block(bdev, bh, fs->block_size, blk);
-        if (*perror)
+        // the bytes after the end were never written or are stale
+        if (pos > fsize && (fsize & (fs->cluster_size - 1)))
         {
-            sfat_blkholder_free(bh);
-            return ret_len;
+            error = sfat_zero_cluster_tail(sb, tail, offset + 1);
+            if (error)
+            {
+                goto out;
+            }
         }
-        buf += fs->block_size;
-        blk++;
-        ret_len += fs->block_size;
-        len -= fs->block_size;
     }
 
-    if (len > 0)
+    for (; idx < need; ++idx)
     {
-        *perror = read_block(bdev, bh, fs->block_size, blk);
-        if (*perror)
+        if (SFAT_CLS_NONE == tail)
         {
-            sfat_blkholder_free(bh);
-            return ret_len;
+            next = inodei->i_start < fs->clusters? inodei->i_start: SFAT_CLS_NONE;
+        }
+        else
+        {
+            error = sfat_get_entry_content(sb, tail, &next);
+            if (error)
+            {
+                break;
+            }
+            next = next < fs->clusters? next: SFAT_CLS_NONE;
         }
 
-        printk(KERN_INFO "sfat: sfat_write_cluster 0080\n");
-        copied = copy_from_user(data, buf, len);
-        if (copied)
+        if (SFAT_CLS_NONE == next)
         {
-            printk(KERN_INFO "sfat: sfat_write_cluster 0085\n");
-            sfat_blkholder_free(bh);
-            return ret_len;  // don't give reason for failure of copy
+            // claiming the cluster and linking it is one journal operation
+            sfat_journal_start(sb);
+            error = sfat_fat_entry_acquire(sb,
+                    SFAT_CLS_NONE == tail? SFAT_CLS_NONE: tail + 1, &next);
+            if (!error)
+            {
+                if (SFAT_CLS_NONE == tail)
+                {
+                    inodei->i_start = next;
+                }
+                else
+                {
+                    error = sfat_fat_entry_modify(sb, tail, cpu_to_le32(next));
+                }
+            }
+            sfat_journal_stop(sb);
+            if (error)
+            {
+                break;
+            }
         }
-        printk(KERN_INFO "sfat: sfat_write_cluster 0090, data[0] is %c, data[1] is %c\n", data[0], data[1]);
-        *perror = write_block(bdev, bh, fs->block_size, blk);
-        printk(KERN_INFO "sfat: sfat_write_cluster 0100\n");
-        if (*perror)
+        tail = next;
+
+        if ((loff_t)idx << fs->cluster_bits < pos)  // (partly) in the gap
         {
-            printk(KERN_INFO "sfat: sfat_write_cluster 0110\n");
-            sfat_blkholder_free(bh);
-            return ret_len;
+            if (run_len && CLS_TO_BLK(fs, next) != run_blk + run_len)
+            {
+                error = sfat_zero_blocks(sb, run_blk, run_len);
+                run_len = 0;
+                if (error)
+                {
+                    ++idx;
+                    break;
+                }
+            }
+            if (!run_len)
+            {
+                run_blk = CLS_TO_BLK(fs, next);
+            }
+            run_len += fs->blk_per_clus;
         }
-        ret_len += len;
+    }
+    if (run_len)
+    {
+        int err = sfat_zero_blocks(sb, run_blk, run_len);
+        error = error? error: err;
     }
 
-    printk(KERN_INFO "sfat: sfat_write_cluster 0220\n");
-    sfat_blkholder_free(bh);
-    return ret_len;
-}
+    if (idx > nr_cls)
+    {
+        sfat_file_hint(inode, idx - 1, tail);
+    }
 
+out:
+    *alloc_end = (loff_t)idx << fs->cluster_bits;
+    if (error && -ENOSPC != error)
+    {
+        *alloc_end = fsize;  // don't trust the zeros
+    }
+    if (pos > fsize && *alloc_end >= pos)
+    {
+        i_size_write(inode, pos);
+    }
+    return error;
+}
 
 /*
  * Desc:
@@ -1625,23 +4912,31 @@ size_t sfat_write_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
  * Return:
  *   >=0: no. of bytes written
  *
+ * A write within the clusters of the file runs under i_chain_sem for
+ * read, so writers of one file (pwrite at different offsets) don't wait
+ * for each other. Only a write which needs clusters or leaves a gap after
+ * the end takes it for write while sfat_file_reserve extends the file.
  */
-ssize_t sfat_sync_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+static ssize_t __sfat_sync_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
 {
     struct inode *inode = filp->f_path.dentry->d_inode;
     struct super_block *sb = inode->i_sb;
-    struct block_device *bdev = sb->s_bdev;
     struct sfat_sb_info *sbi = SFAT_SB(sb);
     struct sfat_inode_info *inodei = SFAT_I(inode);
     struct sfat_fs_info *fs_info = &sbi->fs_info;
 
-    size_t fsize = inode->i_size; // type changing from loff_t to size_t
-                                 // since the size in dir entry has only 32-bit
+    loff_t fsize = 0;
+    loff_t end = 0;
+    loff_t alloc_end = 0;
 
-    size_t cur_cls = inodei->i_start;
-    size_t new_cls = 0;
+    size_t cur_cls = 0;
+    size_t next_cls = 0;
+    size_t idx = 0;
     size_t offset = 0;
 
+    loff_t start_pos = *ppos;
+    size_t start_len = len;
+
     size_t write_space = 0;
     size_t write_len = 0;
     size_t ret_len = 0;
@@ -1651,166 +4946,119 @@ ssize_t sfat_sync_write(struct file *filp, const char __user *buf, size_t len, l
 
     int error = 0;
     // --------------------------
-    printk(KERN_INFO "sfat: sfat_sync_write, file size is %u\n", fsize);
-    printk(KERN_INFO "sfat: sfat_sync_write  *ppos is %lld, len is %u\n", *ppos, len);
+    sfat_dbg(2, "sfat: sfat_sync_write  *ppos is %lld, len is %u\n", *ppos, len);
 
-
-    if (*ppos > fsize || len == 0)  // don't allow null write
+    if (len == 0)  // don't allow null write
+    {
+        return -EINVAL;
+    }
+    if (*ppos >= sb->s_maxbytes)
     {
-        return -EINVAL;  // todo Currently no gap is allowed.
+        return -EFBIG;
     }
+    if (len > sb->s_maxbytes - *ppos)
+    {
+        len = sb->s_maxbytes - *ppos;
+    }
+    end = *ppos + len;
 
-    // file size is not multiple of block size
-    // or
-    // offset is not at the end
-    if ((fsize & (fs_info->block_size - 1)) || (*ppos < fsize))
+    down_read(&inodei->i_chain_sem);
+    fsize = i_size_read(inode);
+    if (*ppos > fsize
+        || end > ((fsize + fs_info->cluster_size - 1) & ~((loff_t)fs_info->cluster_size - 1)))
     {
-        error = sfat_seek(fs_info, bdev, cur_cls, *ppos, &cur_cls, &offset);
-        if (error)
+        up_read(&inodei->i_chain_sem);
+        down_write(&inodei->i_chain_sem);
+        fsize = inode->i_size;  // may have moved meanwhile
+        alloc_end = (fsize + fs_info->cluster_size - 1) & ~((loff_t)fs_info->cluster_size - 1);
+        if (*ppos > fsize || end > alloc_end)
         {
-            return error;
+            error = sfat_file_reserve(inode, *ppos, end, &alloc_end);
         }
-        write_space = fs_info->cluster_size - offset;
-        write_len = len > write_space? write_space: len;
-        ret_len = sfat_write_cluster(fs_info, bdev, buf, write_len,
-                cur_cls, offset, &error);
-        *ppos += ret_len;
-        len -= ret_len;
-        buf += ret_len;
-        accu_len += ret_len;
-        if (ret_len < write_len)
+        downgrade_write(&inodei->i_chain_sem);
+        if (alloc_end <= *ppos || *ppos > i_size_read(inode))
         {
-            goto end;
+            up_read(&inodei->i_chain_sem);
+            return error? error: -EIO;
         }
-
-        while (len > 0)
+        if (end > alloc_end)
         {
-            error = sfat_get_entry_content(fs_info, bdev, cur_cls, &cur_cls);
-            if (error)
-            {
-                goto end;
-            }
-            if (cur_cls < SFAT_ENTRY_MAX)
-            {
-                write_space = fs_info->cluster_size;
-                write_len = len > write_space? write_space: len;
-                ret_len = sfat_write_cluster(fs_info, bdev, buf, write_len,
-                        cur_cls, 0, &error);
-                *ppos += ret_len;
-                len -= ret_len;
-                buf += ret_len;
-                accu_len += ret_len;
-                if (ret_len < write_len)
-                {
-                    goto end;
-                }
-            }
-            else
-            {
-                break;  // no more cluster in the chain
-            }
+            len = alloc_end - *ppos;  // short write, the volume is full
         }
+        error = 0;
     }
-    else // file size is multiple of block size and offset is at the end
-    {
-        if (fsize > 0)
-        {
-            // seek to the last cluster
-            error = sfat_seek(fs_info, bdev, cur_cls, *ppos - 1, &cur_cls, &offset);
-            if (error)
-            {
-                goto end;
-            }
-        }
-        else  // fsize = 0;
-        {
-            printk(KERN_INFO "sfat: sfat_sync_write  0030\n");
-            error = sfat_fat_entry_acquire(fs_info, bdev, &new_cls); // allocate one cluster to the file
-            if (error)
-            {
-                printk(KERN_INFO "sfat: sfat_sync_write  0040\n");
-                goto end;
-            }
-            else
-            {
-                cur_cls = new_cls;
-                write_space = fs_info->cluster_size;
-                write_len = len > write_space? write_space: len;
-                ret_len = sfat_write_cluster(fs_info, bdev, buf, write_len,
-                        cur_cls, 0, &error);
-                *ppos += ret_len;
-                len -= ret_len;
-                buf += ret_len;
-                accu_len += ret_len;
-                if (ret_len < write_len)
-                {
-                    if (ret_len > 0)
-                    {
-                        printk(KERN_INFO "sfat: sfat_sync_write  0061\n");
-                        inodei->i_start = cur_cls;
-                    }
-                    else
-                    {
-                        printk(KERN_INFO "sfat: sfat_sync_write  0063\n");
-                        // todo I didn't return the newly created cluster back
-                    }
-                    goto end;
-                }
-                else
-                {
-                    printk(KERN_INFO "sfat: sfat_sync_write  0066\n");
-                    inodei->i_start = cur_cls;
-                }
-
-            }
+    sfat_dbg(2, "sfat: sfat_sync_write, file size is %lld\n", i_size_read(inode));
 
-        }
+    error = sfat_file_seek(inode, *ppos, &cur_cls, &offset);
+    if (error)
+    {
+        goto end;
     }
+    idx = *ppos >> fs_info->cluster_bits;
 
-    while (len > 0)  // add new cluster
+    while (len > 0)
     {
-        error = sfat_fat_entry_acquire(fs_info, bdev, &new_cls);
-        if (error)
+        write_space = fs_info->cluster_size - offset;
+        write_len = len > write_space? write_space: len;
+        ret_len = sfat_write_cluster(sb, buf, write_len,
+                cur_cls, offset, &error);
+        *ppos += ret_len;
+        len -= ret_len;
+        buf += ret_len;
+        accu_len += ret_len;
+        if (ret_len < write_len || 0 == len)
         {
-            goto end;
+            break;
         }
 
-        error = sfat_fat_entry_modify(fs_info, bdev, cur_cls, cpu_to_le32(new_cls));
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cur_cls, &next_cls);
         if (error)
         {
-            goto end;
+            break;
         }
-        cur_cls = new_cls;
-
-        write_space = fs_info->cluster_size;
-        write_len = len > write_space? write_space: len;
-        ret_len = sfat_write_cluster(fs_info, bdev, buf, write_len,
-                cur_cls, 0, &error);
-        *ppos += ret_len;
-        len -= ret_len;
-        buf += ret_len;
-        accu_len += ret_len;
-        if (ret_len < write_len)
+        if (next_cls >= fs_info->clusters)  // the chain is shorter than i_size
         {
-            goto end;
+            error = -EIO;
+            break;
         }
+        cur_cls = next_cls;
+        ++idx;
+        offset = 0;
     }
+    sfat_file_hint(inode, idx, cur_cls);
 
 end:
-    fsize = fsize < *ppos? *ppos: fsize;
-    printk(KERN_INFO "sfat: sfat_sync_write  file size is %u\n", fsize);
-    inode->i_size = fsize;
+    trace_sfat_write(inode, start_pos, start_len, accu_len);
 
     ts = CURRENT_TIME_SEC;
+    spin_lock(&inode->i_lock);
+    if (*ppos > inode->i_size)
+    {
+        i_size_write(inode, *ppos);
+    }
+    sfat_dbg(2, "sfat: sfat_sync_write  file size is %lld\n", inode->i_size);
     inode->i_mtime.tv_sec = ts.tv_sec;  // time for modification
     inode->i_atime.tv_sec = ts.tv_sec;  // time for access
 
     // no. of blocks consumed by the file
     inode->i_blocks = ((inode->i_size + (fs_info->cluster_size - 1))
                & ~((loff_t)fs_info->cluster_size - 1)) >> fs_info->block_bits;
+    spin_unlock(&inode->i_lock);
+    up_read(&inodei->i_chain_sem);
 
-    error = sfat_inode_write_to_hd(fs_info, bdev, inode);
-    // don't care about the error
+    // the directory entry is written back later by sfat_write_inode
+    // (which takes i_chain_sem, so it can't be held here)
+    mark_inode_dirty(inode);
+    if ((filp->f_flags & O_SYNC) || IS_SYNC(inode))
+    {
+        sfat_fsync_inode(inode, 0);
+        // don't care about the error
+    }
+    if (!accu_len)
+    {
+        return error? error: -EFAULT;  // copy_from_user failed
+    }
     return accu_len;
 
 }
@@ -1830,10 +5078,11 @@ end:
  * Return: length of the data actually copied (may be less than len)
  */
 
-size_t sfat_read_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
+size_t sfat_read_cluster(struct super_block *sb,
         char __user *buf, size_t len,
         size_t cls, size_t offset, int *perror)
 {
+    struct sfat_fs_info *fs = &(SFAT_SB(sb)->fs_info);
     size_t blk = CLS_TO_BLK(fs, cls) + (offset >> fs->block_bits);
     size_t blk_offset = offset & (fs->block_size - 1);
     size_t blk_space = fs->block_size - blk_offset;
@@ -1847,11 +5096,11 @@ size_t sfat_read_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
 
     size_t ret_len = 0;
 
-    printk(KERN_INFO "sfat: sfat_read_cluster, len is %u, cls is %u, offset %u\n", len, cls, offset);
+    sfat_dbg(3, "sfat: sfat_read_cluster, len is %u, cls is %u, offset %u\n", len, cls, offset);
     *perror = 0;
 
     /* ***************************** */
-    printk(KERN_INFO "sfat: sfat_read_cluster  test 0010\n");
+    sfat_dbg(3, "sfat: sfat_read_cluster  test 0010\n");
     /* ***************************** */
 
 
@@ -1864,8 +5113,8 @@ size_t sfat_read_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
 
     while (len > 0)  // offset isn't on the block edge
     {
-        printk(KERN_INFO "sfat: sfat_read_cluster 0030, len is %u\n", len);
-        *perror = read_block(bdev, bh, fs->block_size, blk);
+        sfat_dbg(3, "sfat: sfat_read_cluster 0030, len is %u\n", len);
+        *perror = sfat_read_block(sb, bh, blk);
         data = sfat_blkholder_get_data(bh);
         if (*perror)
         {
@@ -1873,11 +5122,11 @@ size_t sfat_read_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
             return ret_len;
         }
 
-        printk(KERN_INFO "sfat: sfat_read_cluster 0040\n");
+        sfat_dbg(3, "sfat: sfat_read_cluster 0040\n");
         read_len = len < blk_space? len: blk_space;
         copied = copy_to_user(buf, data + blk_offset, read_len);
 
-        printk(KERN_INFO "sfat: sfat_read_cluster 0040, data[0] is %c, data[1] is %c\n", data[blk_offset], data[blk_offset + 1]);
+        sfat_dbg(3, "sfat: sfat_read_cluster 0040, data[0] is %c, data[1] is %c\n", data[blk_offset], data[blk_offset + 1]);
 
         if (copied)  // Something is left uncopied.
         {
@@ -1886,7 +5135,7 @@ size_t sfat_read_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
             return ret_len;  // don't give reason for failure of copy
         }
 
-        printk(KERN_INFO "sfat: sfat_read_cluster 0070\n");
+        sfat_dbg(3, "sfat: sfat_read_cluster 0070\n");
         buf += read_len;
         blk++;
         ret_len += read_len;
@@ -1895,12 +5144,47 @@ size_t sfat_read_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
         blk_space = fs->block_size;
     }
 
-    printk(KERN_INFO "sfat: sfat_read_cluster 0100\n");
+    sfat_dbg(3, "sfat: sfat_read_cluster 0100\n");
     sfat_blkholder_free(bh);
     return ret_len;
 }
 
 
+/*
+ * Desc: update atime after a read according to the atime option
+ *   (relatime unless noatime is given). The inode is only marked dirty,
+ *   so reads never write the directory entry themselves.
+ */
+static void sfat_file_accessed(struct file *filp)
+{
+    struct inode *inode = filp->f_path.dentry->d_inode;
+    struct sfat_sb_info *sbi = SFAT_SB(inode->i_sb);
+    struct timespec now;
+
+    if (IS_NOATIME(inode) || (filp->f_path.mnt->mnt_flags & MNT_NOATIME)
+        || SFAT_ATIME_NOATIME == sbi->options.atime)
+    {
+        return;
+    }
+
+    now = CURRENT_TIME_SEC;
+    if (inode->i_atime.tv_sec == now.tv_sec)
+    {
+        return;
+    }
+
+    // relatime: atime is newer than mtime and ctime and less than a day old
+    if (inode->i_atime.tv_sec >= inode->i_mtime.tv_sec
+        && inode->i_atime.tv_sec >= inode->i_ctime.tv_sec
+        && now.tv_sec - inode->i_atime.tv_sec < 24 * 60 * 60)
+    {
+        return;
+    }
+
+    inode->i_atime = now;
+    mark_inode_dirty_sync(inode);
+}
+
 /*
  * Desc:
  *   Read content to user space (buf) from the volume
@@ -1913,81 +5197,178 @@ size_t sfat_read_cluster(struct sfat_fs_info *fs, struct block_device *bdev,
  *   ppos: offset in the current file
  *
  * Return:
- *   >=0: no. of bytes written
+ *   >=0: no. of bytes read, 0 at the end of the file
+ *   < 0: error code, if nothing could be read (-EIO for a chain shorter
+ *        than the size)
  *
  */
-ssize_t sfat_sync_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+static ssize_t __sfat_sync_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
 {
 
     struct inode *inode = filp->f_path.dentry->d_inode;
     struct super_block *sb = inode->i_sb;
-    struct block_device *bdev = sb->s_bdev;
     struct sfat_sb_info *sbi = SFAT_SB(sb);
     struct sfat_inode_info *inodei = SFAT_I(inode);
     struct sfat_fs_info *fs_info = &sbi->fs_info;
 
-    size_t fsize = inode->i_size; // type changing from loff_t to size_t
-                                 // since the size in dir entry has only 32-bit
+    loff_t fsize = 0;
 
-    size_t cur_cls = inodei->i_start;
-    size_t new_cls = 0;
+    size_t cur_cls = 0;
+    size_t next_cls = 0;
+    size_t idx = 0;
     size_t offset = 0;
 
     size_t read_space = 0;
     size_t read_len = 0;
+    size_t ret_len = 0;
     size_t accu_len = 0;
 
-    struct timespec ts;
-
+    
     int error = 0;
     // --------------------------
-    printk(KERN_INFO "sfat: sfat_sync_read, file size is %u, len is %u, *ppos is %llu\n", fsize, len, *ppos);
+    down_read(&inodei->i_chain_sem);
+    fsize = i_size_read(inode);  // writers of the clusters may move it up
+
+    sfat_dbg(2, "sfat: sfat_sync_read, file size is %lld, len is %u, *ppos is %llu\n", fsize, len, *ppos);
 
     if (*ppos >= fsize)
     {
-        return 0;
+        goto out;
     }
-    if (*ppos + len > fsize)
+    if (len > fsize - *ppos)
     {
         len = fsize - *ppos;
     }
 
-    if (*ppos >= fs_info->cluster_size)  // todo just read the first cluster
+    if (0 == len)
     {
-        return 0;
+        goto out;
     }
 
-    if (*ppos + len > fs_info->cluster_size)  // todo just read the first cluster
+    if (inodei->i_start >= fs_info->clusters)
     {
-        len = fs_info->cluster_size - *ppos;
+        sfat_dbg(3, "sfat: sfat_sync_read, 00050\n");
+        error = -EIO;  // a size but no clusters
+        goto out;
     }
 
-    if (0 == len)
+    error = sfat_file_seek(inode, *ppos, &cur_cls, &offset);
+    if (error)
     {
-        return 0;
+        goto out;
     }
+    idx = *ppos >> fs_info->cluster_bits;
 
-    if (cur_cls > SFAT_ENTRY_MAX)
+    while (len > 0)
     {
-        printk(KERN_INFO "sfat: sfat_sync_read, 00050\n");
-        return 0;
+        read_space = fs_info->cluster_size - offset;
+        read_len = len > read_space? read_space: len;
+        ret_len = sfat_read_cluster(sb, buf, read_len, cur_cls, offset, &error);
+        *ppos += ret_len;
+        len -= ret_len;
+        buf += ret_len;
+        accu_len += ret_len;
+        if (ret_len < read_len)
+        {
+            if (!error)
+            {
+                error = -EFAULT;  // copy_to_user failed
+            }
+            break;
+        }
+        if (0 == len)
+        {
+            break;
+        }
+
+        sfat_stat_inc(sb, SFAT_STAT_CHAIN_HOP);
+        error = sfat_get_entry_content(sb, cur_cls, &next_cls);
+        if (error)
+        {
+            break;
+        }
+        if (next_cls >= fs_info->clusters)  // chain shorter than the size
+        {
+            error = -EIO;
+            break;
+        }
+        cur_cls = next_cls;
+        ++idx;
+        offset = 0;
     }
+    sfat_file_hint(inode, idx, cur_cls);
 
-    accu_len = sfat_read_cluster(fs_info, bdev, buf, len, cur_cls, *ppos, &error);
-    *ppos += accu_len;
+out:
+    up_read(&inodei->i_chain_sem);
+    if (!accu_len)
+    {
+        return error;  // 0 at the end of the file
+    }
+    sfat_file_accessed(filp);
+    return accu_len;
 
+}
 
-    ts = CURRENT_TIME_SEC;
-    inode->i_atime.tv_sec = ts.tv_sec;  // time for access
 
-    error = sfat_inode_write_to_hd(fs_info, bdev, inode);
-    // don't care about the error
+/* ********** ********** ************* */
+/*
+ * VFS entry points, timed into the latency histograms of the volume
+ * (see stats.h). The work is done by the __sfat_xxx functions above.
+ */
+
+int sfat_create_file(struct inode *dir, struct dentry *dentry, int mode,
+            struct nameidata *nd)
+{
+    u64 start = sfat_lat_start();
+    int ret = __sfat_create_file(dir, dentry, mode, nd);
+
+    sfat_lat_end(dir->i_sb, SFAT_LAT_CREATE, start);
+    return ret;
+}
 
-    return accu_len;  // todo
+struct dentry * sfat_lookup(struct inode *dir,struct dentry *dentry, struct nameidata *data)
+{
+    u64 start = sfat_lat_start();
+    struct dentry *ret = __sfat_lookup(dir, dentry, data);
 
+    sfat_lat_end(dir->i_sb, SFAT_LAT_LOOKUP, start);
+    return ret;
 }
 
+int sfat_readdir(struct file *filp, void *dirent, filldir_t filldir)
+{
+    struct super_block *sb = filp->f_path.dentry->d_inode->i_sb;
+    u64 start = sfat_lat_start();
+    int ret = __sfat_readdir(filp, dirent, filldir);
+
+    sfat_lat_end(sb, SFAT_LAT_READDIR, start);
+    return ret;
+}
 
+ssize_t sfat_sync_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+{
+    struct super_block *sb = filp->f_path.dentry->d_inode->i_sb;
+    u64 start = sfat_lat_start();
+    ssize_t ret = __sfat_sync_write(filp, buf, len, ppos);
 
+    sfat_lat_end(sb, SFAT_LAT_WRITE, start);
+    if (ret > 0)
+    {
+        sfat_stat_add(sb, SFAT_STAT_WRITE_BYTES, ret);
+    }
+    return ret;
+}
 
+ssize_t sfat_sync_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+{
+    struct super_block *sb = filp->f_path.dentry->d_inode->i_sb;
+    u64 start = sfat_lat_start();
+    ssize_t ret = __sfat_sync_read(filp, buf, len, ppos);
 
+    sfat_lat_end(sb, SFAT_LAT_READ, start);
+    if (ret > 0)
+    {
+        sfat_stat_add(sb, SFAT_STAT_READ_BYTES, ret);
+    }
+    return ret;
+}
@@ -15,6 +15,24 @@ struct sfat_inode_info {
 
     loff_t i_pos;       /* position of directory entry
                         (in the volume) or 0 */  // in Byte
+
+    struct rw_semaphore i_chain_sem;  /* i_start, the chain and i_size,
+                                         see "Locking" in sfat.h */
+
+    struct hlist_node i_sfat_hash;  /* hash by i_pos, walked under RCU */
+    struct rcu_head i_rcu;          /* frees it after sfat_iget is done */
+    int i_dirty;            /* directory entry needs to be written back */
+
+    u32 *i_buckets;         /* first cluster of each bucket of a hashed
+                               directory (SFAT_ATTR_HASHED) or NULL,
+                               changes under i_mutex (sfat_dir_reshape) */
+    unsigned int i_nbuckets;  /* no. of entries in i_buckets */
+    int i_reshape;          /* the directory is to be rebuilt once the
+                               operation growing it is over */
+
+    size_t i_hint_idx;      /* index (in the file) and no. of the cluster */
+    size_t i_hint_cls;      /* last reached in the chain, or SFAT_CLS_NONE;
+                               under i_lock of the inode */
     struct inode vfs_inode;  /* The real inode for VFS */
 };
 
@@ -27,8 +45,16 @@ void sfat_delete_inode(struct inode *sb);
 
 void sfat_clear_inode(struct inode *sb);
 
+int sfat_write_inode(struct inode *inode, int wait);
+
+void sfat_dirty_inode(struct inode *inode);
+
+int sfat_fsync_inode(struct inode *inode, int datasync);
+
 int sfat_read_root(struct inode *inode);
 
+extern const struct dentry_operations sfat_dentry_operations;
+
 // ===============================
 
 int sfat_create(struct inode *dir, struct dentry *dentry, int mode,
@@ -55,6 +81,12 @@ int nextCluster(struct sfat_fs_info *fs, struct block_device *bdev, size_t cls,
 
 int sfat_count_subdirs(struct inode *inode);
 
+int sfat_count_child_dirs(struct inode *inode);
+
+int sfat_dir_load_index(struct inode *dir);
+
+int sfat_count_free_clusters(struct super_block *sb);
+
 #endif
 
 
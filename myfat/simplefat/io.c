@@ -16,6 +16,12 @@
 #include <linux/blkdev.h>
 #include <linux/fsnotify.h>
 #include <linux/security.h>
+#include <linux/bio.h>
+#include <linux/completion.h>
+
+#include "sfat.h"
+#include "stats.h"
+#include "sfat_trace.h"
 
 
 struct block_holder
@@ -220,7 +226,9 @@ int write_block(struct block_device *bdev, struct block_holder *blk_holder,
     clear_buffer_uptodate(bh);  // clear the bit for future test of whether the read succeeds
 
     bh->b_end_io = end_buffer_write_sync;
-    submit_bh(WRITE_BARRIER, bh);
+    // no barrier, the data may stay in the cache of the device until
+    // blkdev_issue_flush() is called by fsync/sync_fs
+    submit_bh(WRITE, bh);
     wait_on_buffer(bh);
 
     // unlock_page(page);
@@ -236,6 +244,152 @@ int write_block(struct block_device *bdev, struct block_holder *blk_holder,
 
 }
 
+/*
+ * Desc: read_block for a block of the mounted volume, counted in the
+ *   statistics of the volume
+ * return: 0 => success
+ *         -EIO
+ */
+int sfat_read_block(struct super_block *sb, struct block_holder *blk_holder, size_t blk_no)
+{
+    u64 start = 0;
+    int ret = 0;
+
+    sfat_stat_inc(sb, SFAT_STAT_BLK_READ);
+    sfat_heat_account(sb, blk_no, 0);
+    trace_sfat_block_io(sb, READ, blk_no);
+
+    // read_block waits for the completion, so this is submit-to-complete
+    start = sfat_lat_start();
+    ret = read_block(sb->s_bdev, blk_holder, SFAT_SB(sb)->fs_info.block_size, blk_no);
+    sfat_lat_end(sb, SFAT_LAT_BLK_READ, start);
+    return ret;
+}
+
+/*
+ * Desc: write_block for a block of the mounted volume, counted in the
+ *   statistics of the volume
+ * return: 0 => success
+ *         -EIO
+ */
+int sfat_write_block(struct super_block *sb, struct block_holder *blk_holder, size_t blk_no)
+{
+    u64 start = 0;
+    int ret = 0;
+
+    sfat_stat_inc(sb, SFAT_STAT_BLK_WRITE);
+    sfat_heat_account(sb, blk_no, 1);
+    trace_sfat_block_io(sb, WRITE, blk_no);
 
+    start = sfat_lat_start();
+    ret = write_block(sb->s_bdev, blk_holder, SFAT_SB(sb)->fs_info.block_size, blk_no);
+    sfat_lat_end(sb, SFAT_LAT_BLK_WRITE, start);
+    return ret;
+}
 
+struct sfat_bio_wait
+{
+    struct completion done;
+    int error;
+};
 
+static void sfat_end_bio(struct bio *bio, int error)
+{
+    struct sfat_bio_wait *wait = bio->bi_private;
+
+    if (error || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+    {
+        wait->error = -EIO;
+    }
+    complete(&wait->done);
+}
+
+/*
+ * Desc: read or write n blocks which follow each other on the volume,
+ *   starting at blk_no, by as few bios as the device takes (normally one)
+ *   and wait for them. Counted in the statistics like sfat_read_block and
+ *   sfat_write_block, the latency is the one of a whole bio.
+ * In:
+ *   rw: READ or WRITE
+ *   bhs: the blocks in the order of their block no.
+ * Return:
+ *   0: success
+ *   -EIO: (some of) the blocks may not be transferred
+ */
+static int sfat_rw_blocks(struct super_block *sb, int rw, struct block_holder **bhs,
+        size_t n, size_t blk_no)
+{
+    struct sfat_fs_info *fs = &SFAT_SB(sb)->fs_info;
+    struct sfat_bio_wait wait;
+    struct bio *bio = NULL;
+    size_t done = 0;
+    size_t i = 0;
+    u64 start = 0;
+    int error = 0;
+
+    while (done < n)
+    {
+        bio = bio_alloc(GFP_NOFS, min_t(size_t, n - done, BIO_MAX_PAGES));
+        if (!bio)
+        {
+            return -ENOMEM;
+        }
+        bio->bi_bdev = sb->s_bdev;
+        bio->bi_sector = (sector_t)(blk_no + done) << (fs->block_bits - 9);
+        bio->bi_end_io = sfat_end_bio;
+        bio->bi_private = &wait;
+
+        for (i = done; i < n; ++i)
+        {
+            // the data of a block is at the start of its page
+            if (bio_add_page(bio, bhs[i]->page, fs->block_size, 0) < fs->block_size)
+            {
+                break;  // the bio is as large as the device takes
+            }
+        }
+        if (i == done)
+        {
+            bio_put(bio);
+            return -EIO;
+        }
+
+        for (; done < i; ++done)
+        {
+            sfat_heat_account(sb, blk_no + done, WRITE == rw);
+            trace_sfat_block_io(sb, rw, blk_no + done);
+        }
+        if (WRITE == rw)
+        {
+            sfat_stat_add(sb, SFAT_STAT_BLK_WRITE, bio->bi_vcnt);
+            sfat_stat_inc(sb, SFAT_STAT_WB_BIO);
+        }
+        else
+        {
+            sfat_stat_add(sb, SFAT_STAT_BLK_READ, bio->bi_vcnt);
+        }
+
+        init_completion(&wait.done);
+        wait.error = 0;
+        start = sfat_lat_start();
+        submit_bio(rw, bio);
+        wait_for_completion(&wait.done);
+        sfat_lat_end(sb, WRITE == rw? SFAT_LAT_BLK_WRITE: SFAT_LAT_BLK_READ, start);
+        bio_put(bio);
+
+        if (wait.error && !error)
+        {
+            error = wait.error;
+        }
+    }
+    return error;
+}
+
+int sfat_read_blocks(struct super_block *sb, struct block_holder **bhs, size_t n, size_t blk_no)
+{
+    return sfat_rw_blocks(sb, READ, bhs, n, blk_no);
+}
+
+int sfat_write_blocks(struct super_block *sb, struct block_holder **bhs, size_t n, size_t blk_no)
+{
+    return sfat_rw_blocks(sb, WRITE, bhs, n, blk_no);
+}
@@ -9,6 +9,8 @@
 #ifndef __SFAT_IO_H
 #define __SFAT_IO_H
 
+#include <linux/fs.h>
+
 #include "sfat_fs.h"
 
 int sfat_blkholder_cache_init(void);
@@ -27,6 +29,16 @@ int read_block(struct block_device *bdev, struct block_holder *blk_holder,
 int write_block(struct block_device *bdev, struct block_holder *blk_holder,
                             size_t blk_sz, size_t blk_no);
 
+// the same as above with the block size of the volume, counted in its stats
+int sfat_read_block(struct super_block *sb, struct block_holder *blk_holder, size_t blk_no);
+
+int sfat_write_block(struct super_block *sb, struct block_holder *blk_holder, size_t blk_no);
+
+// blocks blk_no, blk_no + 1, ... read/written together
+int sfat_read_blocks(struct super_block *sb, struct block_holder **bhs, size_t n, size_t blk_no);
+
+int sfat_write_blocks(struct super_block *sb, struct block_holder **bhs, size_t n, size_t blk_no);
+
 
 #endif
 
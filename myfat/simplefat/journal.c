@@ -0,0 +1,879 @@
+/*
+ * journal.c
+ *
+ *  Metadata journal of a volume, see journal.h.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jiffies.h>
+#include <linux/sort.h>
+#include <linux/crc32.h>
+
+#include "sfat.h"
+#include "io.h"
+#include "cache.h"
+#include "super.h"
+#include "stats.h"
+#include "journal.h"
+
+/*
+ * a dirty block taken by a commit
+ */
+struct sfat_jblock {
+    size_t blk;                  /* where it belongs */
+    struct sfat_mblock *mb;      /* the cached block (a reference is held) */
+    struct block_holder *copy;   /* its content at the commit */
+};
+
+/* no. of block nos in one descriptor block */
+static inline unsigned long sfat_journal_per_desc(struct super_block *sb)
+{
+    return (SFAT_SB(sb)->fs_info.block_size - sizeof(struct sfat_journal_header))
+        / sizeof(__le32);
+}
+
+static void sfat_journal_header(void *data, u32 type, u32 seq, u32 count)
+{
+    struct sfat_journal_header *h = data;
+
+    h->magic = cpu_to_le32(SFAT_JOURNAL_MAGIC);
+    h->type = cpu_to_le32(type);
+    h->seq = cpu_to_le32(seq);
+    h->count = cpu_to_le32(count);
+}
+
+/*
+ * Desc: write the super block of the journal (not flushed)
+ * In:
+ *   seq: transaction at the start of the log
+ *   flags: SFAT_JOURNAL_CLEAN or 0
+ */
+static int sfat_journal_write_super(struct super_block *sb, u32 seq, u32 flags)
+{
+    struct sfat_journal *j = SFAT_SB(sb)->journal;
+    struct block_holder *bh = NULL;
+    struct sfat_journal_super *js = NULL;
+    int error = 0;
+
+    bh = sfat_blkholder_alloc();
+    if (!bh)
+    {
+        return -ENOMEM;
+    }
+    js = (struct sfat_journal_super *)sfat_blkholder_get_data(bh);
+    memset(js, 0, SFAT_SB(sb)->fs_info.block_size);
+    sfat_journal_header(js, SFAT_JOURNAL_SUPER, seq, 0);
+    js->flags = cpu_to_le32(flags);
+
+    error = sfat_write_block(sb, bh, j->start);
+    sfat_blkholder_free(bh);
+    return error;
+}
+
+static int sfat_jblock_cmp(const void *a, const void *b)
+{
+    const struct sfat_jblock *x = a;
+    const struct sfat_jblock *y = b;
+
+    if (x->blk < y->blk)
+        return -1;
+    return x->blk > y->blk;
+}
+
+static void sfat_jblock_swap(void *a, void *b, int size)
+{
+    struct sfat_jblock t = *(struct sfat_jblock *)a;
+
+    *(struct sfat_jblock *)a = *(struct sfat_jblock *)b;
+    *(struct sfat_jblock *)b = t;
+}
+
+/*
+ * Desc: write the logged copies to their places, blocks following each
+ *   other on the volume by one bio
+ * In:
+ *   jb, n: sorted by block no. (mb is NULL for blocks of a replay)
+ */
+static int sfat_journal_checkpoint(struct super_block *sb, struct sfat_jblock *jb, unsigned long n)
+{
+    struct block_holder *bhs[SFAT_WB_MAX_RUN];
+    unsigned long len = 0;
+    unsigned long i = 0;
+    unsigned long k = 0;
+    int error = 0;
+    int err = 0;
+
+    for (i = 0; i < n; i += len)
+    {
+        bhs[0] = jb[i].copy;
+        for (len = 1; i + len < n && len < SFAT_WB_MAX_RUN
+                && jb[i + len].blk == jb[i].blk + len; ++len)
+        {
+            bhs[len] = jb[i + len].copy;
+        }
+
+        err = sfat_write_blocks(sb, bhs, len, jb[i].blk);
+        if (err)
+        {
+            // logged already, but the log may start over: log them again
+            for (k = 0; k < len && jb[i + k].mb; ++k)
+            {
+                sfat_mblock_mark_dirty(sb, jb[i + k].mb);
+            }
+            if (!error)
+            {
+                error = err;
+            }
+        }
+    }
+    return error;
+}
+
+/*
+ * a window of the log read by one bio, see sfat_jreader_get
+ */
+struct sfat_jreader {
+    struct block_holder *bhs[SFAT_JOURNAL_READ_RUN];
+    unsigned long first;         /* log block in bhs[0] */
+    unsigned long nr;            /* no. of blocks read, 0 => empty */
+    unsigned long reads;         /* no. of log blocks read so far */
+};
+
+/*
+ * a block logged by a committed transaction
+ */
+struct sfat_jentry {
+    size_t dst;                  /* where it belongs */
+    unsigned long pos;           /* log block holding it */
+};
+
+static int sfat_jreader_init(struct sfat_jreader *r)
+{
+    unsigned long i = 0;
+
+    memset(r, 0, sizeof(*r));
+    for (i = 0; i < SFAT_JOURNAL_READ_RUN; ++i)
+    {
+        r->bhs[i] = sfat_blkholder_alloc();
+        if (!r->bhs[i])
+        {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void sfat_jreader_destroy(struct sfat_jreader *r)
+{
+    unsigned long i = 0;
+
+    for (i = 0; i < SFAT_JOURNAL_READ_RUN && r->bhs[i]; ++i)
+    {
+        sfat_blkholder_free(r->bhs[i]);
+    }
+}
+
+/*
+ * Desc: data of a block of the log, reading [pos, last] (at most
+ *   SFAT_JOURNAL_READ_RUN blocks) by one bio if pos isn't in the window
+ *   The data stays valid until the window moves.
+ * In:
+ *   last: last block worth reading ahead
+ */
+static char *sfat_jreader_get(struct super_block *sb, struct sfat_jreader *r,
+        unsigned long pos, unsigned long last, int *perror)
+{
+    struct sfat_journal *j = SFAT_SB(sb)->journal;
+    int error = 0;
+
+    if (pos < r->first || pos >= r->first + r->nr)
+    {
+        r->first = pos;
+        r->nr = min(last + 1 - pos, (unsigned long)SFAT_JOURNAL_READ_RUN);
+        error = sfat_read_blocks(sb, r->bhs, r->nr, j->start + pos);
+        if (error)
+        {
+            r->nr = 0;
+            *perror = error;
+            return NULL;
+        }
+        r->reads += r->nr;
+    }
+    return sfat_blkholder_get_data(r->bhs[pos - r->first]);
+}
+
+/*
+ * Desc: scan the log from its start for committed transactions, reading
+ *   ahead sequentially, and collect the blocks they log
+ * In:
+ *   seq: seq of the first transaction
+ * Out:
+ *   ents, *nents: the blocks in log order (ents has room for the log)
+ *   *ntxn: no. of committed transactions
+ */
+static int sfat_journal_scan(struct super_block *sb, struct sfat_jreader *r, u32 seq,
+        struct sfat_jentry *ents, unsigned long *nents, unsigned long *ntxn)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs = &sbi->fs_info;
+    struct sfat_journal *j = sbi->journal;
+    unsigned long per_desc = sfat_journal_per_desc(sb);
+    unsigned long blk_end = fs->data_start_blk + ((unsigned long)fs->clusters << fs->blk_per_clus_bits);
+    struct sfat_journal_desc *desc = NULL;
+    struct sfat_journal_header *h = NULL;
+    unsigned long pos = 1;
+    unsigned long n = 0;      // entries of the committed transactions
+    unsigned long count = 0;
+    unsigned long i = 0;
+    char *data = NULL;
+    u32 crc = ~0U;
+    int error = 0;
+
+    // the desc is kept aside while the window moves over its blocks
+    desc = kmalloc(fs->block_size, GFP_KERNEL);
+    if (!desc)
+    {
+        return -ENOMEM;
+    }
+
+    *nents = 0;
+    *ntxn = 0;
+    while (pos < j->blocks)
+    {
+        data = sfat_jreader_get(sb, r, pos, j->blocks - 1, &error);
+        if (!data)
+        {
+            break;
+        }
+        h = (struct sfat_journal_header *)data;
+        if (SFAT_JOURNAL_MAGIC != le32_to_cpu(h->magic) || seq != le32_to_cpu(h->seq))
+        {
+            break;
+        }
+
+        if (SFAT_JOURNAL_COMMIT == le32_to_cpu(h->type))
+        {
+            if (crc != le32_to_cpu(h->count))
+            {
+                break;  // torn transaction, the end of the log
+            }
+            *nents = n;
+            ++*ntxn;
+            ++seq;
+            crc = ~0U;
+            ++pos;
+            continue;
+        }
+
+        count = le32_to_cpu(h->count);
+        if (SFAT_JOURNAL_DESC != le32_to_cpu(h->type)
+            || count > per_desc || pos + 1 + count > j->blocks)
+        {
+            break;
+        }
+        memcpy(desc, data, fs->block_size);
+        crc = crc32_le(crc, (unsigned char *)desc, fs->block_size);
+
+        for (i = 0; i < count; ++i)
+        {
+            data = sfat_jreader_get(sb, r, pos + 1 + i, j->blocks - 1, &error);
+            if (!data)
+            {
+                goto out;
+            }
+            crc = crc32_le(crc, data, fs->block_size);
+
+            ents[n].dst = le32_to_cpu(desc->blk[i]);
+            ents[n].pos = pos + 1 + i;
+            ++n;
+        }
+        pos += 1 + count;
+    }
+
+out:
+    kfree(desc);
+    if (error)
+    {
+        return error;
+    }
+
+    // only FAT and directory blocks are logged
+    for (i = 0; i < *nents; ++i)
+    {
+        if (ents[i].dst < fs->fat_start_blk || ents[i].dst >= blk_end)
+        {
+            printk(KERN_ERR "sfat: journal of %s logs block %zu out of the volume\n",
+                    sb->s_id, ents[i].dst);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+static int sfat_jentry_cmp_dst(const void *a, const void *b)
+{
+    const struct sfat_jentry *x = a;
+    const struct sfat_jentry *y = b;
+
+    if (x->dst != y->dst)
+        return x->dst < y->dst? -1: 1;
+    if (x->pos != y->pos)
+        return x->pos < y->pos? -1: 1;
+    return 0;
+}
+
+static int sfat_jentry_cmp_pos(const void *a, const void *b)
+{
+    const struct sfat_jentry *x = a;
+    const struct sfat_jentry *y = b;
+
+    if (x->pos != y->pos)
+        return x->pos < y->pos? -1: 1;
+    return 0;
+}
+
+static void sfat_jentry_swap(void *a, void *b, int size)
+{
+    struct sfat_jentry t = *(struct sfat_jentry *)a;
+
+    *(struct sfat_jentry *)a = *(struct sfat_jentry *)b;
+    *(struct sfat_jentry *)b = t;
+}
+
+/*
+ * Desc: write the committed transactions of the log to their places
+ *   The log is scanned once with large sequential reads. Only the last
+ *   copy of each block is written, the copies are read again window by
+ *   window in log order and written in runs of blocks following each
+ *   other on the volume. So the work is bounded by the size of the
+ *   journal, not of the volume.
+ * In:
+ *   pseq: seq in the super block of the journal
+ * Out:
+ *   pseq: seq of the next transaction
+ */
+static int sfat_journal_replay(struct super_block *sb, u32 *pseq)
+{
+    struct sfat_journal *j = SFAT_SB(sb)->journal;
+    struct sfat_jreader r;
+    struct sfat_jentry *ents = NULL;
+    struct sfat_jblock *jb = NULL;
+    unsigned long begin = jiffies;
+    unsigned long nents = 0;
+    unsigned long ntxn = 0;
+    unsigned long m = 0;
+    unsigned long i = 0;
+    unsigned long k = 0;
+    unsigned long last = 0;
+    int error = 0;
+
+    error = sfat_jreader_init(&r);
+    if (error)
+    {
+        goto out;
+    }
+    ents = vmalloc(j->blocks * sizeof(*ents));
+    jb = kmalloc(SFAT_JOURNAL_READ_RUN * sizeof(*jb), GFP_KERNEL);
+    if (!ents || !jb)
+    {
+        error = -ENOMEM;
+        goto out;
+    }
+
+    error = sfat_journal_scan(sb, &r, *pseq, ents, &nents, &ntxn);
+    if (error || !nents)
+    {
+        goto out;
+    }
+
+    // the last copy of a block wins
+    sort(ents, nents, sizeof(*ents), sfat_jentry_cmp_dst, sfat_jentry_swap);
+    for (i = 0; i < nents; ++i)
+    {
+        if (i + 1 < nents && ents[i + 1].dst == ents[i].dst)
+        {
+            continue;
+        }
+        ents[m++] = ents[i];
+    }
+    sort(ents, m, sizeof(*ents), sfat_jentry_cmp_pos, sfat_jentry_swap);
+
+    for (i = 0; i < m; i += k)
+    {
+        // the copies within one window of the log, read by one bio
+        for (k = 0; i + k < m && ents[i + k].pos < ents[i].pos + SFAT_JOURNAL_READ_RUN; ++k)
+        {
+            last = ents[i + k].pos;
+        }
+        r.nr = 0;
+        for (k = 0; i + k < m && ents[i + k].pos <= last; ++k)
+        {
+            if (!sfat_jreader_get(sb, &r, ents[i + k].pos, last, &error))
+            {
+                goto out;
+            }
+            jb[k].blk = ents[i + k].dst;
+            jb[k].mb = NULL;
+            jb[k].copy = r.bhs[ents[i + k].pos - r.first];
+        }
+
+        sort(jb, k, sizeof(*jb), sfat_jblock_cmp, sfat_jblock_swap);
+        error = sfat_journal_checkpoint(sb, jb, k);
+        if (error)
+        {
+            goto out;
+        }
+    }
+
+    error = sfat_flush_device(sb);
+    if (error)
+    {
+        goto out;
+    }
+    sfat_stat_add(sb, SFAT_STAT_JNL_REPLAY, m);
+
+out:
+    if (!error)
+    {
+        printk(KERN_INFO "sfat: %s: replayed %lu transactions from the journal, "
+                "%lu blocks logged, %lu written, %lu read, in %u ms\n",
+                sb->s_id, ntxn, nents, m, r.reads, jiffies_to_msecs(jiffies - begin));
+        *pseq += ntxn;
+    }
+    kfree(jb);
+    vfree(ents);
+    sfat_jreader_destroy(&r);
+    return error;
+}
+
+/*
+ * Desc: set up the journal at mount, replaying it if the volume wasn't
+ *   unmounted cleanly. Must be done before any metadata is read.
+ * In:
+ *   start, blocks: the journal in blocks of the volume
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+int sfat_journal_load(struct super_block *sb, unsigned long start, unsigned long blocks)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_journal *j = NULL;
+    struct block_holder *bh = NULL;
+    struct sfat_journal_super *js = NULL;
+    unsigned long per_desc = sfat_journal_per_desc(sb);
+    u32 flags = 0;
+    u32 seq = 0;
+    int error = 0;
+
+    if (blocks < SFAT_JOURNAL_MIN_BLOCKS)
+    {
+        printk(KERN_ERR "sfat: journal of %s has only %lu blocks\n", sb->s_id, blocks);
+        return -EINVAL;
+    }
+
+    j = kzalloc(sizeof(*j), GFP_KERNEL);
+    if (!j)
+    {
+        return -ENOMEM;
+    }
+    init_rwsem(&j->op_sem);
+    j->start = start;
+    j->blocks = blocks;
+    j->head = 1;
+    // a transaction needs its descriptors and a commit block besides the blocks
+    j->max_txn = (blocks - 2) * per_desc / (per_desc + 1);
+    j->limit = j->max_txn / 2;
+    sbi->journal = j;
+
+    bh = sfat_blkholder_alloc();
+    if (!bh)
+    {
+        error = -ENOMEM;
+        goto fail;
+    }
+    error = sfat_read_block(sb, bh, start);
+    if (error)
+    {
+        goto fail;
+    }
+    js = (struct sfat_journal_super *)sfat_blkholder_get_data(bh);
+    if (SFAT_JOURNAL_MAGIC != le32_to_cpu(js->h.magic)
+        || SFAT_JOURNAL_SUPER != le32_to_cpu(js->h.type))
+    {
+        printk(KERN_ERR "sfat: bad journal super block on %s\n", sb->s_id);
+        error = -EINVAL;
+        goto fail;
+    }
+    seq = le32_to_cpu(js->h.seq);
+    flags = le32_to_cpu(js->flags);
+    sfat_blkholder_free(bh);
+    bh = NULL;
+
+    if (!(flags & SFAT_JOURNAL_CLEAN))
+    {
+        error = sfat_journal_replay(sb, &seq);
+        if (error)
+        {
+            printk(KERN_ERR "sfat: replaying the journal of %s failed, error is %d\n",
+                    sb->s_id, error);
+            goto fail;
+        }
+    }
+
+    // checkpoint: the replayed blocks are flushed in place, so moving the
+    // start of the log past them clears it; the volume is in use now
+    j->seq = seq;
+    error = sfat_journal_write_super(sb, seq, 0);
+    if (!error)
+    {
+        error = sfat_flush_device(sb);
+    }
+    if (error)
+    {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (bh)
+    {
+        sfat_blkholder_free(bh);
+    }
+    sbi->journal = NULL;
+    kfree(j);
+    return error;
+}
+
+/*
+ * Desc: mark the journal clean at unmount (sync_fs has committed everything
+ *   before) and free it
+ */
+void sfat_journal_release(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_journal *j = sbi->journal;
+    int error = 0;
+
+    if (!j)
+    {
+        return;
+    }
+
+    if (sbi->mcache.nr_dirty)
+    {
+        error = -EIO;  // the last commit failed, leave the log for replay
+    }
+    // the blocks written to their places go to disk before the log is dropped
+    if (!error)
+    {
+        error = sfat_flush_device(sb);
+    }
+    if (!error)
+    {
+        error = sfat_journal_write_super(sb, j->seq, SFAT_JOURNAL_CLEAN);
+    }
+    if (!error)
+    {
+        error = sfat_flush_device(sb);
+    }
+    if (error)
+    {
+        printk(KERN_ERR "sfat: journal of %s is left for replay, error is %d\n", sb->s_id, error);
+    }
+
+    sbi->journal = NULL;
+    kfree(j);
+}
+
+/*
+ * Desc: begin an operation which changes cached metadata blocks
+ *   If the dirty blocks are about to outgrow one transaction, they are
+ *   committed first (no operation may be open in the caller).
+ */
+void sfat_journal_start(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_journal *j = sbi->journal;
+
+    if (!j)
+    {
+        return;
+    }
+    if (sbi->mcache.nr_dirty >= j->limit)
+    {
+        sfat_mcache_write(sb, 0, SFAT_BLK_NONE, SFAT_BLK_NONE);
+    }
+    down_read(&j->op_sem);
+}
+
+void sfat_journal_stop(struct super_block *sb)
+{
+    struct sfat_journal *j = SFAT_SB(sb)->journal;
+
+    if (j)
+    {
+        up_read(&j->op_sem);
+    }
+}
+
+/*
+ * Desc: write the blocks to the log as one transaction and flush
+ *   If the rest of the log is too short (or restart is asked for), the log
+ *   starts over at its beginning once everything logged before is on disk
+ *   in its place.
+ * In:
+ *   jb, n: the blocks, n <= max_txn
+ */
+static int sfat_journal_log(struct super_block *sb, struct sfat_jblock *jb, unsigned long n,
+        int restart)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_journal *j = sbi->journal;
+    unsigned long block_size = sbi->fs_info.block_size;
+    unsigned long per_desc = sfat_journal_per_desc(sb);
+    unsigned long ndesc = DIV_ROUND_UP(n, per_desc);
+    unsigned long need = n + ndesc + 1;
+    struct block_holder **bhs = NULL;
+    struct block_holder **hdrs = NULL;  // descriptors and commit
+    struct sfat_journal_desc *desc = NULL;
+    unsigned long pos = 0;
+    unsigned long i = 0;
+    unsigned long k = 0;
+    u32 crc = ~0U;
+    int error = 0;
+
+    if (restart || j->head + need > j->blocks)
+    {
+        error = sfat_flush_device(sb);
+        if (error)
+        {
+            return error;
+        }
+        j->head = 1;
+        restart = 1;
+    }
+
+    bhs = kmalloc(need * sizeof(*bhs), GFP_NOFS);
+    hdrs = kzalloc((ndesc + 1) * sizeof(*hdrs), GFP_NOFS);
+    if (!bhs || !hdrs)
+    {
+        error = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i <= ndesc; ++i)
+    {
+        hdrs[i] = sfat_blkholder_alloc();
+        if (!hdrs[i])
+        {
+            error = -ENOMEM;
+            goto out;
+        }
+        memset(sfat_blkholder_get_data(hdrs[i]), 0, block_size);
+    }
+
+    for (i = 0; i < n; i += per_desc)
+    {
+        unsigned long cnt = min(n - i, per_desc);
+
+        desc = (struct sfat_journal_desc *)sfat_blkholder_get_data(hdrs[i / per_desc]);
+        sfat_journal_header(desc, SFAT_JOURNAL_DESC, j->seq, cnt);
+        for (k = 0; k < cnt; ++k)
+        {
+            desc->blk[k] = cpu_to_le32(jb[i + k].blk);
+        }
+        crc = crc32_le(crc, (unsigned char *)desc, block_size);
+        bhs[pos++] = hdrs[i / per_desc];
+
+        for (k = 0; k < cnt; ++k)
+        {
+            crc = crc32_le(crc, sfat_blkholder_get_data(jb[i + k].copy), block_size);
+            bhs[pos++] = jb[i + k].copy;
+        }
+    }
+    sfat_journal_header(sfat_blkholder_get_data(hdrs[ndesc]), SFAT_JOURNAL_COMMIT, j->seq, crc);
+    bhs[pos++] = hdrs[ndesc];
+
+    error = sfat_write_blocks(sb, bhs, pos, j->start + j->head);
+    if (!error && restart)
+    {
+        error = sfat_journal_write_super(sb, j->seq, 0);
+    }
+    if (!error)
+    {
+        unsigned long issued = ++j->flush_issued;
+
+        smp_wmb();
+        error = sfat_flush_device(sb);
+        if (!error)
+        {
+            ACCESS_ONCE(j->flush_done) = issued;
+        }
+    }
+    if (!error)
+    {
+        j->head += need;
+        ++j->seq;
+        sfat_stat_inc(sb, SFAT_STAT_JNL_COMMIT);
+        sfat_stat_add(sb, SFAT_STAT_JNL_BLOCKS, n);
+    }
+
+out:
+    if (hdrs)
+    {
+        for (i = 0; i <= ndesc; ++i)
+        {
+            if (hdrs[i])
+            {
+                sfat_blkholder_free(hdrs[i]);
+            }
+        }
+    }
+    kfree(hdrs);
+    kfree(bhs);
+    return error;
+}
+
+/*
+ * Desc: commit all the dirty metadata blocks, called by sfat_mcache_write
+ *   with mcache.write_mutex held
+ *   Operations are held off only while the blocks are copied; logging,
+ *   the flush and the writes to their places go on beside them.
+ * Return:
+ *   0: success
+ *   < 0: error code, the blocks not logged are dirty again
+ */
+int sfat_journal_commit(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_journal *j = sbi->journal;
+    struct sfat_mcache *mc = &sbi->mcache;
+    struct sfat_jblock *jb = NULL;
+    struct sfat_mblock *mb = NULL;
+    unsigned long cap = 0;
+    unsigned long n = 0;
+    unsigned long i = 0;
+    unsigned long len = 0;
+    int restart = 0;
+    int error = 0;
+    int err = 0;
+
+    // copies are allocated beforehand, with no operation held off
+    for (;;)
+    {
+        spin_lock(&mc->lock);
+        cap = mc->nr_dirty;
+        spin_unlock(&mc->lock);
+        if (!cap)
+        {
+            return 0;
+        }
+        cap += cap / 8 + 4;  // room for blocks dirtied meanwhile
+
+        jb = kcalloc(cap, sizeof(*jb), GFP_NOFS);
+        if (!jb)
+        {
+            return -ENOMEM;
+        }
+        for (i = 0; i < cap; ++i)
+        {
+            jb[i].copy = sfat_blkholder_alloc();
+            if (!jb[i].copy)
+            {
+                error = -ENOMEM;
+                goto out;
+            }
+        }
+
+        down_write(&j->op_sem);
+        spin_lock(&mc->lock);
+        if (mc->nr_dirty <= cap)
+        {
+            break;
+        }
+        spin_unlock(&mc->lock);
+        up_write(&j->op_sem);
+
+        for (i = 0; i < cap; ++i)
+        {
+            sfat_blkholder_free(jb[i].copy);
+        }
+        kfree(jb);
+        jb = NULL;
+    }
+
+    // no operation is open, so the dirty blocks are a consistent state
+    list_for_each_entry(mb, &mc->dirty, mb_dirty) {
+        ++mb->mb_count;
+        jb[n].mb = mb;
+        jb[n].blk = mb->mb_blk;
+        ++n;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        mb = jb[i].mb;
+        mb->mb_is_dirty = 0;
+        list_del_init(&mb->mb_dirty);
+        --mc->nr_dirty;
+    }
+    spin_unlock(&mc->lock);
+    for (i = 0; i < n; ++i)
+    {
+        memcpy(sfat_blkholder_get_data(jb[i].copy), sfat_mblock_data(jb[i].mb),
+                sbi->fs_info.block_size);
+    }
+    restart = j->revoke;
+    j->revoke = 0;
+    up_write(&j->op_sem);
+
+    sort(jb, n, sizeof(*jb), sfat_jblock_cmp, sfat_jblock_swap);
+
+    // more than one transaction only if operations outran the limit
+    for (i = 0; i < n; i += len)
+    {
+        len = min(n - i, j->max_txn);
+        err = sfat_journal_log(sb, jb + i, len, restart && !i);
+        if (err)
+        {
+            error = err;
+            printk(KERN_ERR "sfat: journal commit on %s failed, error is %d\n", sb->s_id, error);
+            if (restart)
+            {
+                j->revoke = 1;
+            }
+            for (; i < n; ++i)
+            {
+                sfat_mblock_mark_dirty(sb, jb[i].mb);
+            }
+            break;
+        }
+        // blocks which didn't get home are dirty again (see
+        // sfat_journal_checkpoint); the later transactions still go on, or
+        // nothing would log them
+        err = sfat_journal_checkpoint(sb, jb + i, len);
+        if (err && !error)
+        {
+            error = err;
+        }
+    }
+
+    spin_lock(&mc->lock);
+    for (i = 0; i < n; ++i)
+    {
+        --jb[i].mb->mb_count;
+    }
+    spin_unlock(&mc->lock);
+
+out:
+    for (i = 0; i < cap; ++i)
+    {
+        if (jb[i].copy)
+        {
+            sfat_blkholder_free(jb[i].copy);
+        }
+    }
+    kfree(jb);
+    return error;
+}
@@ -0,0 +1,81 @@
+/*
+ * journal.h
+ *
+ *  Metadata journal of a volume (SFAT_FEATURE_JOURNAL, layout in sfat_fs.h).
+ *  Every change of cached metadata blocks is made inside an operation
+ *  (sfat_journal_start/stop). A commit takes copies of all the dirty blocks
+ *  at a moment when no operation is running, logs them as one transaction
+ *  followed by one flush, and only then writes the copies to their places.
+ *  So many operations share one flush, and after a crash the volume is as
+ *  of the last commit.
+ */
+
+#ifndef __SFAT_JOURNAL_H
+#define __SFAT_JOURNAL_H
+
+#include <linux/fs.h>
+#include <linux/rwsem.h>
+
+#include "sfat.h"
+
+/* most log blocks read by one bio at replay */
+#define SFAT_JOURNAL_READ_RUN  128
+
+struct sfat_journal {
+    struct rw_semaphore op_sem;  /* read: an operation, write: taking a commit */
+    unsigned long start;         /* first block of the journal in the volume */
+    unsigned long blocks;        /* no. of blocks of the journal */
+    unsigned long head;          /* next block of the log, 1 ~ blocks */
+    unsigned long max_txn;       /* most blocks logged by one transaction */
+    unsigned long limit;         /* dirty blocks which make an operation commit first */
+    u32 seq;                     /* seq of the next transaction */
+    unsigned long flush_issued;  /* no. of flushes of commits started */
+    unsigned long flush_done;    /* the last one of them completed */
+    int revoke;                  /* the next commit starts the log over */
+};
+
+int sfat_journal_load(struct super_block *sb, unsigned long start, unsigned long blocks);
+
+void sfat_journal_release(struct super_block *sb);
+
+int sfat_journal_commit(struct super_block *sb);
+
+void sfat_journal_start(struct super_block *sb);
+
+void sfat_journal_stop(struct super_block *sb);
+
+/*
+ * a commit flushes the device, so what was written before a call of
+ * sfat_journal_flush_mark is durable once a flush started after it has
+ * completed, and the caller's own flush can be skipped
+ */
+static inline unsigned long sfat_journal_flush_mark(struct super_block *sb)
+{
+    struct sfat_journal *j = SFAT_SB(sb)->journal;
+
+    return j? ACCESS_ONCE(j->flush_issued): 0;
+}
+
+static inline int sfat_journal_flushed_since(struct super_block *sb, unsigned long mark)
+{
+    struct sfat_journal *j = SFAT_SB(sb)->journal;
+
+    return j && (long)(ACCESS_ONCE(j->flush_done) - mark) > 0;
+}
+
+/*
+ * what is logged so far must not be replayed any more (it has blocks of
+ * clusters which are freed now), called inside the operation freeing them:
+ * the commit of the operation starts the log over
+ */
+static inline void sfat_journal_revoke(struct super_block *sb)
+{
+    struct sfat_journal *j = SFAT_SB(sb)->journal;
+
+    if (j)
+    {
+        j->revoke = 1;
+    }
+}
+
+#endif
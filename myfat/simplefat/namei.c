@@ -10,6 +10,8 @@
 
 #include "super.h"
 #include "io.h"
+#include "cache.h"
+#include "stats.h"
 #include "inode.h"
 
 static int sfat_fill_super(struct super_block *sb, void *data, int silent)
@@ -20,8 +22,7 @@ static int sfat_fill_super(struct super_block *sb, void *data, int silent)
 	if (res)
 		return res;
 
-	sb->s_flags |= MS_NOATIME;
-	sb->s_root->d_op = 0;  // todo &msdos_dentry_operations;
+	sb->s_root->d_op = &sfat_dentry_operations;
 	return 0;
 }
 
@@ -67,6 +68,13 @@ static int __init init_sfat_fs(void)
     	printk (KERN_INFO "sfat_inodeinfo_cache_init failed\n");
         return ret;
     }
+    ret = sfat_mblock_cache_init();
+    if (ret)
+    {
+    	printk (KERN_INFO "sfat_mblock_cache_init failed\n");
+        return ret;
+    }
+    sfat_debugfs_init();
 
     return register_filesystem(&sfat_fs_type);
 }
@@ -75,6 +83,8 @@ static void __exit exit_sfat_fs(void)
 {
     sfat_blkholder_cache_destroy();
     sfat_inodeinfo_cache_destroy();
+    sfat_mblock_cache_destroy();
+    sfat_debugfs_exit();
     unregister_filesystem(&sfat_fs_type);
 }
 
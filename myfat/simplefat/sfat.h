@@ -6,14 +6,49 @@
 #include <linux/nls.h>
 #include <linux/fs.h>
 #include <linux/mutex.h>
+#include <linux/percpu_counter.h>
 
 #include "sfat_fs.h"
+#include "cache.h"
+
+struct sfat_stats;
+struct sfat_heatmap;
+struct sfat_journal;
 
 #define FAT_ERRORS_CONT     1      /* ignore error and continue */
 #define FAT_ERRORS_PANIC    2      /* panic on error */
 #define FAT_ERRORS_RO       3      /* remount r/o on error */
 
 
+/* how atime is updated on read (sfat_mount_options.atime) */
+#define SFAT_ATIME_RELATIME 0      /* only if atime is older than mtime/ctime or a day old */
+#define SFAT_ATIME_NOATIME  1      /* never */
+
+/* defaults of the writeback of cached metadata (see sfat_mcache_wb_start) */
+#define SFAT_WB_INTERVAL_MS 5000   /* mount option wb_interval= */
+#define SFAT_WB_RATIO       10     /* mount option wb_ratio= */
+
+/*
+ * debug messages, the level is fixed at compile time
+ * (make SFAT_DEBUG_LEVEL=n) so that nothing is left of them by default
+ *   1: mount/umount
+ *   2: every operation
+ *   3: inside the loops over blocks and entries
+ * Use the tracepoints in sfat_trace.h to watch a production build.
+ */
+#ifndef SFAT_DEBUG_LEVEL
+#define SFAT_DEBUG_LEVEL 0
+#endif
+
+#define sfat_dbg(level, fmt, args...)                \
+    do {                                             \
+        if (SFAT_DEBUG_LEVEL >= (level))             \
+            printk(KERN_DEBUG fmt, ##args);          \
+    } while (0)
+
+#define SFAT_HASH_BITS  8
+#define SFAT_HASH_SIZE  (1UL << SFAT_HASH_BITS)
+
 /* on-disk position (in byte) of directory entry for root */
 /* The one should be a special number different from other feasible position */
 #define SFAT_ROOT_DIRENTRY_POS 0
@@ -29,6 +64,9 @@ struct sfat_mount_options {
 //    unsigned short shortname; /* flags for shortname display/create rule */
 //    unsigned char name_check; /* r = relaxed, n = normal, s = strict */
     unsigned char errors;     /* On error: continue, panic, remount-ro */
+    unsigned char atime;      /* SFAT_ATIME_XXX */
+    unsigned int wb_interval; /* ms a metadata block stays dirty, 0 => write_super */
+    unsigned int wb_ratio;    /* percent of the cache dirty which starts writeback */
 //    unsigned short allow_utime;/* permission for setting the [am]time */
 //    unsigned quiet:1,         /* set = fake successful chmods and chowns */
 //         showexec:1,      /* set = only set x bit for com/exe/bat */
@@ -78,6 +116,9 @@ struct sfat_fs_info {
     unsigned long clusters;         /* no. of clusters in the data area */
     
     unsigned long root_cluster_cls;    /* cluster no. of the root directory */
+
+    unsigned char version;          /* on-disk format version */
+    unsigned long features;         /* SFAT_FEATURE_XXX */
 };
 
 /*
@@ -112,15 +153,125 @@ static inline loff_t form_dir_entry_pos(struct sfat_fs_info *fs, size_t cls, siz
     return ((CLS_TO_BLK(fs, cls) + blk) << fs->block_bits) + offset;
 }
 
+/* clusters added to a full directory at once */
+#define SFAT_DIR_GROW_CLUSTERS  4
+
+/* a linear subdirectory of this many clusters is made hashed (sfat_dir_reshape) */
+#define SFAT_DIR_HASH_CLUSTERS  8
+
+/* the features this driver knows, a volume with others is not mounted */
+#define SFAT_FEATURES_KNOWN \
+    (SFAT_FEATURE_HASHDIR | SFAT_FEATURE_JOURNAL | SFAT_FEATURE_LARGEFILE)
+
+/* locks of partial block writes of files, see sfat_rmw_lock */
+#define SFAT_RMW_LOCKS  64
+
+/*
+ * An allocation group is a range of clusters whose FAT entries fill
+ * SFAT_AG_FAT_BLKS whole FAT blocks (the last group may be shorter), so
+ * two groups never share a FAT block. Each has its own lock and keeps its
+ * free count up to date, and sbi->free_clusters the sum of them, so that
+ * statfs neither scans FAT nor walks the groups.
+ */
+#define SFAT_AG_FAT_BLKS    32
+
+struct sfat_alloc_group {
+    struct mutex lock;
+    unsigned long start;       /* first cluster */
+    unsigned long end;         /* last cluster + 1 */
+    unsigned long free;        /* no. of free clusters */
+    unsigned long next_free;   /* cluster the scan starts from */
+};
+
+/* no goal for sfat_fat_entry_acquire, use the group of the cpu */
+#define SFAT_CLS_NONE       (~(size_t)0)
+
+/*
+ * Locking
+ *
+ * sfat_alloc_group.lock (mutex): the allocator within one allocation
+ *   group, i.e. finding a free FAT entry of the group and claiming it, plus
+ *   the free/next_free of the group. It is held only for that, never over
+ *   I/O of data, and at most one of them is held at a time.
+ * i_chain_sem (sfat_inode_info, rw_semaphore): i_start, the cluster chain
+ *   and i_size of a regular file, and i_pos. Writers which claim clusters
+ *   or fill a gap after the end hold it for write, so the chain is
+ *   extended one at a time. Writes within the clusters a file has, readers,
+ *   fiemap and the writeback of the directory entry hold it for read, so
+ *   parallel pwrite writers don't wait for each other; such a write only
+ *   moves i_size up (under i_lock of the inode, which also covers the
+ *   i_hint_xxx of the chain). Rename holds it for write (of the moved
+ *   inode, then of the target) while it moves the entry to another slot,
+ *   and so does sfat_dir_reshape for each inode of the directory it
+ *   rebuilds.
+ * rmw_lock (sbi, mutexes hashed by block no.): the read-modify-write of a
+ *   block partly written by a write, so two writers of different bytes of
+ *   one block under i_chain_sem for read don't undo each other.
+ * i_mutex of a directory (taken by VFS for create, lookup, readdir, ...):
+ *   the slots and the chain of the directory. Writeback of an inode only
+ *   rewrites the fields of its own slot, which no other directory
+ *   operation touches while the inode is alive.
+ * inode_hash_lock (sbi, spinlock): changes of inode_hashtable, each also
+ *   bumps inode_hash_seq. Lookups (sfat_iget) walk it under RCU only,
+ *   sfat_inode_info is freed after a grace period for them. Rename moves
+ *   an inode to another bucket at once, so a walk which finds nothing
+ *   retries if inode_hash_seq moved meanwhile. A new inode is only
+ *   hashed after a second search under the lock (sfat_attach_new).
+ * The bucket index of a hashed directory (i_buckets, i_nbuckets) is
+ *   loaded before the inode is hashed and only replaced by
+ *   sfat_dir_reshape, under the i_mutex of the directory like any other
+ *   change of its slots.
+ * mcache.lock (spinlock): the metadata cache structure, not the content of
+ *   the blocks. Different users of a cached block change different entries
+ *   of it, each under the lock owning that entry (see above).
+ *
+ * mcache.write_mutex (mutex): one writer of dirty blocks at a time (the
+ *   writeback worker, sync_fs, fsync), see sfat_mcache_write.
+ * journal op_sem (rw_semaphore, only with the journal): operations which
+ *   change cached metadata hold it for read between sfat_journal_start and
+ *   sfat_journal_stop, after i_chain_sem and before sfat_alloc_group.lock.
+ *   A commit holds it for write (inside mcache.write_mutex, around
+ *   mcache.lock) while it copies the dirty blocks. Operations never nest,
+ *   and nothing writes dirty blocks back from inside one.
+ *
+ * Order: i_mutex of a directory -> i_chain_sem -> journal op_sem
+ *   -> sfat_alloc_group.lock -> mcache.write_mutex -> mcache.lock.
+ *   A commit takes mcache.write_mutex -> journal
+ *   op_sem, so with the journal mcache.write_mutex is never taken inside
+ *   an operation (sfat_mblock_put doesn't write back then).
+ * Operations on different files only meet in the lock of an allocation
+ * group, and allocations on different cpus start in different groups.
+ * Cached names never get here: dcache answers them (positive or negative)
+ * under RCU, and d_hash/d_compare (sfat_hash/sfat_cmp) take no lock. Only
+ * a miss calls sfat_lookup with the i_mutex of the directory.
+ */
 struct sfat_sb_info {
     struct sfat_fs_info fs_info;
 
     unsigned long root_size;       /* size of root directory in cluster */
+    unsigned short root_buckets;   /* no. of hash buckets root was formatted with, 0 => linear */
     
-    // so far the following is unused
-    struct mutex fat_lock;
+    // the data area split for the allocator, see sfat_fat_entry_acquire
+    struct sfat_alloc_group *groups;
+    unsigned long nr_groups;
+    unsigned int group_bits;       /* log2 of clusters per group */
+    struct percpu_counter free_clusters;  /* sum of groups[].free */
+
+    struct mutex rmw_lock[SFAT_RMW_LOCKS];  /* see sfat_rmw_lock */
+
+    // inodes in memory hashed by i_pos, so that one directory entry
+    // has at most one inode (whose dirty state is written back)
     spinlock_t inode_hash_lock;
-    // struct hlist_head inode_hashtable[FAT_HASH_SIZE];
+    seqcount_t inode_hash_seq;
+    struct hlist_head inode_hashtable[SFAT_HASH_SIZE];
+
+    // cached FAT and directory blocks
+    struct sfat_mcache mcache;
+    struct sfat_journal *journal;  /* NULL without SFAT_FEATURE_JOURNAL */
+
+    struct sfat_stats *stats;     /* per-cpu counters, see stats.h */
+    struct sfat_heatmap *heat;    /* block accesses per region or NULL */
+    struct dentry *debugfs_dir;   /* simplefat/<dev> in debugfs or NULL */
     
     struct nls_table *nls_disk;  /* Codepage used on disk */
     struct nls_table *nls_io;    /* Charset used for input and display */
@@ -135,6 +286,18 @@ static inline struct sfat_sb_info *SFAT_SB(struct super_block *sb)
     return sb->s_fs_info;
 }
 
+/* the lock of a partial write of block blk of a file */
+static inline struct mutex *sfat_rmw_lock(struct sfat_sb_info *sbi, size_t blk)
+{
+    return &sbi->rmw_lock[blk % SFAT_RMW_LOCKS];
+}
+
+/* free clusters of the volume, a snapshot (may be a bit off while claims run) */
+static inline unsigned long sfat_free_clusters(struct sfat_sb_info *sbi)
+{
+    return percpu_counter_read_positive(&sbi->free_clusters);
+}
+
 /* Convert attribute bits and a mask to the UNIX mode. */
 /*
  * attrs: attributes pertaining to SFAT, e.g. SFAT_ATTR_DIR
@@ -151,7 +314,7 @@ static inline mode_t sfat_make_mode(struct sfat_sb_info *sbi,
     {
 
         ret = (mode & ~sbi->options.fs_dmask) | S_IFDIR;
-        printk(KERN_INFO "sfat_make_mode S_IFDIR mode is %d\n", ret);
+        sfat_dbg(3, "sfat_make_mode S_IFDIR mode is %d\n", ret);
         return ret;
     }
     else
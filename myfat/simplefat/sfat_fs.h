@@ -34,6 +34,26 @@
 #define SFAT_ROOT_INO 5  // I like 5.
 
 
+/*
+ * sfat_boot_sector.signature, set by every format since v2
+ * Older formats wrote only the first 40 bytes of the boot sector and left
+ * whatever was on the device after them, so the fields from signature on
+ * are only read if it is there. A volume without it is v1, whatever the
+ * bytes say: it has to be formatted again for any v2 feature.
+ */
+#define SFAT_BOOT_SIGNATURE  0x32544653  /* "SFT2" */
+
+/* on-disk format version (sfat_boot_sector.version) */
+#define SFAT_FORMAT_V1  1  /* linear directories only */
+#define SFAT_FORMAT_V2  2  /* hashed directories may exist */
+
+/* feature bits (sfat_boot_sector.features), only valid for SFAT_FORMAT_V2 */
+#define SFAT_FEATURE_HASHDIR  0x00000001  /* SFAT_ATTR_HASHED directories */
+#define SFAT_FEATURE_JOURNAL  0x00000002  /* metadata journal in the reserved area */
+#define SFAT_FEATURE_LARGEFILE  0x00000004  /* files over 4GB (SFAT_ATTR_LARGE entries), */
+                                            /* which have no creation time on disk */
+
+
 
 /* sfat's attribute */
 #define SFAT_ATTR_NONE   0   /* no attribute bits */
@@ -41,7 +61,9 @@
 //#define ATTR_HIDDEN 2   /* hidden */
 //#define ATTR_SYS    4   /* system */
 //#define ATTR_VOLUME 8   /* volume label */
+#define SFAT_ATTR_LARGE  8   /* file over 4GB, see struct sfat_dir_entry_large */
 #define SFAT_ATTR_DIR    16  /* directory */
+#define SFAT_ATTR_HASHED 32  /* directory in hashed (v2) layout */
 #define SFAT_ATTR_EMPTY    64  /* this entry is free */
 #define SFAT_ATTR_EMPTY_END    128  /* this entry and the rest entries are free */
 //#define ATTR_ARCH   32  /* archived */
@@ -60,6 +82,66 @@
  * ioctl commands
  */
 #define SFAT_IOCTL_TEST	_IO('r', 0x20)
+#define SFAT_IOCTL_GET_STATS	_IOR('r', 0x21, struct sfat_ioctl_stats)
+#define SFAT_IOCTL_CREATE_BATCH	_IOWR('r', 0x22, struct sfat_ioctl_batch)
+
+/*
+ * counters of a mounted volume, returned by SFAT_IOCTL_GET_STATS on any
+ * file or directory of it
+ * The counters run from mount on. The struct has a fixed size since _IOR
+ * puts it into the command number: new fields take the place of reserved
+ * ones and raise the version, so a tool can tell which fields are valid
+ * (all of its own version and below).
+ * average chain length walked = chain_hop / chain_walk
+ */
+#define SFAT_STATS_VERSION 1
+
+struct sfat_ioctl_stats {
+    __u32   version;        /* SFAT_STATS_VERSION */
+    __u32   size;           /* sizeof(struct sfat_ioctl_stats) of the kernel */
+
+    __u64   blk_read;       /* blocks read from the device */
+    __u64   blk_write;      /* blocks written to the device */
+    __u64   cache_hit;      /* metadata blocks found in the cache */
+    __u64   cache_miss;     /* metadata blocks read into the cache */
+    __u64   cls_alloc;      /* clusters allocated */
+    __u64   read_bytes;     /* bytes read from files */
+    __u64   write_bytes;    /* bytes written to files */
+    __u64   chain_walk;     /* walks along cluster chains */
+    __u64   chain_hop;      /* clusters moved over by those walks */
+
+    __u64   free_clusters;  /* free clusters now */
+    __u64   clusters;       /* clusters of the data area */
+    __u64   cluster_size;   /* bytes per cluster */
+
+    __u64   reserved[19];   /* 0, room for new fields (256 bytes in all) */
+};
+
+/*
+ * files created by SFAT_IOCTL_CREATE_BATCH on a directory in one
+ * operation: one scan of the directory, the entries put into consecutive
+ * free slots (the directory grows by as many clusters as needed at once),
+ * the data clusters allocated as one run and written by large bios.
+ * Each file gets its own result, the others are created anyway
+ * (-EEXIST for a name taken already or given twice). Names are cut to
+ * SFAT_NAME_LEN like for open(2).
+ */
+#define SFAT_BATCH_MAX_FILES  1024       /* most files per call */
+#define SFAT_BATCH_MAX_DATA   (4 << 20)  /* most bytes of contents per call */
+#define SFAT_BATCH_NAME_LEN   32
+
+struct sfat_batch_file {
+    char    name[SFAT_BATCH_NAME_LEN];  /* ended by '\0' */
+    __u64   data;           /* address of the initial contents, 0 => none */
+    __u32   size;           /* no. of bytes at data */
+    __s32   error;          /* out: 0 or a negative errno for this file */
+};
+
+struct sfat_ioctl_batch {
+    __u64   files;          /* address of count struct sfat_batch_file */
+    __u32   count;
+    __u32   created;        /* out: no. of files created */
+};
 
 /*
  * | head (1 sector) | reserved area (multiple sectors) | fat area (multiple sectors X 2) | data area |
@@ -89,6 +171,64 @@ struct sfat_boot_sector {
     __le32  root_start;           /* cluster no. of the root directory */
     __le32  root_size;           /* size of the root directory in cluster */
     __le32  freelist;       /* cluster no. of the free list */  // todo This one is useless.
+
+    // the following items are only valid with SFAT_BOOT_SIGNATURE
+    __le32  signature;      /* SFAT_BOOT_SIGNATURE */
+    __u8    version;        /* on-disk format version */
+    // the following items are only valid for version >= SFAT_FORMAT_V2
+    __le32  features;       /* SFAT_FEATURE_XXX */
+    __le16  root_buckets;   /* no. of hash buckets the root directory starts with */
+                            /* 0 => root is a linear directory */
+    // only valid with SFAT_FEATURE_JOURNAL
+    __le32  journal_start;  /* first sector of the journal (in the reserved area) */
+    __le32  journal_length; /* no. of sectors of the journal */
+}__attribute__((__packed__));
+
+/*
+ * Metadata journal (SFAT_FEATURE_JOURNAL)
+ *
+ * | journal super block | log ... |
+ *
+ * The journal is counted in blocks of the volume. A transaction in the log
+ * is one or more descriptor blocks, each followed by the blocks it lists,
+ * and a commit block:
+ *
+ * | desc (n block nos) | n blocks | desc | ... | commit |
+ *
+ * The log always starts at block 1 with the transaction whose seq is in
+ * the super block, seq goes up by one per transaction. A transaction
+ * counts only if its commit block is there with the right seq and crc32
+ * (over its descriptor and logged blocks), so one flush after writing it
+ * is enough. Replaying the log writes the logged blocks to their places
+ * in order; older transactions are replayed again, which does no harm.
+ * SFAT_JOURNAL_CLEAN in the super block means nothing needs replay.
+ */
+#define SFAT_JOURNAL_MAGIC   0x4c4a4653  /* "SFJL" */
+
+#define SFAT_JOURNAL_SUPER   1
+#define SFAT_JOURNAL_DESC    2
+#define SFAT_JOURNAL_COMMIT  3
+
+#define SFAT_JOURNAL_CLEAN   0x00000001  /* sfat_journal_super.flags */
+
+/* smallest journal accepted, in blocks */
+#define SFAT_JOURNAL_MIN_BLOCKS  64
+
+struct sfat_journal_header {
+    __le32  magic;          /* SFAT_JOURNAL_MAGIC */
+    __le32  type;           /* SFAT_JOURNAL_XXX */
+    __le32  seq;            /* transaction (super block: first one of the log) */
+    __le32  count;          /* desc: no. of block nos following, commit: crc32 */
+}__attribute__((__packed__));
+
+struct sfat_journal_super {
+    struct sfat_journal_header h;
+    __le32  flags;          /* SFAT_JOURNAL_CLEAN */
+}__attribute__((__packed__));
+
+struct sfat_journal_desc {
+    struct sfat_journal_header h;
+    __le32  blk[0];         /* where the following blocks belong */
 }__attribute__((__packed__));
 
 struct sfat_dir_entry {  // 32 bytes
@@ -105,6 +245,95 @@ struct sfat_dir_entry {  // 32 bytes
 	__le32  fst_cls_no;  // first cluster no.  If size == 0, then this is SFAT_ENTRY_FREE(0)
 }__attribute__((__packed__));
 
+/*
+ * Extended entry of a regular file over 4GB (SFAT_ATTR_LARGE, only with
+ * SFAT_FEATURE_LARGEFILE). The same slot as struct sfat_dir_entry, the
+ * creation time gives way to the high 32 bits of the size. It is lost once
+ * a file grows over 4GB and doesn't come back if it shrinks again: ctime
+ * of such a file reads as its write time (mtime) after the next iget.
+ */
+struct sfat_dir_entry_large {  // 32 bytes
+	__u8    name[11];
+	__u8    attr;  // SFAT_ATTR_LARGE is set
+
+	__le32  size_hi;  // size >> 32
+	__le32  lst_acc_time;
+	__le32  wrt_time;
+
+	__le32  size;  // size & 0xffffffff
+	__le32  fst_cls_no;
+}__attribute__((__packed__));
+
+/*
+ * Hashed directory (SFAT_ATTR_HASHED, v2 format)
+ *
+ * | index chain | bucket 0 chain | bucket 1 chain | ... |
+ *
+ * The chain of the directory (fst_cls_no) holds its index: struct
+ * sfat_dir_index, the table of buckets going on over as many blocks and
+ * clusters of the chain as it needs. The rest of the chain is unused.
+ * Every bucket is an ordinary linear directory chain (terminated by
+ * SFAT_ATTR_EMPTY_END) and a name always lives in bucket
+ * sfat_dir_bucket(sfat_name_hash(name), buckets), so each bucket holds a
+ * range of the top SFAT_DIR_HASH_BITS bits of the hash.
+ *
+ * The no. of buckets follows the size of the directory: when a bucket
+ * outgrows its first cluster, the driver copies the directory into new
+ * chains with about one bucket per half cluster of entries (up to
+ * SFAT_DIR_MAX_BUCKETS) and frees the old ones. A linear subdirectory is
+ * converted the same way once it is a few clusters long. So a lookup
+ * takes its bucket from the index in memory and reads about one block.
+ * The root has no entry to carry SFAT_ATTR_HASHED: it is hashed if format
+ * made it so (then it keeps its index in place and only the buckets
+ * move), otherwise it stays linear.
+ */
+#define SFAT_DIR_INDEX_MAGIC  0x32484653  /* "SFH2" */
+
+/* the index takes at most 64K (plus its header) */
+#define SFAT_DIR_MAX_BUCKETS  16384
+
+/* bits of the hash which choose the bucket */
+#define SFAT_DIR_HASH_BITS  22
+
+struct sfat_dir_index {
+    __le32  magic;          /* SFAT_DIR_INDEX_MAGIC */
+    __le32  buckets;        /* no. of buckets */
+    __le32  bucket[0];      /* first cluster of each bucket */
+}__attribute__((__packed__));
+
+/* no. of bytes of the index of a directory with n buckets */
+#define SFAT_DIR_INDEX_SIZE(n)  (sizeof(struct sfat_dir_index) + (n) * sizeof(__le32))
+
+/*
+ * Desc: hash of a name as stored in sfat_dir_entry.name (FNV-1a)
+ *   This decides the bucket on disk, so it must never change.
+ * In:
+ *   name: SFAT_NAME_LEN bytes, padded by '\0'
+ */
+static inline __u32 sfat_name_hash(const __u8 *name)
+{
+    __u32 hash = 2166136261U;
+    int i = 0;
+
+    for (i = 0; i < SFAT_NAME_LEN && name[i]; ++i)
+    {
+        hash ^= name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Desc: the bucket of a name whose hash is hash, in a directory with
+ *   buckets buckets. Buckets cover the top SFAT_DIR_HASH_BITS of the hash
+ *   in ascending ranges, so readdir can go through them in hash order.
+ */
+static inline __u32 sfat_dir_bucket(__u32 hash, __u32 buckets)
+{
+    return (__u32)(((__u64)(hash >> (32 - SFAT_DIR_HASH_BITS)) * buckets)
+            >> SFAT_DIR_HASH_BITS);
+}
+
 
 
 #endif
@@ -0,0 +1,198 @@
+/*
+ * sfat_trace.h
+ *
+ *  Static tracepoints of simplefat, off unless enabled at runtime, e.g.
+ *  echo 1 > /sys/kernel/debug/tracing/events/simplefat/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplefat
+
+#if !defined(_SFAT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SFAT_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+#include "sfat_fs.h"
+
+TRACE_EVENT(sfat_block_io,
+
+    TP_PROTO(struct super_block *sb, int rw, size_t blk_no),
+
+    TP_ARGS(sb, rw, blk_no),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(int, rw)
+        __field(size_t, blk_no)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->rw = rw;
+        __entry->blk_no = blk_no;
+    ),
+
+    TP_printk("dev %d,%d %s blk %zu",
+        MAJOR(__entry->dev), MINOR(__entry->dev),
+        (__entry->rw & WRITE) ? "write" : "read", __entry->blk_no)
+);
+
+TRACE_EVENT(sfat_fat_get,
+
+    TP_PROTO(struct super_block *sb, size_t cls, size_t next),
+
+    TP_ARGS(sb, cls, next),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(size_t, cls)
+        __field(size_t, next)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->cls = cls;
+        __entry->next = next;
+    ),
+
+    TP_printk("dev %d,%d cls %zu next %zx",
+        MAJOR(__entry->dev), MINOR(__entry->dev),
+        __entry->cls, __entry->next)
+);
+
+TRACE_EVENT(sfat_fat_set,
+
+    TP_PROTO(struct super_block *sb, size_t cls, u32 value),
+
+    TP_ARGS(sb, cls, value),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(size_t, cls)
+        __field(u32, value)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->cls = cls;
+        __entry->value = value;
+    ),
+
+    TP_printk("dev %d,%d cls %zu value %x",
+        MAJOR(__entry->dev), MINOR(__entry->dev),
+        __entry->cls, __entry->value)
+);
+
+TRACE_EVENT(sfat_alloc,
+
+    TP_PROTO(struct super_block *sb, size_t cls, unsigned long group,
+        unsigned long group_free),
+
+    TP_ARGS(sb, cls, group, group_free),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(size_t, cls)
+        __field(unsigned long, group)
+        __field(unsigned long, group_free)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->cls = cls;
+        __entry->group = group;
+        __entry->group_free = group_free;
+    ),
+
+    TP_printk("dev %d,%d cls %zu group %lu free %lu",
+        MAJOR(__entry->dev), MINOR(__entry->dev),
+        __entry->cls, __entry->group, __entry->group_free)
+);
+
+TRACE_EVENT(sfat_lookup,
+
+    TP_PROTO(struct inode *dir, const unsigned char *name, int error),
+
+    TP_ARGS(dir, name, error),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __array(char, name, SFAT_NAME_LEN + 1)
+        __field(int, error)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        memcpy(__entry->name, name, SFAT_NAME_LEN);
+        __entry->name[SFAT_NAME_LEN] = '\0';
+        __entry->error = error;
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s error %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev),
+        (unsigned long)__entry->dir, __entry->name, __entry->error)
+);
+
+TRACE_EVENT(sfat_readdir,
+
+    TP_PROTO(struct inode *dir, loff_t pos),
+
+    TP_ARGS(dir, pos),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(loff_t, pos)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->pos = pos;
+    ),
+
+    TP_printk("dev %d,%d dir %lu pos %lld",
+        MAJOR(__entry->dev), MINOR(__entry->dev),
+        (unsigned long)__entry->dir, __entry->pos)
+);
+
+TRACE_EVENT(sfat_write,
+
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, size_t written),
+
+    TP_ARGS(inode, pos, len, written),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(size_t, written)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->len = len;
+        __entry->written = written;
+    ),
+
+    TP_printk("dev %d,%d ino %lu pos %lld len %zu written %zu",
+        MAJOR(__entry->dev), MINOR(__entry->dev),
+        (unsigned long)__entry->ino, __entry->pos,
+        __entry->len, __entry->written)
+);
+
+#endif /* _SFAT_TRACE_H */
+
+/* the header is in the directory of the module, see CFLAGS_stats.o */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sfat_trace
+#include <trace/define_trace.h>
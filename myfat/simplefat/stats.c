@@ -0,0 +1,498 @@
+/*
+ * stats.c
+ *
+ *  Per-mount counters and their debugfs files.
+ */
+
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "sfat.h"
+#include "stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "sfat_trace.h"
+
+/* names shown in the stats file, in the order of enum sfat_stat_item */
+static const char *sfat_stat_names[SFAT_STAT_NR] = {
+    "blk_read",
+    "blk_write",
+    "fat_lookup",
+    "cls_alloc",
+    "fat_scan_blk",
+    "dir_scan",
+    "dirent_visit",
+    "chain_hop",
+    "readdir",
+    "cache_hit",
+    "cache_miss",
+    "chain_walk",
+    "read_bytes",
+    "write_bytes",
+    "wb_bio",
+    "wb_run",
+    "jnl_commit",
+    "jnl_blocks",
+    "jnl_replay",
+    "batch_file",
+    "cls_free",
+};
+
+/* names shown in the latency file, in the order of enum sfat_lat_item */
+static const char *sfat_lat_names[SFAT_LAT_NR] = {
+    "blk_read",
+    "blk_write",
+    "lookup",
+    "create",
+    "readdir",
+    "read",
+    "write",
+};
+
+/* /sys/kernel/debug/simplefat, NULL if debugfs is not available */
+static struct dentry *sfat_debugfs_root = NULL;
+
+/*
+ * return: 0 => success
+ *         -ENOMEM
+ */
+int sfat_stats_init(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+
+    sbi->stats = alloc_percpu(struct sfat_stats);
+    if (!sbi->stats)
+    {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void sfat_stats_destroy(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+
+    free_percpu(sbi->stats);
+    sbi->stats = NULL;
+}
+
+/*
+ * Desc: add up the counters of all cpus
+ *   The result is not an atomic snapshot, which is fine for monitoring.
+ */
+unsigned long sfat_stat_sum(struct super_block *sb, enum sfat_stat_item item)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    unsigned long sum = 0;
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu) {
+        sum += per_cpu_ptr(sbi->stats, cpu)->count[item];
+    }
+    return sum;
+}
+
+/*
+ * Desc: SFAT_IOCTL_GET_STATS, copy the counters of the volume to user space
+ * In:
+ *   arg: struct sfat_ioctl_stats in user space
+ * Return:
+ *   0: success
+ *   -EFAULT
+ */
+int sfat_ioctl_get_stats(struct super_block *sb, void __user *arg)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_ioctl_stats st;
+
+    memset(&st, 0, sizeof(st));
+    st.version = SFAT_STATS_VERSION;
+    st.size = sizeof(st);
+
+    st.blk_read = sfat_stat_sum(sb, SFAT_STAT_BLK_READ);
+    st.blk_write = sfat_stat_sum(sb, SFAT_STAT_BLK_WRITE);
+    st.cache_hit = sfat_stat_sum(sb, SFAT_STAT_CACHE_HIT);
+    st.cache_miss = sfat_stat_sum(sb, SFAT_STAT_CACHE_MISS);
+    st.cls_alloc = sfat_stat_sum(sb, SFAT_STAT_CLS_ALLOC);
+    st.read_bytes = sfat_stat_sum(sb, SFAT_STAT_READ_BYTES);
+    st.write_bytes = sfat_stat_sum(sb, SFAT_STAT_WRITE_BYTES);
+    st.chain_walk = sfat_stat_sum(sb, SFAT_STAT_CHAIN_WALK);
+    st.chain_hop = sfat_stat_sum(sb, SFAT_STAT_CHAIN_HOP);
+
+    st.free_clusters = sfat_free_clusters(sbi);
+    st.clusters = sbi->fs_info.clusters;
+    st.cluster_size = sbi->fs_info.cluster_size;
+
+    if (copy_to_user(arg, &st, sizeof(st)))
+    {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/*
+ * Desc: clear the latency histograms of all cpus
+ *   Operations finishing meanwhile may be lost or kept, which doesn't
+ *   matter for a histogram.
+ */
+void sfat_lat_reset(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(sbi->stats, cpu)->lat, 0,
+               sizeof(per_cpu_ptr(sbi->stats, cpu)->lat));
+    }
+}
+
+/*
+ * one block per operation: "<name> total <n>", followed by one line
+ * "<from>-<to> ns <count>" for every bucket which isn't empty
+ */
+static int sfat_lat_show(struct seq_file *m, void *v)
+{
+    struct super_block *sb = m->private;
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    unsigned long hist[SFAT_LAT_BUCKETS];
+    unsigned long total = 0;
+    int cpu = 0;
+    int i, b = 0;
+
+    for (i = 0; i < SFAT_LAT_NR; ++i)
+    {
+        memset(hist, 0, sizeof(hist));
+        total = 0;
+        for_each_possible_cpu(cpu) {
+            for (b = 0; b < SFAT_LAT_BUCKETS; ++b)
+            {
+                hist[b] += per_cpu_ptr(sbi->stats, cpu)->lat[i][b];
+            }
+        }
+        for (b = 0; b < SFAT_LAT_BUCKETS; ++b)
+        {
+            total += hist[b];
+        }
+
+        seq_printf(m, "%s total %lu\n", sfat_lat_names[i], total);
+        for (b = 0; b < SFAT_LAT_BUCKETS; ++b)
+        {
+            if (!hist[b])
+                continue;
+            if (b == SFAT_LAT_BUCKETS - 1)
+                seq_printf(m, "  %llu- ns %lu\n", 1ULL << b, hist[b]);
+            else
+                seq_printf(m, "  %llu-%llu ns %lu\n", 1ULL << b, (1ULL << (b + 1)) - 1, hist[b]);
+        }
+    }
+    return 0;
+}
+
+static int sfat_lat_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sfat_lat_show, inode->i_private);
+}
+
+/*
+ * writing anything to the file resets the histograms
+ */
+static ssize_t sfat_lat_write(struct file *file, const char __user *buf,
+                              size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+
+    sfat_lat_reset(m->private);
+    return count;
+}
+
+static const struct file_operations sfat_lat_fops = {
+    .owner      = THIS_MODULE,
+    .open       = sfat_lat_open,
+    .read       = seq_read,
+    .write      = sfat_lat_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+/*
+ * Desc: set up the heatmap of a volume whose layout (fs_info) is known
+ *   The heatmap only serves monitoring, the volume is mounted without it
+ *   if there is no memory.
+ */
+void sfat_heatmap_init(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs = &sbi->fs_info;
+    struct sfat_heatmap *hm = NULL;
+    unsigned long data_blks = 0;
+    unsigned int shift = 0;
+    unsigned long nr_data = 0;
+    unsigned long nr = 0;
+
+    shift = SFAT_HEAT_DATA_SHIFT > fs->block_bits? SFAT_HEAT_DATA_SHIFT - fs->block_bits: 0;
+    data_blks = fs->clusters << (fs->cluster_bits - fs->block_bits);
+    nr_data = (data_blks + (1UL << shift) - 1) >> shift;
+    nr = 3 + (fs->data_start_blk - fs->fat_start_blk) + nr_data;
+
+    hm = vmalloc(sizeof(*hm) + 2 * nr * sizeof(atomic_long_t));
+    if (!hm)
+    {
+        printk(KERN_INFO "sfat: no heatmap for %s\n", sb->s_id);
+        sbi->heat = NULL;
+        return;
+    }
+    hm->fat_start = fs->fat_start_blk;
+    hm->nr_fat = fs->data_start_blk - fs->fat_start_blk;
+    hm->root_start = CLS_TO_BLK(fs, fs->root_cluster_cls);
+    hm->root_end = hm->root_start + (sbi->root_size << (fs->cluster_bits - fs->block_bits));
+    hm->data_start = fs->data_start_blk;
+    hm->data_shift = shift;
+    hm->nr = nr;
+    memset(hm->cnt, 0, 2 * nr * sizeof(atomic_long_t));
+
+    sbi->heat = hm;
+}
+
+void sfat_heatmap_destroy(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+
+    vfree(sbi->heat);
+    sbi->heat = NULL;
+}
+
+/*
+ * Desc: count a block access in the region of the block
+ * In:
+ *   write: 0 => read, 1 => write
+ */
+void sfat_heat_account(struct super_block *sb, size_t blk_no, int write)
+{
+    struct sfat_heatmap *hm = SFAT_SB(sb)->heat;
+    unsigned long r = 0;
+
+    if (!hm)  // not set up yet (boot sector at mount)
+    {
+        return;
+    }
+
+    if (0 == blk_no)
+    {
+        r = 0;
+    }
+    else if (blk_no < hm->fat_start)
+    {
+        r = 1;
+    }
+    else if (blk_no < hm->data_start)
+    {
+        r = 2 + (blk_no - hm->fat_start);
+    }
+    else if (blk_no >= hm->root_start && blk_no < hm->root_end)
+    {
+        r = 2 + hm->nr_fat;
+    }
+    else
+    {
+        r = 3 + hm->nr_fat + ((blk_no - hm->data_start) >> hm->data_shift);
+        if (r >= hm->nr)
+        {
+            r = hm->nr - 1;
+        }
+    }
+    atomic_long_inc(&hm->cnt[r * 2 + write]);
+}
+
+void sfat_heat_reset(struct super_block *sb)
+{
+    struct sfat_heatmap *hm = SFAT_SB(sb)->heat;
+    unsigned long i = 0;
+
+    if (!hm)
+    {
+        return;
+    }
+    for (i = 0; i < 2 * hm->nr; ++i)
+    {
+        atomic_long_set(&hm->cnt[i], 0);
+    }
+}
+
+/*
+ * one line "<region> <index> <first blk>-<last blk> <reads> <writes>" for
+ * every region which has been accessed, the index counts FAT blocks and
+ * MBs of the data area
+ */
+static int sfat_heat_show(struct seq_file *m, void *v)
+{
+    struct super_block *sb = m->private;
+    struct sfat_heatmap *hm = SFAT_SB(sb)->heat;
+    unsigned long r = 0;
+    unsigned long rd, wr = 0;
+    unsigned long first, last = 0;
+    unsigned long idx = 0;
+    const char *name = NULL;
+
+    if (!hm)
+    {
+        return 0;
+    }
+
+    seq_printf(m, "region index blocks reads writes\n");
+    for (r = 0; r < hm->nr; ++r)
+    {
+        rd = atomic_long_read(&hm->cnt[r * 2]);
+        wr = atomic_long_read(&hm->cnt[r * 2 + 1]);
+        if (!rd && !wr)
+        {
+            continue;
+        }
+
+        if (0 == r)
+        {
+            name = "boot";
+            idx = 0;
+            first = last = 0;
+        }
+        else if (1 == r)
+        {
+            name = "reserved";
+            idx = 0;
+            first = 1;
+            last = hm->fat_start - 1;
+        }
+        else if (r < 2 + hm->nr_fat)
+        {
+            name = "fat";
+            idx = r - 2;
+            first = last = hm->fat_start + idx;
+        }
+        else if (r == 2 + hm->nr_fat)
+        {
+            name = "root";
+            idx = 0;
+            first = hm->root_start;
+            last = hm->root_end - 1;
+        }
+        else
+        {
+            name = "data";
+            idx = r - 3 - hm->nr_fat;
+            first = hm->data_start + (idx << hm->data_shift);
+            last = first + (1UL << hm->data_shift) - 1;
+        }
+        seq_printf(m, "%s %lu %lu-%lu %lu %lu\n", name, idx, first, last, rd, wr);
+    }
+    return 0;
+}
+
+static int sfat_heat_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sfat_heat_show, inode->i_private);
+}
+
+/*
+ * writing anything to the file resets the heatmap
+ */
+static ssize_t sfat_heat_write(struct file *file, const char __user *buf,
+                               size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+
+    sfat_heat_reset(m->private);
+    return count;
+}
+
+static const struct file_operations sfat_heat_fops = {
+    .owner      = THIS_MODULE,
+    .open       = sfat_heat_open,
+    .read       = seq_read,
+    .write      = sfat_heat_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static int sfat_stats_show(struct seq_file *m, void *v)
+{
+    struct super_block *sb = m->private;
+    int i = 0;
+
+    for (i = 0; i < SFAT_STAT_NR; ++i)
+    {
+        seq_printf(m, "%s %lu\n", sfat_stat_names[i], sfat_stat_sum(sb, i));
+    }
+    return 0;
+}
+
+static int sfat_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sfat_stats_show, inode->i_private);
+}
+
+static const struct file_operations sfat_stats_fops = {
+    .owner      = THIS_MODULE,
+    .open       = sfat_stats_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+/*
+ * Desc: create the top directory of the module
+ *   The file system works without debugfs, so a failure is only reported.
+ */
+int __init sfat_debugfs_init(void)
+{
+    sfat_debugfs_root = debugfs_create_dir("simplefat", NULL);
+    if (IS_ERR(sfat_debugfs_root) || !sfat_debugfs_root)
+    {
+        printk(KERN_INFO "sfat: debugfs is not available\n");
+        sfat_debugfs_root = NULL;
+    }
+    return 0;
+}
+
+void sfat_debugfs_exit(void)
+{
+    debugfs_remove_recursive(sfat_debugfs_root);
+    sfat_debugfs_root = NULL;
+}
+
+/*
+ * Desc: create the directory of a mounted volume, named after its device
+ */
+void sfat_debugfs_mount(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct dentry *dir = NULL;
+
+    sbi->debugfs_dir = NULL;
+    if (!sfat_debugfs_root)
+    {
+        return;
+    }
+
+    dir = debugfs_create_dir(sb->s_id, sfat_debugfs_root);
+    if (IS_ERR(dir) || !dir)
+    {
+        printk(KERN_INFO "sfat: no debugfs directory for %s\n", sb->s_id);
+        return;
+    }
+    debugfs_create_file("stats", S_IRUGO, dir, sb, &sfat_stats_fops);
+    debugfs_create_file("latency", S_IRUGO | S_IWUSR, dir, sb, &sfat_lat_fops);
+    debugfs_create_file("heatmap", S_IRUGO | S_IWUSR, dir, sb, &sfat_heat_fops);
+    sbi->debugfs_dir = dir;
+}
+
+void sfat_debugfs_umount(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+
+    debugfs_remove_recursive(sbi->debugfs_dir);
+    sbi->debugfs_dir = NULL;
+}
@@ -0,0 +1,158 @@
+/*
+ * stats.h
+ *
+ *  Per-mount counters of I/O and allocation. The counters are per-cpu,
+ *  so counting takes neither a lock nor a shared cache line. They are
+ *  summed up when read through debugfs
+ *  (/sys/kernel/debug/simplefat/<dev>/stats, latency and heatmap).
+ */
+
+#ifndef __SFAT_STATS_H
+#define __SFAT_STATS_H
+
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+#include "sfat.h"
+
+enum sfat_stat_item {
+    SFAT_STAT_BLK_READ,       /* blocks read from the device */
+    SFAT_STAT_BLK_WRITE,      /* blocks written to the device */
+    SFAT_STAT_FAT_LOOKUP,     /* FAT entries looked up */
+    SFAT_STAT_CLS_ALLOC,      /* clusters allocated */
+    SFAT_STAT_FAT_SCAN_BLK,   /* FAT blocks scanned for a free cluster */
+    SFAT_STAT_DIR_SCAN,       /* directory scans for a name or a free entry */
+    SFAT_STAT_DIRENT_VISIT,   /* directory entries examined by the scans */
+    SFAT_STAT_CHAIN_HOP,      /* moves to the next cluster of a chain */
+    SFAT_STAT_READDIR,        /* calls of readdir */
+    SFAT_STAT_CACHE_HIT,      /* metadata blocks found in the cache */
+    SFAT_STAT_CACHE_MISS,     /* metadata blocks read into the cache */
+    SFAT_STAT_CHAIN_WALK,     /* walks along a chain (see SFAT_STAT_CHAIN_HOP) */
+    SFAT_STAT_READ_BYTES,     /* bytes returned by read */
+    SFAT_STAT_WRITE_BYTES,    /* bytes accepted by write */
+    SFAT_STAT_WB_BIO,         /* bios of sfat_write_blocks (merged block writes) */
+    SFAT_STAT_WB_RUN,         /* runs of the background writeback */
+    SFAT_STAT_JNL_COMMIT,     /* transactions committed to the journal */
+    SFAT_STAT_JNL_BLOCKS,     /* metadata blocks logged in the journal */
+    SFAT_STAT_JNL_REPLAY,     /* blocks written by the replay of the journal at mount */
+    SFAT_STAT_BATCH_FILE,     /* files created by SFAT_IOCTL_CREATE_BATCH */
+    SFAT_STAT_CLS_FREE,       /* clusters freed */
+    SFAT_STAT_NR,
+};
+
+/* latency histograms */
+enum sfat_lat_item {
+    SFAT_LAT_BLK_READ,        /* read_block, submit to completion */
+    SFAT_LAT_BLK_WRITE,       /* write_block, submit to completion */
+    SFAT_LAT_LOOKUP,
+    SFAT_LAT_CREATE,
+    SFAT_LAT_READDIR,
+    SFAT_LAT_READ,
+    SFAT_LAT_WRITE,
+    SFAT_LAT_NR,
+};
+
+/* bucket b counts latencies in [2^b, 2^(b+1)) ns, the last one takes the rest */
+#define SFAT_LAT_BUCKETS 32
+
+struct sfat_stats {
+    unsigned long count[SFAT_STAT_NR];
+    unsigned long lat[SFAT_LAT_NR][SFAT_LAT_BUCKETS];
+};
+
+static inline void sfat_stat_add(struct super_block *sb, enum sfat_stat_item item,
+                                 unsigned long n)
+{
+    struct sfat_stats *st = per_cpu_ptr(SFAT_SB(sb)->stats, get_cpu());
+
+    st->count[item] += n;
+    put_cpu();
+}
+
+static inline void sfat_stat_inc(struct super_block *sb, enum sfat_stat_item item)
+{
+    sfat_stat_add(sb, item, 1);
+}
+
+/*
+ * Desc: start timing an operation
+ * Return: the start time to be passed to sfat_lat_end
+ */
+static inline u64 sfat_lat_start(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+/*
+ * Desc: account the time since start in the histogram of item
+ */
+static inline void sfat_lat_end(struct super_block *sb, enum sfat_lat_item item, u64 start)
+{
+    u64 ns = ktime_to_ns(ktime_get()) - start;
+    unsigned int b = ns? ilog2(ns): 0;
+    struct sfat_stats *st = NULL;
+
+    if (b >= SFAT_LAT_BUCKETS)
+    {
+        b = SFAT_LAT_BUCKETS - 1;
+    }
+
+    st = per_cpu_ptr(SFAT_SB(sb)->stats, get_cpu());
+    ++st->lat[item][b];
+    put_cpu();
+}
+
+/*
+ * block-access heatmap
+ *
+ * | boot | reserved | FAT block 0 | ... | FAT block n-1 | root dir | data 1MB | data 1MB | ... |
+ *
+ * Every FAT block (of all the copies) is a region of its own, the root
+ * directory (its initial clusters) is one region, the rest of the data area
+ * is cut into regions of 1MB. Each region counts reads and writes.
+ * The counters are shared by all cpus, which is cheap compared with the
+ * block I/O they count.
+ */
+#define SFAT_HEAT_DATA_SHIFT 20  /* log2 of the size of a data region */
+
+struct sfat_heatmap {
+    unsigned long fat_start;    /* first FAT block */
+    unsigned long nr_fat;       /* no. of FAT blocks */
+    unsigned long root_start;   /* blocks of the root directory, [start, end) */
+    unsigned long root_end;
+    unsigned long data_start;   /* first block of the data area */
+    unsigned int data_shift;    /* log2 of blocks per data region */
+    unsigned long nr;           /* no. of regions */
+    atomic_long_t cnt[0];       /* [region * 2]: reads, [region * 2 + 1]: writes */
+};
+
+int sfat_stats_init(struct super_block *sb);
+
+void sfat_stats_destroy(struct super_block *sb);
+
+unsigned long sfat_stat_sum(struct super_block *sb, enum sfat_stat_item item);
+
+void sfat_lat_reset(struct super_block *sb);
+
+void sfat_heatmap_init(struct super_block *sb);
+
+void sfat_heatmap_destroy(struct super_block *sb);
+
+void sfat_heat_account(struct super_block *sb, size_t blk_no, int write);
+
+void sfat_heat_reset(struct super_block *sb);
+
+int sfat_ioctl_get_stats(struct super_block *sb, void __user *arg);
+
+int sfat_debugfs_init(void);
+
+void sfat_debugfs_exit(void);
+
+void sfat_debugfs_mount(struct super_block *sb);
+
+void sfat_debugfs_umount(struct super_block *sb);
+
+#endif
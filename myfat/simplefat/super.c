@@ -28,6 +28,14 @@
 #include "super.h"
 #include "io.h"
 #include "inode.h"
+#include "cache.h"
+#include "stats.h"
+#include "journal.h"
+
+static void sfat_put_super(struct super_block *sb);
+static void sfat_write_super(struct super_block *sb);
+static int sfat_sync_fs(struct super_block *sb, int wait);
+static int sfat_statfs(struct dentry *dentry, struct kstatfs *buf);
 
 static const struct super_operations sfat_sops = {
     // callback for allocating memory for inode
@@ -37,16 +45,28 @@ static const struct super_operations sfat_sops = {
     .destroy_inode  = sfat_destroy_inode,
 
 
-//    .write_inode    = sfat_write_inode,
+    // callback for writing back the directory entry of a dirty inode
+    .write_inode    = sfat_write_inode,
+
+    // callback when the inode is marked dirty
+    .dirty_inode    = sfat_dirty_inode,
 
     // callback when the inode needs to be deleted.
     // (User deletes the file.)
     // Must call clear_inode in the end of this function
     .delete_inode   = sfat_delete_inode,
-//    .put_super      = sfat_put_super,
-//    .write_super    = sfat_write_super,
-//    .sync_fs        = sfat_sync_fs,
-//    .statfs         = sfat_statfs,
+
+    // callback when the volume is unmounted
+    .put_super      = sfat_put_super,
+
+    // callback for writing back dirty metadata periodically (sb->s_dirt)
+    .write_super    = sfat_write_super,
+
+    // callback for sync(2) and unmount
+    .sync_fs        = sfat_sync_fs,
+
+    // callback for df, served from the counters in sbi
+    .statfs         = sfat_statfs,
 
     // callback before destroy_inode
     .clear_inode    = sfat_clear_inode,
@@ -56,12 +76,83 @@ static const struct super_operations sfat_sops = {
 };
 
 
+enum {
+    Opt_noatime, Opt_relatime, Opt_wb_interval, Opt_wb_ratio, Opt_err,
+};
+
+static const match_table_t sfat_tokens = {
+    {Opt_noatime, "noatime"},
+    {Opt_relatime, "relatime"},
+    {Opt_wb_interval, "wb_interval=%u"},
+    {Opt_wb_ratio, "wb_ratio=%u"},
+    {Opt_err, NULL},
+};
+
+/*
+ * options: comma separated option string, modified in place
+ * return: 0 is success
+ *         -EINVAL for unknown option
+ */
 static int parse_options(char *options, int silent,
              struct sfat_mount_options *opts)
 {
+    char *p = NULL;
+    substring_t args[MAX_OPT_ARGS];
+    int token = 0;
+    int option = 0;
+
     opts->fs_uid = current_uid();
     opts->fs_gid = current_gid();
     opts->fs_fmask = opts->fs_dmask = current_umask();
+    opts->atime = SFAT_ATIME_RELATIME;
+    opts->wb_interval = SFAT_WB_INTERVAL_MS;
+    opts->wb_ratio = SFAT_WB_RATIO;
+
+    if (!options)
+    {
+        return 0;
+    }
+
+    while ((p = strsep(&options, ",")) != NULL)
+    {
+        if (!*p)
+        {
+            continue;
+        }
+        sfat_dbg(1, "sfat: parse_options: option is %s\n", p);
+
+        token = match_token(p, sfat_tokens, args);
+        switch (token)
+        {
+        case Opt_noatime:
+            opts->atime = SFAT_ATIME_NOATIME;
+            break;
+        case Opt_relatime:
+            opts->atime = SFAT_ATIME_RELATIME;
+            break;
+        case Opt_wb_interval:
+            if (match_int(&args[0], &option) || option < 0)
+            {
+                return -EINVAL;
+            }
+            opts->wb_interval = option;
+            break;
+        case Opt_wb_ratio:
+            if (match_int(&args[0], &option) || option < 1 || option > 100)
+            {
+                return -EINVAL;
+            }
+            opts->wb_ratio = option;
+            break;
+        default:
+            if (!silent)
+            {
+                printk(KERN_ERR "SFAT: Unrecognized mount option \"%s\" "
+                       "or missing value\n", p);
+            }
+            return -EINVAL;
+        }
+    }
 
     return 0;
 }
@@ -101,7 +192,7 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
 
     struct inode *root_inode = 0;
 
-    char *p = NULL;
+    int i = 0;
     // end of local variables definition
 
     minsize = bdev_logical_block_size(sb->s_bdev);
@@ -111,7 +202,7 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
     memset(buf, 0, BDEVNAME_SIZE);
     bdevname(bdev, buf);
     buf[BDEVNAME_SIZE-1] = '\0';
-    printk (KERN_INFO "sfat: sfat_fill_super_impl: device name is %s\n", buf);
+    sfat_dbg(1, "sfat: sfat_fill_super_impl: device name is %s\n", buf);
 
     bd_inode = bdev->bd_inode;
     if (!bd_inode)
@@ -127,22 +218,10 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
     size_inode = bd_inode->i_size;
 
     // just for fun
-    printk (KERN_INFO "sfat: sfat_fill_super_impl: blksz_bdev_logic = %u, "
+    sfat_dbg(1, "sfat: sfat_fill_super_impl: blksz_bdev_logic = %u, "
             "blksz_bdev = %u, blksz_super = %lu, blkbits_inode = %u, size_inode = %lld\n",
             (unsigned int)blksz_bdev_logic, blksz_bdev, blksz_super, blkbits_inode, size_inode);
 
-    if (data)
-    {
-        while ((p = strsep((char**)&data, ",")) != NULL)
-        {
-            if (!*p)
-            {
-                continue;
-            }
-            printk (KERN_INFO "sfat: sfat_fill_super_impl: option is %s\n", p);
-        }
-    }
-
     /*
      * GFP_KERNEL is ok here, because while we do hold the
      * supeblock lock, memory pressure can't call back into
@@ -165,10 +244,31 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
     sb->s_op = &sfat_sops;  // callback for matipulating meta-info of the whole file system as well as inodes
     sb->s_export_op = 0;  // &fat_export_ops;  // todo: Does 0 suffice?
 
+    for (i = 0; i < SFAT_RMW_LOCKS; ++i)
+    {
+        mutex_init(&sbi->rmw_lock[i]);
+    }
+    spin_lock_init(&sbi->inode_hash_lock);
+    seqcount_init(&sbi->inode_hash_seq);
+    for (i = 0; i < SFAT_HASH_SIZE; ++i)
+    {
+        INIT_HLIST_HEAD(&sbi->inode_hashtable[i]);
+    }
+    sfat_mcache_init(sb);
+
+    error = sfat_stats_init(sb);
+    if (error)
+        goto out_release_sbi;
+
     error = parse_options(data, silent, &sbi->options);
     if (error)
         goto out_release_sbi;
 
+    if (SFAT_ATIME_NOATIME == sbi->options.atime)
+    {
+        sb->s_flags |= MS_NOATIME;
+    }
+
     bh = sfat_blkholder_alloc();
     if (!bh)
     {
@@ -177,14 +277,14 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
         goto out_release_sbi;
     }
     
-    error = read_block(bdev, bh, sbi->fs_info.block_size, 0);
+    error = sfat_read_block(sb, bh, 0);
     if (error)
     {
         goto out_release_bh;
     }
 
     bs = (struct sfat_boot_sector *)sfat_blkholder_get_data(bh);
-    printk (KERN_INFO "sfat: sfat_fill_super_impl() media is 0x%x\n", bs->media);
+    sfat_dbg(1, "sfat: sfat_fill_super_impl() media is 0x%x\n", bs->media);
 
     media = bs->media;
     if (SFAT_MEDIA != media)
@@ -249,6 +349,98 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
 
     sbi->root_size = le32_to_cpu(bs->root_size);
 
+    // volumes formatted before v2 may have anything after root_size
+    fs_info->version = SFAT_FORMAT_V1;
+    if (le32_to_cpu(bs->signature) == SFAT_BOOT_SIGNATURE)
+    {
+        fs_info->version = bs->version;
+    }
+    if (fs_info->version < SFAT_FORMAT_V1 || fs_info->version > SFAT_FORMAT_V2)
+    {
+        if (!silent)
+        {
+            printk(KERN_ERR "SFAT: unsupported format version %u\n", fs_info->version);
+        }
+        error = -EINVAL;
+        goto out_release_bh;
+    }
+
+    if (fs_info->version >= SFAT_FORMAT_V2)
+    {
+        fs_info->features = le32_to_cpu(bs->features);
+    }
+    if (fs_info->features & ~SFAT_FEATURES_KNOWN)
+    {
+        if (!silent)
+        {
+            printk(KERN_ERR "SFAT: unsupported features 0x%lx\n",
+                    fs_info->features & ~SFAT_FEATURES_KNOWN);
+        }
+        error = -EINVAL;
+        goto out_release_bh;
+    }
+
+    // a file can't be longer than the data area, nor than the 32-bit size
+    // of its entry unless the volume has extended entries
+    sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE,
+            (loff_t)fs_info->clusters << fs_info->cluster_bits);
+    if (!(fs_info->features & SFAT_FEATURE_LARGEFILE))
+    {
+        sb->s_maxbytes = min_t(loff_t, sb->s_maxbytes, 0xffffffffLL);
+    }
+
+    if (fs_info->features & SFAT_FEATURE_HASHDIR)
+    {
+        // only tells whether root is hashed, its index says how many
+        // buckets it has by now
+        sbi->root_buckets = le16_to_cpu(bs->root_buckets);
+        if (sbi->root_buckets > SFAT_DIR_MAX_BUCKETS)
+        {
+            if (!silent)
+            {
+                printk(KERN_ERR "SFAT: bogus no. of root buckets %u\n", sbi->root_buckets);
+            }
+            error = -EINVAL;
+            goto out_release_bh;
+        }
+    }
+
+    if (fs_info->features & SFAT_FEATURE_JOURNAL)
+    {
+        u32 jstart = le32_to_cpu(bs->journal_start);
+        u32 jlen = le32_to_cpu(bs->journal_length);
+
+        if (jstart < 1 || jlen > reserved || jstart - 1 > reserved - jlen)
+        {
+            if (!silent)
+            {
+                printk(KERN_ERR "SFAT: journal (%u, %u) out of the reserved area\n", jstart, jlen);
+            }
+            error = -EINVAL;
+            goto out_release_bh;
+        }
+        // replayed before anything reads the FAT
+        error = sfat_journal_load(sb, SEC_2_BLK(jstart), SEC_2_BLK(jlen));
+        if (error)
+        {
+            goto out_release_bh;
+        }
+    }
+
+    error = sfat_count_free_clusters(sb);
+    if (error)
+    {
+        goto out_release_bh;
+    }
+
+    sfat_heatmap_init(sb);
+
+    error = sfat_mcache_wb_start(sb, sbi->options.wb_interval, sbi->options.wb_ratio);
+    if (error)
+    {
+        goto out_release_bh;
+    }
+
     // end of initialization of sbi
 
 
@@ -268,11 +460,11 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
         printk(KERN_INFO "SFAT: sfat_read_root failed, error is %d\n", error);
     	goto out_release_root;
     }
-    printk(KERN_INFO "SFAT: sfat_read_root 0030\n");
+    sfat_dbg(1, "SFAT: sfat_read_root 0030\n");
     insert_inode_hash(root_inode);
-    printk(KERN_INFO "SFAT: sfat_read_root 0040\n");
+    sfat_dbg(1, "SFAT: sfat_read_root 0040\n");
     sb->s_root = d_alloc_root(root_inode);
-    printk(KERN_INFO "SFAT: sfat_read_root 0050\n");
+    sfat_dbg(1, "SFAT: sfat_read_root 0050\n");
     if (!sb->s_root) 
     {
         error = -ENOMEM;
@@ -282,7 +474,8 @@ int sfat_fill_super_impl(struct super_block *sb, void *data, int silent)
 
     // finally we succeed
     sfat_blkholder_free(bh);
-    printk(KERN_INFO "SFAT: sfat_fill_super_impl success\n");
+    sfat_debugfs_mount(sb);
+    sfat_dbg(1, "SFAT: sfat_fill_super_impl success\n");
     return 0;
 
 out_release_root:
@@ -297,11 +490,144 @@ out_release_bh:
     sfat_blkholder_free(bh);
 
 out_release_sbi:
-    printk(KERN_INFO "SFAT: sfat_fill_super_impl out_release_sbi\n");
+    sfat_dbg(1, "SFAT: sfat_fill_super_impl out_release_sbi\n");
+    sfat_mcache_wb_stop(sb);
+    sfat_journal_release(sb);
+    sfat_mcache_destroy(sb);
+    sfat_heatmap_destroy(sb);
+    kfree(sbi->groups);
+    percpu_counter_destroy(&sbi->free_clusters);  // no-op if never set up
+    sfat_stats_destroy(sb);
     sb->s_fs_info = NULL;
     kfree(sbi);
     return error;
 }
 
+/*
+ * Desc: ask the device to make the data in its write cache durable
+ * Return:
+ *   0: success (or the device has no cache to flush)
+ *   < 0: error code
+ */
+int sfat_flush_device(struct super_block *sb)
+{
+    int error = blkdev_issue_flush(sb->s_bdev, NULL);
+
+    if (-EOPNOTSUPP == error)
+    {
+        return 0;
+    }
+    return error;
+}
+
+/*
+ * Desc: write all dirty metadata blocks back (sorted by block no.)
+ *   No cache flush is issued, the data may still be in the cache of
+ *   the device afterwards.
+ */
+static void sfat_write_super(struct super_block *sb)
+{
+    int error = 0;
+
+    lock_super(sb);
+    sb->s_dirt = 0;
+    error = sfat_mcache_write(sb, 0, SFAT_BLK_NONE, SFAT_BLK_NONE);
+    if (error)
+    {
+        sb->s_dirt = 1;  // try again next time
+        printk(KERN_ERR "sfat: sfat_write_super failed, error is %d\n", error);
+    }
+    unlock_super(sb);
+}
+
+/*
+ * Desc: called by sync(2) and unmount after the dirty inodes are written.
+ *   All dirty metadata blocks go to disk in one sorted batch, followed by
+ *   one cache flush when the caller waits (unless a journal commit has
+ *   flushed meanwhile).
+ * Return:
+ *   0: success
+ *   < 0: error code
+ */
+static int sfat_sync_fs(struct super_block *sb, int wait)
+{
+    unsigned long mark = sfat_journal_flush_mark(sb);
+    int error = 0;
+    int err = 0;
+
+    lock_super(sb);
+    sb->s_dirt = 0;
+    error = sfat_mcache_write(sb, 0, SFAT_BLK_NONE, SFAT_BLK_NONE);
+    if (error)
+    {
+        sb->s_dirt = 1;
+    }
+    unlock_super(sb);
+
+    if (wait && !sfat_journal_flushed_since(sb, mark))
+    {
+        err = sfat_flush_device(sb);
+        if (!error)
+        {
+            error = err;
+        }
+    }
+    return error;
+}
+
+/*
+ * Desc: release the in-memory structures of the volume
+ *   VFS has synced the volume before, anything dirtied since then is
+ *   written here.
+ */
+static void sfat_put_super(struct super_block *sb)
+{
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
 
+    sfat_dbg(1, "sfat: sfat_put_super\n");
 
+    sfat_mcache_wb_stop(sb);
+    if (sfat_sync_fs(sb, 1))
+    {
+        printk(KERN_ERR "sfat: metadata of %s may not be written back\n", sb->s_id);
+    }
+    sfat_journal_release(sb);
+
+    sfat_debugfs_umount(sb);
+    sfat_mcache_destroy(sb);
+    sfat_heatmap_destroy(sb);
+    kfree(sbi->groups);
+    percpu_counter_destroy(&sbi->free_clusters);
+    sfat_stats_destroy(sb);
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+}
+
+/*
+ * Desc: report the usage of the volume, O(1) since the numbers come
+ *   from the counters maintained by the allocator
+ *   One block of statfs is one cluster. The no. of files is unknown (0):
+ *   nothing keeps it on disk, and counting it would read every directory
+ *   of the volume at mount.
+ */
+static int sfat_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    struct sfat_sb_info *sbi = SFAT_SB(sb);
+    struct sfat_fs_info *fs_info = &sbi->fs_info;
+    u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+    unsigned long free_clusters = sfat_free_clusters(sbi);  // a snapshot is enough
+
+    buf->f_type = sb->s_magic;
+    buf->f_bsize = fs_info->cluster_size;
+    buf->f_blocks = fs_info->clusters;
+    buf->f_bfree = free_clusters;
+    buf->f_bavail = free_clusters;
+    buf->f_files = 0;
+    buf->f_ffree = 0;
+    buf->f_fsid.val[0] = (u32)id;
+    buf->f_fsid.val[1] = (u32)(id >> 32);
+    buf->f_namelen = SFAT_NAME_LEN;
+
+    return 0;
+}
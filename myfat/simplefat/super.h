@@ -5,5 +5,7 @@
 
 int sfat_fill_super_impl(struct super_block *sb, void *data, int silent);
 
+int sfat_flush_device(struct super_block *sb);
+
 #endif
 